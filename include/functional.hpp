@@ -67,6 +67,15 @@
 
 #include "functional_fake_sal2.hpp"
 
+#ifdef FUNCTIONAL_USE_SSE2
+//Compiler-provided intrinsics header, not a CRT one.
+#include <emmintrin.h>
+#endif //FUNCTIONAL_USE_SSE2
+
+#ifdef FUNCTIONAL_USE_AVX2
+#include <immintrin.h>
+#endif //FUNCTIONAL_USE_AVX2
+
 #ifdef FUNCTIONAL_DONT_INCLUDE_CONFIG
 #define FUNCTIONAL_HEAP_SIZE 2 * 1024 * 1024 * 512
 #define FUNCTIONAL_BLOCK_SIZE 4096
@@ -80,6 +89,57 @@
 #define FUNCTIONAL_BLOCK_SIZE 4096
 #endif //FUNCTIONAL_BLOCK_SIZE
 
+#ifndef FUNCTIONAL_HUGE_PAGE_SIZE
+#define FUNCTIONAL_HUGE_PAGE_SIZE 2 * 1024 * 1024
+#endif //FUNCTIONAL_HUGE_PAGE_SIZE
+
+#ifndef FUNCTIONAL_PAGE_SIZE
+#define FUNCTIONAL_PAGE_SIZE 4096
+#endif //FUNCTIONAL_PAGE_SIZE
+
+//The pool base is aligned to a huge page with FUNCTIONAL_ALLOCATOR_HUGE_PAGES, otherwise to a block.
+#ifdef FUNCTIONAL_ALLOCATOR_HUGE_PAGES
+#define FUNCTIONAL_ALLOCATOR_POOL_ALIGNMENT (FUNCTIONAL_HUGE_PAGE_SIZE)
+#else //FUNCTIONAL_ALLOCATOR_HUGE_PAGES
+#define FUNCTIONAL_ALLOCATOR_POOL_ALIGNMENT (FUNCTIONAL_BLOCK_SIZE)
+#endif //FUNCTIONAL_ALLOCATOR_HUGE_PAGES
+
+#ifndef FUNCTIONAL_ALLOCATOR_HEAP_COUNT
+#define FUNCTIONAL_ALLOCATOR_HEAP_COUNT 1
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT
+
+#ifndef FUNCTIONAL_ARENA_CHUNK_SIZE
+#define FUNCTIONAL_ARENA_CHUNK_SIZE 64 * 1024
+#endif //FUNCTIONAL_ARENA_CHUNK_SIZE
+
+#ifndef FUNCTIONAL_CONSTEXPR_SEED
+#define FUNCTIONAL_CONSTEXPR_SEED 0
+#endif //FUNCTIONAL_CONSTEXPR_SEED
+
+#ifndef FUNCTIONAL_FUNCTION_INLINE_SIZE
+#define FUNCTIONAL_FUNCTION_INLINE_SIZE 32
+#endif //FUNCTIONAL_FUNCTION_INLINE_SIZE
+
+#ifndef FUNCTIONAL_STRING_BUILDER_CHUNK_SIZE
+#define FUNCTIONAL_STRING_BUILDER_CHUNK_SIZE 64 * 1024
+#endif //FUNCTIONAL_STRING_BUILDER_CHUNK_SIZE
+
+#ifndef FUNCTIONAL_WRITER_BUFFER_SIZE
+#define FUNCTIONAL_WRITER_BUFFER_SIZE 8 * 1024
+#endif //FUNCTIONAL_WRITER_BUFFER_SIZE
+
+#ifndef FUNCTIONAL_CACHE_LINE_SIZE
+#define FUNCTIONAL_CACHE_LINE_SIZE 64
+#endif //FUNCTIONAL_CACHE_LINE_SIZE
+
+#ifndef FUNCTIONAL_LOG_RING_SIZE
+#define FUNCTIONAL_LOG_RING_SIZE 64 * 1024
+#endif //FUNCTIONAL_LOG_RING_SIZE
+
+#ifndef FUNCTIONAL_LOG_RECORD_SIZE
+#define FUNCTIONAL_LOG_RECORD_SIZE 4 * 1024
+#endif //FUNCTIONAL_LOG_RECORD_SIZE
+
 #define Q_NULL reinterpret_cast<void*>(0)
 
 inline namespace {
@@ -180,6 +240,10 @@ typedef CPointerSizeDetector<two_enable_if_t<sizeof(void*) == 4, unsigned int, u
 typedef functional_unsigned_size_t functional_uintptr_t;
 typedef functional_uintptr_t functional_ptrdiff_t;
 
+//Fixed width types for code that needs exactly 32/64 bits no matter what the pointer size is (hashes, RNG states &c).
+typedef unsigned int functional_uint32_t;
+typedef unsigned long long functional_uint64_t;
+
 //Simple constexpr bool. Though we don't use it ourselves. - xWhitey
 template<bool _Condition> using constexpr_bool = integral_constant<bool, _Condition>;
 /* Usage:
@@ -271,36 +335,36 @@ typedef struct CString {
 
 	CString(_In_ functional_unsigned_size_t _Length);
 
-	CString(_In_ CString& _Other) {
-		this->_m_lp_cStorage = _Other._m_lp_cStorage;
-		this->_m_iLength = _Other._m_iLength;
-	}
+	CString(_In_ CString& _Other) : CString(static_cast<const CString&>(_Other)) {}
 
 	CString(_In_ CString&& _Other) noexcept {
 		this->_m_lp_cStorage = _Other._m_lp_cStorage;
 		this->_m_iLength = _Other._m_iLength;
+		_Other._m_lp_cStorage = Q_nullptr;
+		_Other._m_iLength = 0;
 	}
 
-	CString(_In_ const CString& _Other) {
-		this->_m_lp_cStorage = _Other._m_lp_cStorage;
-		this->_m_iLength = _Other._m_iLength;
-	}
+	//Copies are deep: sharing the storage made both strings free it in their destructors.
+	CString(_In_ const CString& _Other);
 
-	CString(_In_ const CString&& _Other) noexcept {
-		this->_m_lp_cStorage = _Other._m_lp_cStorage;
-		this->_m_iLength = _Other._m_iLength;
-	}
+	CString(_In_ const CString&& _Other) : CString(static_cast<const CString&>(_Other)) {}
 
 	~CString();
 
-	CString& operator=(_In_ const CString& _Rhs) {
-		this->_m_lp_cStorage = _Rhs._m_lp_cStorage;
-		this->_m_iLength = _Rhs._m_iLength;
-	}
+	CString& operator=(_In_ const CString& _Rhs);
+
+	CString& operator=(_In_ CString&& _Rhs) noexcept {
+		if (this != &_Rhs) {
+			//A swap, our old text goes with _Rhs and is freed by its destructor.
+			char* storage = this->_m_lp_cStorage;
+			const functional_unsigned_size_t length = this->_m_iLength;
+			this->_m_lp_cStorage = _Rhs._m_lp_cStorage;
+			this->_m_iLength = _Rhs._m_iLength;
+			_Rhs._m_lp_cStorage = storage;
+			_Rhs._m_iLength = length;
+		}
 
-	CString& operator=(_In_ const CString&& _Rhs) noexcept {
-		this->_m_lp_cStorage = _Rhs._m_lp_cStorage;
-		this->_m_iLength = _Rhs._m_iLength;
+		return *this;
 	}
 
 	CString& operator=(_In_z_ const char* _String);
@@ -317,22 +381,27 @@ typedef struct CString {
 
 	CString& operator+(_In_ char _Character);
 
-	Q_bool operator==(_In_ CString& _Rhs);
+	Q_bool operator==(_In_ const CString& _Rhs) const;
 
-	Q_bool operator==(_In_ const char* _Rhs);
+	Q_bool operator==(_In_ const char* _Rhs) const;
 
-	Q_bool operator!=(_In_ CString& _Rhs);
+	Q_bool operator!=(_In_ const CString& _Rhs) const;
 
-	Q_bool operator!=(_In_ const char* _Rhs);
+	Q_bool operator!=(_In_ const char* _Rhs) const;
 
-	const char* c_str() {
+	const char* c_str() const {
 		return this->_m_lp_cStorage;
 	}
 
-	functional_unsigned_size_t length() {
+	functional_unsigned_size_t length() const {
 		return this->_m_iLength;
 	}
+
+	//Equals to Q_hash_string(c_str()), so it can be matched against Q_hash_literal("...") computed at compile time.
+	functional_uint64_t hash() const;
 private:
+	friend struct CStringBuilder;
+
 	char* _m_lp_cStorage = Q_nullptr;
 	functional_unsigned_size_t _m_iLength = 0;
 } CString, Q_string;
@@ -404,37 +473,642 @@ void* Q_memset(_Out_writes_bytes_all_(_Size) void* _Dst, _In_reads_bytes_(_Size)
 	return dest;
 }
 
+//Full 64x64 -> 128 bit multiplication. Returns the low half, stores the high one into _High.
+constexpr functional_uint64_t Q_mul128(_In_ functional_uint64_t _A, _In_ functional_uint64_t _B, _Out_ functional_uint64_t& _High) {
+#ifdef __SIZEOF_INT128__
+	const unsigned __int128 product = static_cast<unsigned __int128>(_A) * _B;
+	_High = static_cast<functional_uint64_t>(product >> 64);
+	return static_cast<functional_uint64_t>(product);
+#else
+	//No native 128 bit integer (MSVC, 32 bit targets): schoolbook multiplication on 32 bit halves.
+	const functional_uint64_t aLow = _A & 0xFFFFFFFF, aHigh = _A >> 32;
+	const functional_uint64_t bLow = _B & 0xFFFFFFFF, bHigh = _B >> 32;
+	const functional_uint64_t lowLow = aLow * bLow, lowHigh = aLow * bHigh, highLow = aHigh * bLow, highHigh = aHigh * bHigh;
+	const functional_uint64_t middle = (lowLow >> 32) + (lowHigh & 0xFFFFFFFF) + (highLow & 0xFFFFFFFF);
+	_High = highHigh + (lowHigh >> 32) + (highLow >> 32) + (middle >> 32);
+	return (middle << 32) | (lowLow & 0xFFFFFFFF);
+#endif //__SIZEOF_INT128__
+}
+
+//Multiplies and folds both halves of the product together. The core of our hash and also a good 64 bit mixer.
+constexpr functional_uint64_t Q_hash_mix(_In_ functional_uint64_t _A, _In_ functional_uint64_t _B) {
+	functional_uint64_t high = 0;
+	const functional_uint64_t low = Q_mul128(_A, _B, high);
+	return low ^ high;
+}
+
+//Cheap finalizer for integer keys (and pointers).
+constexpr functional_uint64_t Q_hash_integer(_In_ functional_uint64_t _Value) {
+	return Q_hash_mix(_Value ^ 0x2D358DCCAA6C78A5ull, 0x8BB84B93962EACC9ull);
+}
+
+//Byte readers are templated on the pointer type, so the very same kernel runs on 'const char*' in constant expressions
+//and on 'const unsigned char*' at runtime. Compilers fold these shifts into single loads.
+template<class _Byte> constexpr functional_uint64_t Q_hash_read64(_In_reads_(8) const _Byte* _Data) {
+	functional_uint64_t result = 0;
+	for (int idx = 7; idx >= 0; idx--) result = (result << 8) | static_cast<unsigned char>(_Data[idx]);
+	return result;
+}
+
+template<class _Byte> constexpr functional_uint64_t Q_hash_read32(_In_reads_(4) const _Byte* _Data) {
+	return static_cast<functional_uint64_t>(static_cast<unsigned char>(_Data[0])) | (static_cast<functional_uint64_t>(static_cast<unsigned char>(_Data[1])) << 8) |
+		(static_cast<functional_uint64_t>(static_cast<unsigned char>(_Data[2])) << 16) | (static_cast<functional_uint64_t>(static_cast<unsigned char>(_Data[3])) << 24);
+}
+
+//wyhash-style 64 bit kernel: 48 byte blocks are consumed by three independent multiply lanes so they run in parallel
+//(there is no 64x64 -> 128 multiply in SSE/AVX, so the lanes live in scalar registers), tails are read with overlapping loads.
+template<class _Byte> constexpr functional_uint64_t Q_hash_bytes_internal(_In_reads_(_Size) const _Byte* _Data, _In_ functional_uint64_t _Size, _In_ functional_uint64_t _Seed) {
+	constexpr functional_uint64_t secret[4] = { 0x2D358DCCAA6C78A5ull, 0x8BB84B93962EACC9ull, 0x4B33A62ED433D4A3ull, 0x4D5A2DA51DE1AA47ull };
+
+	_Seed ^= Q_hash_mix(_Seed ^ secret[0], secret[1]);
+	functional_uint64_t a = 0, b = 0;
+
+	if (_Size <= 16) {
+		if (_Size >= 4) {
+			const functional_uint64_t shift = (_Size >> 3) << 2;
+			a = (Q_hash_read32(_Data) << 32) | Q_hash_read32(_Data + shift);
+			b = (Q_hash_read32(_Data + _Size - 4) << 32) | Q_hash_read32(_Data + _Size - 4 - shift);
+		} else if (_Size > 0) {
+			a = (static_cast<functional_uint64_t>(static_cast<unsigned char>(_Data[0])) << 16) | (static_cast<functional_uint64_t>(static_cast<unsigned char>(_Data[_Size >> 1])) << 8) |
+				static_cast<unsigned char>(_Data[_Size - 1]);
+		}
+	} else {
+		functional_uint64_t left = _Size;
+		if (left > 48) {
+			functional_uint64_t lane1 = _Seed, lane2 = _Seed;
+			do {
+				_Seed = Q_hash_mix(Q_hash_read64(_Data) ^ secret[1], Q_hash_read64(_Data + 8) ^ _Seed);
+				lane1 = Q_hash_mix(Q_hash_read64(_Data + 16) ^ secret[2], Q_hash_read64(_Data + 24) ^ lane1);
+				lane2 = Q_hash_mix(Q_hash_read64(_Data + 32) ^ secret[3], Q_hash_read64(_Data + 40) ^ lane2);
+				_Data += 48;
+				left -= 48;
+			} while (left > 48);
+			_Seed ^= lane1 ^ lane2;
+		}
+		while (left > 16) {
+			_Seed = Q_hash_mix(Q_hash_read64(_Data) ^ secret[1], Q_hash_read64(_Data + 8) ^ _Seed);
+			_Data += 16;
+			left -= 16;
+		}
+		a = Q_hash_read64(_Data + left - 16);
+		b = Q_hash_read64(_Data + left - 8);
+	}
+
+	a ^= secret[1];
+	b ^= _Seed;
+	functional_uint64_t high = 0;
+	a = Q_mul128(a, b, high);
+	b = high;
+
+	return Q_hash_mix(a ^ secret[0] ^ _Size, b ^ secret[1]);
+}
+
+functional_uint64_t Q_hash_bytes(_In_reads_bytes_(_Size) const void* _Data, _In_ functional_unsigned_size_t _Size, _In_opt_ functional_uint64_t _Seed = 0) {
+	Q_SLOWASSERT((_Data || !_Size) && "Q_hash_bytes: What should I hash?");
+
+	return Q_hash_bytes_internal(static_cast<const unsigned char*>(_Data), _Size, _Seed);
+}
+
+//Gives the same value as Q_hash_bytes over the string's characters (without the null terminator). Usable in constant expressions.
+constexpr functional_uint64_t Q_hash_string(_In_z_ const char* _String, _In_opt_ functional_uint64_t _Seed = 0) {
+	functional_uint64_t length = 0;
+	while (_String[length] != '\0') ++length;
+
+	return Q_hash_bytes_internal(_String, length, _Seed);
+}
+
+//Compile-time hash of a string literal: constexpr auto id = Q_hash_literal("player.health");
+template<functional_unsigned_size_t _Size> constexpr functional_uint64_t Q_hash_literal(_In_z_ const char(&_Literal)[_Size], _In_opt_ functional_uint64_t _Seed = 0) {
+	return Q_hash_bytes_internal(_Literal, _Size - 1, _Seed);
+}
+
+int Q_memcmp(_In_reads_bytes_(_Size) const void* _Lhs, _In_reads_bytes_(_Size) const void* _Rhs, _In_ functional_unsigned_size_t _Size) {
+	auto lhs = static_cast<const unsigned char*>(_Lhs);
+	auto rhs = static_cast<const unsigned char*>(_Rhs);
+
+	Q_SLOWASSERT(((lhs && rhs) || !_Size) && "Q_memcmp: What should I compare?");
+
+	for (; _Size; --_Size, ++lhs, ++rhs) {
+		if (*lhs != *rhs) return *lhs < *rhs ? -1 : 1;
+	}
+
+	return 0;
+}
+
+//Index of the lowest set bit. _Value must be non-zero.
+inline int Q_count_trailing_zeros(_In_ functional_uint64_t _Value) {
+	Q_SLOWASSERT(_Value && "Q_count_trailing_zeros: result is undefined for zero");
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctzll(_Value);
+#else
+	int count = 0;
+	while (!(_Value & 1)) {
+		_Value >>= 1;
+		++count;
+	}
+	return count;
+#endif //__GNUC__ || __clang__
+}
+
+//Number of zero bits above the highest set bit. _Value must be non-zero.
+inline int Q_count_leading_zeros(_In_ functional_uint64_t _Value) {
+	Q_SLOWASSERT(_Value && "Q_count_leading_zeros: result is undefined for zero");
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_clzll(_Value);
+#else
+	int count = 0;
+	while (!(_Value & 0x8000000000000000ull)) {
+		_Value <<= 1;
+		++count;
+	}
+	return count;
+#endif //__GNUC__ || __clang__
+}
+
+//Atomics on top of the compiler builtins (no STL). They work on 4 and 8 byte integers and pointers.
+//Q_atomic_load is an acquire load, Q_atomic_store a release store, read-modify-write operations are acquire-release.
+#if defined(_MSC_VER) && !defined(__clang__)
+extern "C" long _InterlockedCompareExchange(long volatile* _Destination, long _Exchange, long _Comparand);
+extern "C" __int64 _InterlockedCompareExchange64(__int64 volatile* _Destination, __int64 _Exchange, __int64 _Comparand);
+extern "C" long _InterlockedExchangeAdd(long volatile* _Addend, long _Value);
+extern "C" __int64 _InterlockedExchangeAdd64(__int64 volatile* _Addend, __int64 _Value);
+extern "C" void _ReadWriteBarrier();
+#pragma intrinsic(_InterlockedCompareExchange, _InterlockedCompareExchange64, _InterlockedExchangeAdd, _InterlockedExchangeAdd64, _ReadWriteBarrier)
+#if defined(_M_ARM64)
+extern "C" void __dmb(unsigned int _Type);
+extern "C" void __yield();
+#pragma intrinsic(__dmb, __yield)
+//_ARM64_BARRIER_ISH from <arm64intr.h>, the inner shareable domain all our threads live in.
+#define FUNCTIONAL_ARM64_BARRIER_ISH 0xB
+#else //_M_ARM64
+extern "C" void _mm_pause();
+#pragma intrinsic(_mm_pause)
+#endif //_M_ARM64
+
+template<class _Ty, class _Bits> union UAtomicBits {
+	_Ty m_Value;
+	_Bits m_iBits;
+};
+#endif //_MSC_VER && !__clang__
+
+template<class _Ty> _Ty Q_atomic_load(_In_ const volatile _Ty* _Where) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __atomic_load_n(_Where, __ATOMIC_ACQUIRE);
+#elif defined(_M_ARM64)
+	//ARM64 lets later accesses pass the load, so it needs a barrier behind it. Volatile accesses are plain ones
+	//here (/volatile:iso is the default on ARM), under /volatile:ms the barrier is merely redundant.
+	_Ty value = *_Where;
+	__dmb(FUNCTIONAL_ARM64_BARRIER_ISH);
+	return value;
+#else
+	//x86/x64 loads already have acquire semantics, we only have to keep the compiler from reordering.
+	_Ty value = *_Where;
+	_ReadWriteBarrier();
+	return value;
+#endif //__GNUC__ || __clang__
+}
+
+template<class _Ty> _Ty Q_atomic_load_relaxed(_In_ const volatile _Ty* _Where) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __atomic_load_n(_Where, __ATOMIC_RELAXED);
+#else
+	return *_Where;
+#endif //__GNUC__ || __clang__
+}
+
+template<class _Ty> void Q_atomic_store(_Out_ volatile _Ty* _Where, _In_ _Ty _Value) {
+#if defined(__GNUC__) || defined(__clang__)
+	__atomic_store_n(_Where, _Value, __ATOMIC_RELEASE);
+#elif defined(_M_ARM64)
+	__dmb(FUNCTIONAL_ARM64_BARRIER_ISH);
+	*_Where = _Value;
+#else
+	_ReadWriteBarrier();
+	*_Where = _Value;
+#endif //__GNUC__ || __clang__
+}
+
+template<class _Ty> void Q_atomic_store_relaxed(_Out_ volatile _Ty* _Where, _In_ _Ty _Value) {
+#if defined(__GNUC__) || defined(__clang__)
+	__atomic_store_n(_Where, _Value, __ATOMIC_RELAXED);
+#else
+	*_Where = _Value;
+#endif //__GNUC__ || __clang__
+}
+
+//On failure _Expected receives the current value.
+template<class _Ty> Q_bool Q_atomic_compare_exchange(_Inout_ volatile _Ty* _Where, _Inout_ _Ty& _Expected, _In_ _Ty _Desired) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __atomic_compare_exchange_n(_Where, &_Expected, _Desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ? Q_TRUE : Q_FALSE;
+#else
+	static_assert(sizeof(_Ty) == 4 || sizeof(_Ty) == 8, "Q_atomic_compare_exchange supports 4 and 8 byte types only");
+	if constexpr (sizeof(_Ty) == 8) {
+		UAtomicBits<_Ty, __int64> expected, desired, previous;
+		expected.m_Value = _Expected;
+		desired.m_Value = _Desired;
+		previous.m_iBits = _InterlockedCompareExchange64(reinterpret_cast<__int64 volatile*>(_Where), desired.m_iBits, expected.m_iBits);
+		_Expected = previous.m_Value;
+		return previous.m_iBits == expected.m_iBits ? Q_TRUE : Q_FALSE;
+	} else {
+		UAtomicBits<_Ty, long> expected, desired, previous;
+		expected.m_Value = _Expected;
+		desired.m_Value = _Desired;
+		previous.m_iBits = _InterlockedCompareExchange(reinterpret_cast<long volatile*>(_Where), desired.m_iBits, expected.m_iBits);
+		_Expected = previous.m_Value;
+		return previous.m_iBits == expected.m_iBits ? Q_TRUE : Q_FALSE;
+	}
+#endif //__GNUC__ || __clang__
+}
+
+//Returns the value before the addition. Integers only.
+template<class _Ty> _Ty Q_atomic_fetch_add(_Inout_ volatile _Ty* _Where, _In_ _Ty _Delta) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __atomic_fetch_add(_Where, _Delta, __ATOMIC_ACQ_REL);
+#else
+	static_assert(sizeof(_Ty) == 4 || sizeof(_Ty) == 8, "Q_atomic_fetch_add supports 4 and 8 byte types only");
+	if constexpr (sizeof(_Ty) == 8) {
+		return static_cast<_Ty>(_InterlockedExchangeAdd64(reinterpret_cast<__int64 volatile*>(_Where), static_cast<__int64>(_Delta)));
+	} else {
+		return static_cast<_Ty>(_InterlockedExchangeAdd(reinterpret_cast<long volatile*>(_Where), static_cast<long>(_Delta)));
+	}
+#endif //__GNUC__ || __clang__
+}
+
+inline void Q_atomic_fence() {
+#if defined(__GNUC__) || defined(__clang__)
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#else
+	volatile long dummy = 0;
+	_InterlockedExchangeAdd(&dummy, 0);
+#endif //__GNUC__ || __clang__
+}
+
+//Tells the CPU we're spinning (PAUSE on x86), so the sibling hyper-thread gets the core meanwhile.
+inline void Q_cpu_relax() {
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+	__builtin_ia32_pause();
+#elif defined(_MSC_VER) && !defined(__clang__) && defined(_M_ARM64)
+	__yield();
+#elif defined(_MSC_VER) && !defined(__clang__)
+	_mm_pause();
+#endif
+}
+
+//Test-and-test-and-set lock for short critical sections.
+typedef struct CSpinLock {
+	CSpinLock() : _m_iLocked(0) {}
+
+	Q_bool TryLock() {
+		functional_uint32_t expected = 0;
+		return (Q_atomic_load_relaxed(&this->_m_iLocked) == 0 && Q_atomic_compare_exchange(&this->_m_iLocked, expected, 1u)) ? Q_TRUE : Q_FALSE;
+	}
+
+	void Lock() {
+		while (!this->TryLock()) {
+			while (Q_atomic_load_relaxed(&this->_m_iLocked)) Q_cpu_relax();
+		}
+	}
+
+	void Unlock() {
+		Q_atomic_store(&this->_m_iLocked, 0u);
+	}
+private:
+	volatile functional_uint32_t _m_iLocked;
+} CSpinLock;
+
+//Raw cycle counter (RDTSC on x86, CNTVCT on ARM64). Monotonic on anything modern, only meant for timestamps and entropy. 0 when unsupported.
+#if defined(_MSC_VER) && !defined(__clang__) && (defined(_M_IX86) || defined(_M_X64))
+extern "C" unsigned __int64 __rdtsc();
+#pragma intrinsic(__rdtsc)
+#endif //_MSC_VER && !__clang__ && (_M_IX86 || _M_X64)
+
+inline functional_uint64_t Q_read_cycle_counter() {
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+	return __builtin_ia32_rdtsc();
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+	functional_uint64_t value = 0;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+	return value;
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+#ifdef FUNCTIONAL_USE_LINUX_SYSCALLS
+//Direct Linux system calls, so the few OS services we can use (output, entropy, memory advice) don't need libc.
+#if defined(__x86_64__)
+enum {
+	Q_LINUX_SYS_WRITE = 1,
+	Q_LINUX_SYS_MADVISE = 28,
+	Q_LINUX_SYS_GETRANDOM = 318
+};
+
+inline long Q_linux_syscall(_In_ long _Number, _In_opt_ long _First = 0, _In_opt_ long _Second = 0, _In_opt_ long _Third = 0) {
+	long result = 0;
+	__asm__ volatile("syscall" : "=a"(result) : "a"(_Number), "D"(_First), "S"(_Second), "d"(_Third) : "rcx", "r11", "memory");
+	return result;
+}
+#elif defined(__aarch64__)
+enum {
+	Q_LINUX_SYS_WRITE = 64,
+	Q_LINUX_SYS_MADVISE = 233,
+	Q_LINUX_SYS_GETRANDOM = 278
+};
+
+inline long Q_linux_syscall(_In_ long _Number, _In_opt_ long _First = 0, _In_opt_ long _Second = 0, _In_opt_ long _Third = 0) {
+	register long x8 __asm__("x8") = _Number;
+	register long x0 __asm__("x0") = _First;
+	register long x1 __asm__("x1") = _Second;
+	register long x2 __asm__("x2") = _Third;
+	__asm__ volatile("svc 0" : "+r"(x0) : "r"(x8), "r"(x1), "r"(x2) : "memory");
+	return x0;
+}
+#else
+#error FUNCTIONAL_USE_LINUX_SYSCALLS is supported on x86_64 and aarch64 only.
+#endif //__x86_64__
+#endif //FUNCTIONAL_USE_LINUX_SYSCALLS
+
+//Snapshot/restore streams. Return Q_FALSE to abort, a reader must fill all _Size bytes.
+typedef Q_bool(*Q_allocator_writer_t)(_In_reads_bytes_(_Size) const void* _Data, _In_ functional_unsigned_size_t _Size, _In_opt_ void* _Context);
+typedef Q_bool(*Q_allocator_reader_t)(_Out_writes_bytes_all_(_Size) void* _Data, _In_ functional_unsigned_size_t _Size, _In_opt_ void* _Context);
+
+//Filled by Q_allocator_statistics. Bytes are whole blocks, headers included.
+typedef struct CAllocatorStatistics {
+	functional_unsigned_size_t m_iUsedBytes;
+	functional_unsigned_size_t m_iFreeBytes;
+	functional_unsigned_size_t m_iLargestFreeBytes;
+	//How far into the pool we've ever handed out memory, the pool's share of the RSS.
+	functional_unsigned_size_t m_iPeakFootprint;
+	functional_unsigned_size_t m_iSegments;
+	functional_unsigned_size_t m_iFreeSegments;
+
+	//0 when all free memory is one block, close to 1 when it's crumbs.
+	double Fragmentation() const {
+		return this->m_iFreeBytes ? 1.0 - static_cast<double>(this->m_iLargestFreeBytes) / static_cast<double>(this->m_iFreeBytes) : 0.0;
+	}
+} CAllocatorStatistics;
+
+typedef enum : unsigned int {
+	Q_ALLOCATION_MALLOC,
+	Q_ALLOCATION_FREE,
+	//m_iPointer is the new block, m_iOldPointer the one passed in.
+	Q_ALLOCATION_REALLOC
+} Q_allocation_op;
+
+//One traced call. Pointers are only ids: a replay maps them to its own blocks.
+typedef struct CAllocationRecord {
+	functional_uint64_t m_iTimestamp;
+	functional_uint64_t m_iPointer;
+	functional_uint64_t m_iOldPointer;
+	unsigned int m_iSize;
+	Q_allocation_op m_Op;
+} CAllocationRecord;
+
+#ifdef FUNCTIONAL_ALLOCATOR_TRACE
+#ifndef FUNCTIONAL_ALLOCATOR_TRACE_SIZE
+#define FUNCTIONAL_ALLOCATOR_TRACE_SIZE 4096
+#endif //FUNCTIONAL_ALLOCATOR_TRACE_SIZE
+
+//Gets the ring's records whenever it's full or flushed. It must not allocate through us: calls made meanwhile aren't traced
+//(with FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1 they'd wait for the drain to return, i.e forever).
+typedef void(*Q_allocation_drain_t)(_In_reads_(_Count) const CAllocationRecord* _Records, _In_ functional_unsigned_size_t _Count, _In_opt_ void* _Context);
+
+typedef struct CAllocationTrace {
+	CAllocationRecord m_a_Records[FUNCTIONAL_ALLOCATOR_TRACE_SIZE];
+	functional_unsigned_size_t m_iCount;
+	Q_allocation_drain_t m_lpDrain;
+	void* m_lpContext;
+	Q_bool m_bSuspended;
+#if FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+	//The heaps are used concurrently then, but there's only one ring.
+	CSpinLock m_Lock;
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+
+	void Record(_In_ Q_allocation_op _Op, _In_opt_ void* _Pointer, _In_opt_ void* _OldPointer, _In_ functional_unsigned_size_t _Size) {
+		this->Lock();
+		if (this->m_lpDrain && !this->m_bSuspended) {
+			CAllocationRecord& record = this->m_a_Records[this->m_iCount];
+			record.m_iTimestamp = Q_read_cycle_counter();
+			record.m_iPointer = static_cast<functional_uint64_t>(reinterpret_cast<functional_uintptr_t>(_Pointer));
+			record.m_iOldPointer = static_cast<functional_uint64_t>(reinterpret_cast<functional_uintptr_t>(_OldPointer));
+			record.m_iSize = static_cast<unsigned int>(_Size);
+			record.m_Op = _Op;
+			if (++this->m_iCount == FUNCTIONAL_ALLOCATOR_TRACE_SIZE) this->FlushLocked();
+		}
+		this->Unlock();
+	}
+
+	void Flush() {
+		this->Lock();
+		this->FlushLocked();
+		this->Unlock();
+	}
+
+	//Flushes what the old drain has buffered and switches to the new one.
+	void SetDrain(_In_opt_ Q_allocation_drain_t _Drain, _In_opt_ void* _Context) {
+		this->Lock();
+		this->FlushLocked();
+		this->m_lpDrain = _Drain;
+		this->m_lpContext = _Context;
+		this->Unlock();
+	}
+private:
+	void FlushLocked() {
+		if (!this->m_lpDrain || !this->m_iCount) return;
+
+		this->m_bSuspended = Q_TRUE;
+		this->m_lpDrain(this->m_a_Records, this->m_iCount, this->m_lpContext);
+		this->m_bSuspended = Q_FALSE;
+		this->m_iCount = 0;
+	}
+
+	void Lock() {
+#if FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+		this->m_Lock.Lock();
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+	}
+
+	void Unlock() {
+#if FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+		this->m_Lock.Unlock();
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+	}
+} CAllocationTrace;
+
+static CAllocationTrace gs_AllocationTrace;
+
+//Starts tracing into _Drain, 0 stops it (whatever's buffered is flushed to the old drain first).
+void Q_allocator_trace(_In_opt_ Q_allocation_drain_t _Drain, _In_opt_ void* _Context = Q_nullptr) {
+	gs_AllocationTrace.SetDrain(_Drain, _Context);
+}
+
+void Q_allocator_trace_flush() {
+	gs_AllocationTrace.Flush();
+}
+
+#define Q_TRACE_ALLOCATION(_Op, _Pointer, _OldPointer, _Size) gs_AllocationTrace.Record(_Op, _Pointer, _OldPointer, _Size)
+#else
+#define Q_TRACE_ALLOCATION(_Op, _Pointer, _OldPointer, _Size)
+#endif //FUNCTIONAL_ALLOCATOR_TRACE
+
 #ifndef FUNCTIONAL_NO_ALLOCATOR
 inline namespace YouShouldNotUseThisFunctional {
 	typedef struct CAllocatedSegment {
 		Q_bool m_bIsFree;
 		functional_size_t m_iSize;
+#ifdef FUNCTIONAL_ALLOCATOR_RELOCATABLE
+		//Byte offsets from the pool base, -1 for none. Go through CAllocator::Next/Previous.
+		functional_size_t m_iNext, m_iPrevious;
+#else
 		CAllocatedSegment* m_lpNext, * m_lpPrevious;
+#endif //FUNCTIONAL_ALLOCATOR_RELOCATABLE
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+		//Key ^ own offset in the pool ^ state: a stray write, a wild pointer or a second free all fail to decode.
+		functional_uint64_t m_iCanary;
+		functional_size_t m_iRequested;
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
 	} CAllocatedSegment;
 }
 
+//Every pointer we hand out sits right behind its segment header in a block aligned pool, so this (the lowest set bit of the header size) is what Q_malloc guarantees.
+#define FUNCTIONAL_MALLOC_ALIGNMENT (sizeof(CAllocatedSegment) & (0 - sizeof(CAllocatedSegment)))
+
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+#ifndef FUNCTIONAL_ALLOCATOR_REDZONE_SIZE
+#define FUNCTIONAL_ALLOCATOR_REDZONE_SIZE 16
+#endif //FUNCTIONAL_ALLOCATOR_REDZONE_SIZE
+#ifndef FUNCTIONAL_ALLOCATOR_QUARANTINE_SIZE
+#define FUNCTIONAL_ALLOCATOR_QUARANTINE_SIZE 256
+#endif //FUNCTIONAL_ALLOCATOR_QUARANTINE_SIZE
+//Bytes every allocation is padded with, only guard mode has a red zone. It starts right behind the block and is handled in whole
+//words, the first one partially masked, hence the extra word.
+#define FUNCTIONAL_ALLOCATOR_EFFECTIVE_REDZONE (((FUNCTIONAL_ALLOCATOR_REDZONE_SIZE + 7) & ~7) + 8)
+#else //FUNCTIONAL_ALLOCATOR_GUARD
+#define FUNCTIONAL_ALLOCATOR_EFFECTIVE_REDZONE 0
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
+
 typedef struct CAllocator {
+	//All heaps sit side by side in one function-local array, every call sets all of them up again.
 	static CAllocator* Init() {
-		static CAllocator allocator = CAllocator{};
-		allocator.ClearPool();
-		allocator._m_lpSegments = (CAllocatedSegment*)allocator._m_acMemoryPool;
-		allocator._m_lpSegments->m_bIsFree = Q_TRUE;
-		allocator._m_lpSegments->m_iSize = FUNCTIONAL_HEAP_SIZE / FUNCTIONAL_BLOCK_SIZE;
-		allocator._m_lpSegments->m_lpNext = Q_nullptr;
-		allocator._m_lpSegments->m_lpPrevious = Q_nullptr;
-		allocator._m_lpOldFreeSegment = Q_nullptr;
+		static CAllocator heaps[FUNCTIONAL_ALLOCATOR_HEAP_COUNT];
+		for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_HEAP_COUNT; idx++) heaps[idx].Reset(idx);
+
+		return heaps;
+	}
+
+	//The pool isn't cleared here: it's static storage, so it starts out zero, and the first touch is better left to whoever
+	//allocates from it (that's what puts the pages on their NUMA node). Q_clear_allocator clears it explicitly.
+	void Reset(_In_ functional_unsigned_size_t _Heap) {
+		this->_m_iHeap = _Heap;
+		//The array is oversized by one alignment unit, the pool starts at the first aligned address inside it.
+		const functional_uintptr_t pool = reinterpret_cast<functional_uintptr_t>(this->_m_acMemoryPool);
+		this->_m_lpPool = reinterpret_cast<char*>((pool + FUNCTIONAL_ALLOCATOR_POOL_ALIGNMENT - 1) & ~static_cast<functional_uintptr_t>(FUNCTIONAL_ALLOCATOR_POOL_ALIGNMENT - 1));
+#ifdef FUNCTIONAL_ALLOCATOR_HEAP_BIND
+		FUNCTIONAL_ALLOCATOR_HEAP_BIND(_Heap, this->_m_lpPool, FUNCTIONAL_HEAP_SIZE);
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_BIND
+#if defined(FUNCTIONAL_ALLOCATOR_HUGE_PAGES) && defined(FUNCTIONAL_USE_LINUX_SYSCALLS)
+		//MADV_HUGEPAGE before the first touch, so the faults already bring in huge pages.
+		Q_linux_syscall(Q_LINUX_SYS_MADVISE, reinterpret_cast<long>(this->_m_lpPool), FUNCTIONAL_HEAP_SIZE, 14);
+#endif //FUNCTIONAL_ALLOCATOR_HUGE_PAGES && FUNCTIONAL_USE_LINUX_SYSCALLS
+		this->_m_lpSegments = (CAllocatedSegment*)this->_m_lpPool;
+		this->_m_lpSegments->m_bIsFree = Q_TRUE;
+		this->_m_lpSegments->m_iSize = FUNCTIONAL_HEAP_SIZE / FUNCTIONAL_BLOCK_SIZE;
+		this->SetNext(this->_m_lpSegments, Q_nullptr);
+		this->SetPrevious(this->_m_lpSegments, Q_nullptr);
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+		this->_m_iGuardKey = Q_read_cycle_counter() ^ pool ^ 0x9E3779B97F4A7C15ull;
+		this->_m_iQuarantineHead = 0;
+		for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_QUARANTINE_SIZE; idx++) this->_m_a_lpQuarantine[idx] = Q_nullptr;
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
+		this->Seal(this->_m_lpSegments);
+		this->_m_lpOldFreeSegment = Q_nullptr;
+		this->_m_lpMaintainCursor = Q_nullptr;
+		this->_m_lpDecommittedFrom = this->_m_lpPool + FUNCTIONAL_HEAP_SIZE;
+		this->_m_lpHighWater = this->_m_lpPool;
+		for (functional_unsigned_size_t idx = 0; idx < m_iBinCount; idx++) this->_m_a_lpBins[idx] = Q_nullptr;
+	}
+
+	Q_bool Owns(_In_ const void* _Pointer) const {
+		return static_cast<const char*>(_Pointer) >= this->_m_lpPool && static_cast<const char*>(_Pointer) < this->_m_lpPool + FUNCTIONAL_HEAP_SIZE ? Q_TRUE : Q_FALSE;
+	}
+
+	//Only multi-heap builds lock, one heap is as thread-unsafe as it always was.
+	void Lock() {
+#if FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+		this->_m_Lock.Lock();
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+	}
 
-		return &allocator;
+	void Unlock() {
+#if FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+		this->_m_Lock.Unlock();
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
 	}
 
+	typedef struct CScopedLock {
+		CScopedLock(_In_ CAllocator* _Heap) : m_lpHeap(_Heap) {
+			_Heap->Lock();
+		}
+
+		~CScopedLock() {
+			this->m_lpHeap->Unlock();
+		}
+
+		CAllocator* m_lpHeap;
+	} CScopedLock;
+
 	void ClearPool() {
-		Q_memset(this->_m_acMemoryPool, 0, FUNCTIONAL_HEAP_SIZE);
+		Q_memset(this->_m_lpPool, 0, FUNCTIONAL_HEAP_SIZE);
+	}
+
+#ifdef FUNCTIONAL_ALLOCATOR_RELOCATABLE
+	CAllocatedSegment* FromOffset(_In_ functional_size_t _Offset) {
+		return _Offset < 0 ? Q_nullptr : reinterpret_cast<CAllocatedSegment*>(this->_m_lpPool + _Offset);
+	}
+
+	functional_size_t ToOffset(_In_opt_ CAllocatedSegment* _Segment) {
+		return _Segment ? static_cast<functional_size_t>(reinterpret_cast<char*>(_Segment) - this->_m_lpPool) : -1;
+	}
+
+	CAllocatedSegment* Next(_In_ CAllocatedSegment* _Segment) {
+		return FromOffset(_Segment->m_iNext);
+	}
+
+	CAllocatedSegment* Previous(_In_ CAllocatedSegment* _Segment) {
+		return FromOffset(_Segment->m_iPrevious);
+	}
+
+	void SetNext(_In_ CAllocatedSegment* _Segment, _In_opt_ CAllocatedSegment* _Next) {
+		_Segment->m_iNext = ToOffset(_Next);
+	}
+
+	void SetPrevious(_In_ CAllocatedSegment* _Segment, _In_opt_ CAllocatedSegment* _Previous) {
+		_Segment->m_iPrevious = ToOffset(_Previous);
+	}
+#else
+	CAllocatedSegment* Next(_In_ CAllocatedSegment* _Segment) {
+		return _Segment->m_lpNext;
+	}
+
+	CAllocatedSegment* Previous(_In_ CAllocatedSegment* _Segment) {
+		return _Segment->m_lpPrevious;
+	}
+
+	void SetNext(_In_ CAllocatedSegment* _Segment, _In_opt_ CAllocatedSegment* _Next) {
+		_Segment->m_lpNext = _Next;
+	}
+
+	void SetPrevious(_In_ CAllocatedSegment* _Segment, _In_opt_ CAllocatedSegment* _Previous) {
+		_Segment->m_lpPrevious = _Previous;
 	}
+#endif //FUNCTIONAL_ALLOCATOR_RELOCATABLE
 
 	CAllocatedSegment* SearchFreeSegment(_In_ CAllocatedSegment* _Segment, _In_ functional_size_t _MinSize) {
 		while (_Segment) {
 			if (_Segment->m_bIsFree && _Segment->m_iSize >= _MinSize) return _Segment;
-			_Segment = _Segment->m_lpNext;
+			_Segment = Next(_Segment);
 		}
 		return _Segment;
 	}
@@ -444,25 +1118,27 @@ typedef struct CAllocator {
 		return size / FUNCTIONAL_BLOCK_SIZE;
 	}
 
-	CAllocatedSegment* CutSegment(_In_ CAllocatedSegment* _Segment, _In_ functional_size_t _Size) {
+	//Splits the last _Size blocks off _Segment, sealed with their own state.
+	CAllocatedSegment* CutSegment(_In_ CAllocatedSegment* _Segment, _In_ functional_size_t _Size, _In_ Q_bool _IsFree) {
 		functional_uintptr_t addr = reinterpret_cast<functional_uintptr_t>(_Segment);
 		addr += (_Segment->m_iSize - _Size) * FUNCTIONAL_BLOCK_SIZE;
 		CAllocatedSegment* result = (CAllocatedSegment*)addr;
 		_Segment->m_iSize -= _Size;
 		result->m_iSize = _Size;
-		result->m_lpPrevious = _Segment;
-		result->m_lpNext = _Segment->m_lpNext;
-		if (_Segment->m_lpNext) _Segment->m_lpNext->m_lpPrevious = result;
-		_Segment->m_lpNext = result;
-		result->m_bIsFree = _Segment->m_bIsFree;
+		SetPrevious(result, _Segment);
+		SetNext(result, Next(_Segment));
+		if (Next(_Segment)) SetPrevious(Next(_Segment), result);
+		SetNext(_Segment, result);
+		result->m_bIsFree = _IsFree;
+		Seal(result);
 		return result;
 	}
 
 	CAllocatedSegment* MergeSegment(_In_ CAllocatedSegment* _Segment, _In_ CAllocatedSegment* _OldSegment) {
-		if (this->_m_lpOldFreeSegment == _OldSegment) this->_m_lpOldFreeSegment = _Segment;
+		ForgetSegment(_OldSegment, _Segment);
 		_Segment->m_iSize += _OldSegment->m_iSize;
-		_Segment->m_lpNext = _OldSegment->m_lpNext;
-		if (_OldSegment->m_lpNext) _OldSegment->m_lpNext->m_lpPrevious = _Segment;
+		SetNext(_Segment, Next(_OldSegment));
+		if (Next(_OldSegment)) SetPrevious(Next(_OldSegment), _Segment);
 
 		return _Segment;
 	}
@@ -480,8 +1156,9 @@ typedef struct CAllocator {
 	}
 
 	void* Allocate(_In_ functional_size_t _Size) {
-		int s = GetNumBlock(_Size + sizeof(CAllocatedSegment));
-		CAllocatedSegment* it = SearchFreeSegment(this->_m_lpOldFreeSegment, s);
+		int s = GetNumBlock(_Size + sizeof(CAllocatedSegment) + FUNCTIONAL_ALLOCATOR_EFFECTIVE_REDZONE);
+		CAllocatedSegment* it = SearchBins(s);
+		if (!it) it = SearchFreeSegment(this->_m_lpOldFreeSegment, s);
 		if (!it) it = SearchFreeSegment(this->_m_lpSegments, s);
 		if (!it) {
 			return Q_nullptr;
@@ -490,22 +1167,233 @@ typedef struct CAllocator {
 		it->m_bIsFree = Q_FALSE;
 
 		if (it->m_iSize > s + GetNumBlock(sizeof(CAllocatedSegment))) {
-			CAllocatedSegment* n = CutSegment(it, it->m_iSize - s);
-			n->m_bIsFree = Q_TRUE;
+			CAllocatedSegment* n = CutSegment(it, it->m_iSize - s, Q_TRUE);
 			this->_m_lpOldFreeSegment = n;
+			RememberFree(n);
 		}
+		Recommitted(it);
+		Arm(it, _Size);
 
 		return SegmentToPtr(it);
 	}
 
+	//Image layout: CImageHeader, the quarantine ring as pool offsets (guard mode only), then the pool up to the block past the
+	//high water mark. Nothing above that was ever handed out, so it's all one free segment whose header is in the image.
+	Q_bool Snapshot(_In_ Q_allocator_writer_t _Writer, _In_opt_ void* _Context) {
+		CImageHeader header = this->ImageHeader();
+		if (!_Writer(&header, sizeof(header), _Context)) return Q_FALSE;
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+		functional_uint64_t quarantine[FUNCTIONAL_ALLOCATOR_QUARANTINE_SIZE];
+		for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_QUARANTINE_SIZE; idx++) {
+			quarantine[idx] = this->_m_a_lpQuarantine[idx] ? static_cast<functional_uint64_t>(static_cast<char*>(this->_m_a_lpQuarantine[idx]) - this->_m_lpPool) : ~0ull;
+		}
+		if (!_Writer(quarantine, sizeof(quarantine), _Context)) return Q_FALSE;
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
+
+		return _Writer(this->_m_lpPool, static_cast<functional_unsigned_size_t>(header.m_iExtent), _Context);
+	}
+
+	//Everything allocated before is gone afterwards. An image from another build configuration is refused, and without
+	//FUNCTIONAL_ALLOCATOR_RELOCATABLE so is one taken at another pool address. A read failing halfway leaves an empty heap.
+	Q_bool Restore(_In_ Q_allocator_reader_t _Reader, _In_opt_ void* _Context) {
+		CImageHeader header;
+		if (!_Reader(&header, sizeof(header), _Context)) return Q_FALSE;
+
+		const CImageHeader expected = this->ImageHeader();
+		if (header.m_iMagic != expected.m_iMagic || header.m_iVersion != expected.m_iVersion || header.m_iHeapSize != expected.m_iHeapSize ||
+			header.m_iBlockSize != expected.m_iBlockSize || header.m_iSegmentSize != expected.m_iSegmentSize || header.m_iFlags != expected.m_iFlags ||
+			header.m_iExtent > FUNCTIONAL_HEAP_SIZE || header.m_iHighWater > header.m_iExtent) return Q_FALSE;
+#ifndef FUNCTIONAL_ALLOCATOR_RELOCATABLE
+		if (header.m_iBase != expected.m_iBase) return Q_FALSE;
+#endif //FUNCTIONAL_ALLOCATOR_RELOCATABLE
+
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+		functional_uint64_t quarantine[FUNCTIONAL_ALLOCATOR_QUARANTINE_SIZE];
+		if (!_Reader(quarantine, sizeof(quarantine), _Context)) return Q_FALSE;
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
+
+		if (!_Reader(this->_m_lpPool, static_cast<functional_unsigned_size_t>(header.m_iExtent), _Context)) {
+			this->Reset(this->_m_iHeap);
+			return Q_FALSE;
+		}
+
+		this->_m_lpOldFreeSegment = Q_nullptr;
+		this->_m_lpMaintainCursor = Q_nullptr;
+		for (functional_unsigned_size_t idx = 0; idx < m_iBinCount; idx++) this->_m_a_lpBins[idx] = Q_nullptr;
+		this->_m_lpDecommittedFrom = this->_m_lpPool + FUNCTIONAL_HEAP_SIZE;
+		this->_m_lpHighWater = this->_m_lpPool + header.m_iHighWater;
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+		this->_m_iGuardKey = header.m_iGuardKey;
+		this->_m_iQuarantineHead = static_cast<functional_unsigned_size_t>(header.m_iQuarantineHead % FUNCTIONAL_ALLOCATOR_QUARANTINE_SIZE);
+		for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_QUARANTINE_SIZE; idx++) {
+			this->_m_a_lpQuarantine[idx] = quarantine[idx] < header.m_iExtent ? this->_m_lpPool + quarantine[idx] : Q_nullptr;
+		}
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
+
+		return Q_TRUE;
+	}
+
+	//Walks the whole segment list, don't call it on a hot path.
+	void Statistics(_Out_ CAllocatorStatistics& _Statistics) {
+		Q_memset(&_Statistics, 0, sizeof(_Statistics));
+		for (CAllocatedSegment* it = this->_m_lpSegments; it; it = Next(it)) {
+			const functional_unsigned_size_t bytes = static_cast<functional_unsigned_size_t>(it->m_iSize) * FUNCTIONAL_BLOCK_SIZE;
+			_Statistics.m_iSegments++;
+			if (it->m_bIsFree) {
+				_Statistics.m_iFreeSegments++;
+				_Statistics.m_iFreeBytes += bytes;
+				if (bytes > _Statistics.m_iLargestFreeBytes) _Statistics.m_iLargestFreeBytes = bytes;
+			} else {
+				_Statistics.m_iUsedBytes += bytes;
+			}
+		}
+		_Statistics.m_iPeakFootprint = static_cast<functional_unsigned_size_t>(this->_m_lpHighWater - this->_m_lpPool);
+	}
+
+	//One bounded slice of housekeeping, meant for idle time: visits at most _Budget segments (merges count too) from where
+	//the previous call stopped, merges free runs, refreshes the size bins and decommits a free tail of the pool.
+	//Returns Q_TRUE once a whole pass over the pool is done.
+	Q_bool Maintain(_In_ functional_size_t _Budget) {
+		CAllocatedSegment* it = this->_m_lpMaintainCursor ? this->_m_lpMaintainCursor : this->_m_lpSegments;
+
+		while (it && _Budget-- > 0) {
+			if (it->m_bIsFree) {
+				while (Next(it) && Next(it)->m_bIsFree && _Budget > 0) {
+					MergeSegment(it, Next(it));
+					_Budget--;
+				}
+				RememberFree(it);
+				if (!Next(it)) DecommitTail(it);
+			}
+			it = Next(it);
+		}
+		this->_m_lpMaintainCursor = it;
+
+		return it ? Q_FALSE : Q_TRUE;
+	}
+
 	void Free(_In_ void* _Pointer) {
 		if (!_Pointer) return;
 		CAllocatedSegment* segment = PtrToSegment(_Pointer);
-		segment->m_bIsFree = Q_TRUE;
-		Q_memset(_Pointer, 0, segment->m_iSize);
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+		//The block sits in quarantine for a while, whatever gets evicted is what we really free now.
+		segment = Quarantine(segment);
+		if (!segment) return;
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
+		ReleaseSegment(segment);
+
+		if (Next(segment) && Next(segment)->m_bIsFree) MergeSegment(segment, Next(segment));
+		if (Previous(segment) && Previous(segment)->m_bIsFree) segment = MergeSegment(Previous(segment), segment);
+		RememberFree(segment);
+	}
+
+	//_Size may be anything from what was asked for up to UsableSize. The header already knows the size, we only use it to catch mismatched frees.
+	void FreeSized(_In_ void* _Pointer, _In_ functional_size_t _Size) {
+		if (!_Pointer) return;
+		Q_SLOWASSERT(static_cast<functional_unsigned_size_t>(_Size) <= UsableSize(_Pointer) && "Size mismatch at CAllocator::FreeSized");
+		(void)_Size;
+
+		Free(_Pointer);
+	}
+
+	//Carves _Count equal segments out of one free run, so the search and the split happen once.
+	//Falls back to one by one allocation when there's no run that big. Returns how many pointers were stored into _Out.
+	functional_size_t AllocateBatch(_In_ functional_size_t _Size, _In_ functional_size_t _Count, _Out_writes_(_Count) void** _Out) {
+		if (_Count <= 0) return 0;
+
+		const functional_size_t s = GetNumBlock(_Size + sizeof(CAllocatedSegment) + FUNCTIONAL_ALLOCATOR_EFFECTIVE_REDZONE);
+		const functional_size_t total = s * _Count;
+		CAllocatedSegment* it = SearchFreeSegment(this->_m_lpOldFreeSegment, total);
+		if (!it) it = SearchFreeSegment(this->_m_lpSegments, total);
+		if (!it) {
+			for (functional_size_t idx = 0; idx < _Count; idx++) {
+				_Out[idx] = Allocate(_Size);
+				if (!_Out[idx]) return idx;
+			}
+
+			return _Count;
+		}
+
+		it->m_bIsFree = Q_FALSE;
+
+		if (it->m_iSize > total + GetNumBlock(sizeof(CAllocatedSegment))) {
+			CAllocatedSegment* n = CutSegment(it, it->m_iSize - total, Q_TRUE);
+			this->_m_lpOldFreeSegment = n;
+			RememberFree(n);
+		}
+		Recommitted(it);
+
+		//Split the run front to back, the last segment keeps whatever slack the run had.
+		for (functional_size_t idx = 0; idx < _Count - 1; idx++) {
+			CAllocatedSegment* next = (CAllocatedSegment*)(reinterpret_cast<char*>(it) + s * FUNCTIONAL_BLOCK_SIZE);
+			next->m_bIsFree = Q_FALSE;
+			next->m_iSize = it->m_iSize - s;
+			SetPrevious(next, it);
+			SetNext(next, Next(it));
+			if (Next(it)) SetPrevious(Next(it), next);
+			SetNext(it, next);
+			it->m_iSize = s;
+			Arm(it, _Size);
+			_Out[idx] = SegmentToPtr(it);
+			it = next;
+		}
+		Arm(it, _Size);
+		_Out[_Count - 1] = SegmentToPtr(it);
+
+		return _Count;
+	}
+
+	//Sorts _Pointers by address (the array is reordered) so neighbours freed together are linked out as one run
+	//instead of being merged one by one. Nullptrs are skipped.
+	void FreeBatch(_Inout_updates_(_Count) void** _Pointers, _In_ functional_size_t _Count) {
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+		//Everything has to go through the checks and the quarantine anyway.
+		for (functional_size_t idx = 0; idx < _Count; idx++) Free(_Pointers[idx]);
+		return;
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
+		SortPointers(_Pointers, _Count);
+
+		functional_size_t idx = 0;
+		while (idx < _Count && !_Pointers[idx]) idx++;
+
+		while (idx < _Count) {
+			CAllocatedSegment* head = PtrToSegment(_Pointers[idx]);
+			ReleaseSegment(head);
+			CAllocatedSegment* tail = head;
+			functional_size_t blocks = head->m_iSize;
+
+			//Swallow every following pointer whose segment is the very next one.
+			for (idx++; idx < _Count && PtrToSegment(_Pointers[idx]) == Next(tail); idx++) {
+				tail = Next(tail);
+				ReleaseSegment(tail);
+				blocks += tail->m_iSize;
+				ForgetSegment(tail, head);
+			}
+
+			if (tail != head) {
+				head->m_iSize = blocks;
+				SetNext(head, Next(tail));
+				if (Next(tail)) SetPrevious(Next(tail), head);
+			}
+
+			if (Next(head) && Next(head)->m_bIsFree) MergeSegment(head, Next(head));
+			if (Previous(head) && Previous(head)->m_bIsFree) head = MergeSegment(Previous(head), head);
+			RememberFree(head);
+		}
+	}
 
-		if (segment->m_lpNext && segment->m_lpNext->m_bIsFree) MergeSegment(segment, segment->m_lpNext);
-		if (segment->m_lpPrevious && segment->m_lpPrevious->m_bIsFree) MergeSegment(segment->m_lpPrevious, segment);
+	//How many bytes the caller may really use: the whole segment minus its header.
+	//In guard mode that's exactly what was asked for, the rest belongs to the red zone.
+	functional_unsigned_size_t UsableSize(_In_ void* _Pointer) {
+		if (!_Pointer) return 0;
+
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+		CAllocatedSegment* segment = PtrToSegment(_Pointer);
+		Verify(segment, m_iStateLive, "Q_malloc_usable_size on a pointer we don't own");
+		return static_cast<functional_unsigned_size_t>(segment->m_iRequested);
+#else
+		return PtrToSegment(_Pointer)->m_iSize * FUNCTIONAL_BLOCK_SIZE - sizeof(CAllocatedSegment);
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
 	}
 
 	void* Reallocate(_In_ void* _Pointer, _In_ functional_size_t _Size) {
@@ -515,22 +1403,34 @@ typedef struct CAllocator {
 			return Q_nullptr;
 		}
 
+		if (!_Pointer) return Allocate(_Size);
+
 		CAllocatedSegment* segment = PtrToSegment(_Pointer);
-		int block = GetNumBlock(_Size + sizeof(CAllocatedSegment));
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+		Verify(segment, m_iStateLive, "Q_realloc on a freed or foreign pointer");
+		VerifyRedZone(segment);
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
+		int block = GetNumBlock(_Size + sizeof(CAllocatedSegment) + FUNCTIONAL_ALLOCATOR_EFFECTIVE_REDZONE);
 		if (segment->m_iSize >= block) {
+			Arm(segment, _Size);
 			return _Pointer;
 		} else {
-			if (segment->m_lpNext && segment->m_lpNext->m_bIsFree && segment->m_iSize + segment->m_lpNext->m_iSize >= block) {
-				MergeSegment(segment, segment->m_lpNext);
+			if (Next(segment) && Next(segment)->m_bIsFree && segment->m_iSize + Next(segment)->m_iSize >= block) {
+				MergeSegment(segment, Next(segment));
 				if (segment->m_iSize > block + GetNumBlock(sizeof(CAllocatedSegment))) {
-					CAllocatedSegment* n = CutSegment(segment, segment->m_iSize - block);
-					n->m_bIsFree = Q_TRUE;
+					CAllocatedSegment* n = CutSegment(segment, segment->m_iSize - block, Q_TRUE);
+					RememberFree(n);
 				}
+				Recommitted(segment);
+				Arm(segment, _Size);
 
 				return _Pointer;
 			} else {
 				auto storage = Allocate(_Size);
-				Q_memcpy(storage, _Pointer, _Size);
+				//Leave the old block alone when we're out of memory, like realloc does.
+				if (!storage) return Q_nullptr;
+				const functional_size_t usable = static_cast<functional_size_t>(UsableSize(_Pointer));
+				Q_memcpy(storage, _Pointer, static_cast<unsigned int>(usable < _Size ? usable : _Size));
 				Free(_Pointer);
 
 				return storage;
@@ -538,46 +1438,487 @@ typedef struct CAllocator {
 		}
 	}
 private:
-	CAllocator() {
-		Q_memset(this->_m_acMemoryPool, 0, Q_ARRAYSIZE(this->_m_acMemoryPool));
-		this->_m_lpSegments = Q_nullptr;
-		this->_m_lpOldFreeSegment = Q_nullptr;
+	typedef struct CImageHeader {
+		functional_uint64_t m_iMagic, m_iVersion;
+		//The image must come from the same configuration.
+		functional_uint64_t m_iHeapSize, m_iBlockSize, m_iSegmentSize, m_iFlags;
+		functional_uint64_t m_iBase, m_iExtent, m_iHighWater;
+		functional_uint64_t m_iGuardKey, m_iQuarantineHead;
+	} CImageHeader;
+
+	CImageHeader ImageHeader() {
+		CImageHeader header;
+		Q_memset(&header, 0, sizeof(header));
+		header.m_iMagic = 0x50414548434E5546ull; //"FUNCHEAP"
+		header.m_iVersion = 1;
+		header.m_iHeapSize = FUNCTIONAL_HEAP_SIZE;
+		header.m_iBlockSize = FUNCTIONAL_BLOCK_SIZE;
+		header.m_iSegmentSize = sizeof(CAllocatedSegment);
+#ifdef FUNCTIONAL_ALLOCATOR_RELOCATABLE
+		header.m_iFlags |= 1;
+#endif //FUNCTIONAL_ALLOCATOR_RELOCATABLE
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+		header.m_iFlags |= 2;
+		header.m_iGuardKey = this->_m_iGuardKey;
+		header.m_iQuarantineHead = this->_m_iQuarantineHead;
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
+		header.m_iBase = static_cast<functional_uint64_t>(reinterpret_cast<functional_uintptr_t>(this->_m_lpPool));
+		header.m_iHighWater = static_cast<functional_uint64_t>(this->_m_lpHighWater - this->_m_lpPool);
+		header.m_iExtent = header.m_iHighWater + FUNCTIONAL_BLOCK_SIZE < FUNCTIONAL_HEAP_SIZE ? header.m_iHighWater + FUNCTIONAL_BLOCK_SIZE : FUNCTIONAL_HEAP_SIZE;
+
+		return header;
 	}
-		 
-	char _m_acMemoryPool[FUNCTIONAL_HEAP_SIZE];
-	CAllocatedSegment* _m_lpSegments;
-	CAllocatedSegment* _m_lpOldFreeSegment;
-} CAllocator;
 
-static CAllocator* gs_lpAllocator = CAllocator::Init();
+	//Size bins: _m_a_lpBins[n] remembers some free segment of 2^n .. 2^(n+1) - 1 blocks. They're only hints,
+	//so they may go stale (allocated since), but never dangle: ForgetSegment redirects them away from merged headers.
+	static constexpr functional_unsigned_size_t m_iBinCount = sizeof(functional_size_t) * 8;
 
-void* Q_malloc(_In_ functional_size_t _Size) {
-	if (!gs_lpAllocator || reinterpret_cast<functional_uintptr_t>(gs_lpAllocator) == 1) gs_lpAllocator = CAllocator::Init();
+	static functional_unsigned_size_t BinOf(_In_ functional_size_t _Blocks) {
+		functional_unsigned_size_t bin = 0;
+		while (_Blocks >>= 1) bin++;
+		return bin;
+	}
 
-	return gs_lpAllocator->Allocate(_Size);
-}
+	void RememberFree(_In_ CAllocatedSegment* _Segment) {
+		this->_m_a_lpBins[BinOf(_Segment->m_iSize)] = _Segment;
+	}
 
-void Q_free(_In_ void* _Pointer) {
-	//How did you manage to use free without initializing the allocator, huh?
-	//Is your code bugsafe/bugless?
-	Q_SLOWASSERT(gs_lpAllocator && reinterpret_cast<functional_uintptr_t>(gs_lpAllocator) != 1);
-	if (!gs_lpAllocator || reinterpret_cast<functional_uintptr_t>(gs_lpAllocator) == 1) gs_lpAllocator = CAllocator::Init();
+	CAllocatedSegment* SearchBins(_In_ functional_size_t _MinSize) {
+		for (functional_unsigned_size_t bin = BinOf(_MinSize); bin < m_iBinCount; bin++) {
+			CAllocatedSegment* it = this->_m_a_lpBins[bin];
+			if (it && it->m_bIsFree && it->m_iSize >= _MinSize) return it;
+		}
+		return Q_nullptr;
+	}
 
-	gs_lpAllocator->Free(_Pointer);
-}
+	//_OldSegment's header is about to become the middle of _Segment, so nothing may point at it anymore.
+	void ForgetSegment(_In_ CAllocatedSegment* _OldSegment, _In_ CAllocatedSegment* _Segment) {
+		if (this->_m_lpOldFreeSegment == _OldSegment) this->_m_lpOldFreeSegment = _Segment;
+		if (this->_m_lpMaintainCursor == _OldSegment) this->_m_lpMaintainCursor = _Segment;
+		for (functional_unsigned_size_t bin = 0; bin < m_iBinCount; bin++) {
+			if (this->_m_a_lpBins[bin] == _OldSegment) this->_m_a_lpBins[bin] = _Segment;
+		}
+	}
 
-void* Q_realloc(_In_ void* _Pointer, _In_ functional_size_t _Size) {
-	//How did you manage to use realloc without initializing the allocator, huh?
+	//Gives the whole pages behind the last segment's header back to the page source. They read as zero when touched again,
+	//so nothing has to be recommitted, we only track how far down the pool is decommitted to not repeat ourselves.
+	void DecommitTail(_In_ CAllocatedSegment* _Segment) {
+		//Blocks can be smaller than a page and the pool end needn't sit on one either, madvise only takes whole pages.
+		const functional_uintptr_t page = FUNCTIONAL_PAGE_SIZE;
+		char* from = reinterpret_cast<char*>((reinterpret_cast<functional_uintptr_t>(_Segment) + FUNCTIONAL_BLOCK_SIZE + page - 1) & ~(page - 1));
+		char* to = reinterpret_cast<char*>(reinterpret_cast<functional_uintptr_t>(this->_m_lpDecommittedFrom) & ~(page - 1));
+		if (from >= to) return;
+
+#if defined(FUNCTIONAL_ALLOCATOR_DECOMMIT)
+		if (FUNCTIONAL_ALLOCATOR_DECOMMIT(from, static_cast<functional_unsigned_size_t>(to - from)) != 0) return;
+#elif defined(FUNCTIONAL_USE_LINUX_SYSCALLS)
+		if (Q_linux_syscall(Q_LINUX_SYS_MADVISE, reinterpret_cast<long>(from), static_cast<long>(to - from), 4 /*MADV_DONTNEED*/) != 0) return;
+#else
+		return;
+#endif //FUNCTIONAL_ALLOCATOR_DECOMMIT
+		this->_m_lpDecommittedFrom = from;
+	}
+
+	void Recommitted(_In_ CAllocatedSegment* _Segment) {
+		char* end = reinterpret_cast<char*>(_Segment) + _Segment->m_iSize * FUNCTIONAL_BLOCK_SIZE;
+		if (end > this->_m_lpDecommittedFrom) this->_m_lpDecommittedFrom = end;
+		if (end > this->_m_lpHighWater) this->_m_lpHighWater = end;
+	}
+
+	void ReleaseSegment(_In_ CAllocatedSegment* _Segment) {
+		_Segment->m_bIsFree = Q_TRUE;
+		Seal(_Segment);
+		Q_memset(SegmentToPtr(_Segment), 0, _Segment->m_iSize);
+	}
+
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+	static constexpr functional_uint64_t m_iStateFree = 0xF4EEF4EEF4EEF4EEull;
+	static constexpr functional_uint64_t m_iStateLive = 0x11FE11FE11FE11FEull;
+	static constexpr functional_uint64_t m_iStateQuarantined = 0xDEADDEADDEADDEADull;
+	static constexpr functional_uint64_t m_iRedZoneWord = 0xFDFDFDFDFDFDFDFDull;
+	static constexpr functional_unsigned_size_t m_iRedZoneWords = (FUNCTIONAL_ALLOCATOR_REDZONE_SIZE + 7) / 8;
+	static constexpr functional_uint64_t m_iPoisonWord = 0xDDDDDDDDDDDDDDDDull;
+	//Only this many leading words of a quarantined block are poisoned and checked, it keeps the overhead flat for big blocks.
+	static constexpr functional_unsigned_size_t m_iPoisonWords = 8;
+
+	//Doesn't allocate or format anything, the heap is exactly what we can't trust here.
+	static void GuardFailure(_In_z_ const char* _Reason, _In_ void* _Pointer) {
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD_FAILED
+		FUNCTIONAL_ALLOCATOR_GUARD_FAILED(_Reason, _Pointer);
+#else
+		(void)_Pointer;
+		gs_lpszAssertionFailureReason = _Reason;
+		*((volatile unsigned int*)0) = 0xCAFE;
+#endif //FUNCTIONAL_ALLOCATOR_GUARD_FAILED
+	}
+
+	//Offset rather than address so canaries survive a snapshot restored elsewhere.
+	functional_uint64_t StateOf(_In_ CAllocatedSegment* _Segment) {
+		return _Segment->m_iCanary ^ this->_m_iGuardKey ^ static_cast<functional_uint64_t>(reinterpret_cast<char*>(_Segment) - this->_m_lpPool);
+	}
+
+	void Seal(_In_ CAllocatedSegment* _Segment, _In_ functional_uint64_t _State) {
+		_Segment->m_iCanary = this->_m_iGuardKey ^ static_cast<functional_uint64_t>(reinterpret_cast<char*>(_Segment) - this->_m_lpPool) ^ _State;
+	}
+
+	void Seal(_In_ CAllocatedSegment* _Segment) {
+		Seal(_Segment, _Segment->m_bIsFree ? m_iStateFree : m_iStateLive);
+	}
+
+	void Verify(_In_ CAllocatedSegment* _Segment, _In_ functional_uint64_t _Expected, _In_z_ const char* _Reason) {
+		const functional_uint64_t state = StateOf(_Segment);
+		if (state == _Expected) return;
+
+		if (state == m_iStateQuarantined || state == m_iStateFree) GuardFailure(_Expected == m_iStateLive ? "Double free or use after free detected by CAllocator" : _Reason, SegmentToPtr(_Segment));
+		else GuardFailure("Heap corruption: segment header canary is broken", SegmentToPtr(_Segment));
+	}
+
+	//The red zone begins inside the word holding the block's last bytes: those bytes are masked out (little endian), the rest of
+	//that word and m_iRedZoneWords more carry the pattern. No byte loops, this runs on every allocation and free.
+	static functional_uint64_t* RedZone(_In_ CAllocatedSegment* _Segment, _Out_ functional_uint64_t& _Mask) {
+		const functional_unsigned_size_t requested = static_cast<functional_unsigned_size_t>(_Segment->m_iRequested);
+		_Mask = ~0ull << ((requested & 7) * 8);
+		return reinterpret_cast<functional_uint64_t*>(reinterpret_cast<char*>(_Segment) + sizeof(CAllocatedSegment) + (requested & ~static_cast<functional_unsigned_size_t>(7)));
+	}
+
+	void VerifyRedZone(_In_ CAllocatedSegment* _Segment) {
+		functional_uint64_t mask;
+		const functional_uint64_t* zone = RedZone(_Segment, mask);
+		functional_uint64_t bad = (zone[0] ^ m_iRedZoneWord) & mask;
+		for (functional_unsigned_size_t idx = 1; idx <= m_iRedZoneWords; idx++) bad |= zone[idx] ^ m_iRedZoneWord;
+		if (bad) GuardFailure("Heap buffer overflow: red zone behind the block was overwritten", SegmentToPtr(_Segment));
+	}
+
+	//A live block: remembers the requested size and paints the red zone right behind it.
+	void Arm(_In_ CAllocatedSegment* _Segment, _In_ functional_size_t _Size) {
+		Seal(_Segment, m_iStateLive);
+		_Segment->m_iRequested = _Size;
+		functional_uint64_t mask;
+		functional_uint64_t* zone = RedZone(_Segment, mask);
+		zone[0] = (zone[0] & ~mask) | (m_iRedZoneWord & mask);
+		for (functional_unsigned_size_t idx = 1; idx <= m_iRedZoneWords; idx++) zone[idx] = m_iRedZoneWord;
+	}
+
+	//Whole words of the block's start that are poisoned while it sits in quarantine.
+	static functional_unsigned_size_t PoisonedWords(_In_ CAllocatedSegment* _Segment) {
+		const functional_unsigned_size_t words = static_cast<functional_unsigned_size_t>(_Segment->m_iRequested) / 8;
+		return words < m_iPoisonWords ? words : m_iPoisonWords;
+	}
+
+	//Checks the block and its neighbours' headers, poisons it and parks it in the ring.
+	//Returns the block evicted from the ring (to be freed for real) or Q_nullptr while the ring is filling up.
+	CAllocatedSegment* Quarantine(_In_ CAllocatedSegment* _Segment) {
+		Verify(_Segment, m_iStateLive, "Q_free on a pointer we don't own");
+		VerifyRedZone(_Segment);
+		if (Next(_Segment)) {
+			const functional_uint64_t state = StateOf(Next(_Segment));
+			if (state != m_iStateFree && state != m_iStateLive && state != m_iStateQuarantined) GuardFailure("Heap corruption: the next segment header is broken", SegmentToPtr(Next(_Segment)));
+		}
+
+		Seal(_Segment, m_iStateQuarantined);
+		functional_uint64_t* words = static_cast<functional_uint64_t*>(SegmentToPtr(_Segment));
+		for (functional_unsigned_size_t idx = 0, count = PoisonedWords(_Segment); idx < count; idx++) words[idx] = m_iPoisonWord;
+
+		CAllocatedSegment* evicted = static_cast<CAllocatedSegment*>(this->_m_a_lpQuarantine[this->_m_iQuarantineHead]);
+		this->_m_a_lpQuarantine[this->_m_iQuarantineHead] = _Segment;
+		this->_m_iQuarantineHead = (this->_m_iQuarantineHead + 1) % FUNCTIONAL_ALLOCATOR_QUARANTINE_SIZE;
+		if (!evicted) return Q_nullptr;
+
+		Verify(evicted, m_iStateQuarantined, "Heap corruption: a quarantined segment header is broken");
+		const functional_uint64_t* poisoned = static_cast<functional_uint64_t*>(SegmentToPtr(evicted));
+		functional_uint64_t bad = 0;
+		for (functional_unsigned_size_t idx = 0, count = PoisonedWords(evicted); idx < count; idx++) bad |= poisoned[idx] ^ m_iPoisonWord;
+		if (bad) GuardFailure("Use after free: a freed block was written to", SegmentToPtr(evicted));
+		VerifyRedZone(evicted);
+
+		return evicted;
+	}
+#else
+	void Seal(_In_ CAllocatedSegment*) {}
+	void Arm(_In_ CAllocatedSegment*, _In_ functional_size_t) {}
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
+
+	//Heapsort: no recursion and no scratch memory, we are the allocator after all.
+	static void SortPointers(_Inout_updates_(_Count) void** _Pointers, _In_ functional_size_t _Count) {
+		auto sift = [_Pointers](functional_size_t _Root, functional_size_t _End) {
+			for (functional_size_t child; (child = _Root * 2 + 1) < _End; _Root = child) {
+				if (child + 1 < _End && _Pointers[child] < _Pointers[child + 1]) child++;
+				if (!(_Pointers[_Root] < _Pointers[child])) return;
+				void* temp = _Pointers[_Root];
+				_Pointers[_Root] = _Pointers[child];
+				_Pointers[child] = temp;
+			}
+		};
+
+		for (functional_size_t idx = _Count / 2; idx-- > 0;) sift(idx, _Count);
+		for (functional_size_t end = _Count; end-- > 1;) {
+			void* temp = _Pointers[0];
+			_Pointers[0] = _Pointers[end];
+			_Pointers[end] = temp;
+			sift(0, end);
+		}
+	}
+
+	//The pool is static storage and therefore already zero. Touching it here would fault it in before madvise and on the wrong node.
+	CAllocator() {
+		this->_m_lpPool = Q_nullptr;
+		this->_m_lpSegments = Q_nullptr;
+		this->_m_lpOldFreeSegment = Q_nullptr;
+		this->_m_lpMaintainCursor = Q_nullptr;
+		this->_m_lpDecommittedFrom = Q_nullptr;
+		this->_m_lpHighWater = Q_nullptr;
+		this->_m_iHeap = 0;
+	}
+		 
+	char _m_acMemoryPool[FUNCTIONAL_HEAP_SIZE + FUNCTIONAL_ALLOCATOR_POOL_ALIGNMENT];
+	char* _m_lpPool;
+	CAllocatedSegment* _m_lpSegments;
+	CAllocatedSegment* _m_lpOldFreeSegment;
+	CAllocatedSegment* _m_lpMaintainCursor;
+	CAllocatedSegment* _m_a_lpBins[m_iBinCount];
+	char* _m_lpDecommittedFrom;
+	char* _m_lpHighWater;
+	functional_unsigned_size_t _m_iHeap;
+#if FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+	CSpinLock _m_Lock;
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+#ifdef FUNCTIONAL_ALLOCATOR_GUARD
+	functional_uint64_t _m_iGuardKey;
+	void* _m_a_lpQuarantine[FUNCTIONAL_ALLOCATOR_QUARANTINE_SIZE];
+	functional_unsigned_size_t _m_iQuarantineHead;
+#endif //FUNCTIONAL_ALLOCATOR_GUARD
+} CAllocator;
+
+//Heap 0, the others follow it in the same array.
+static CAllocator* gs_lpAllocator = CAllocator::Init();
+
+inline CAllocator* Q_allocator_heaps() {
+	if (!gs_lpAllocator || reinterpret_cast<functional_uintptr_t>(gs_lpAllocator) == 1) gs_lpAllocator = CAllocator::Init();
+
+	return gs_lpAllocator;
+}
+
+#if FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1 && !defined(FUNCTIONAL_ALLOCATOR_CURRENT_HEAP)
+static thread_local functional_unsigned_size_t gs_iThreadHeap = 0;
+
+//Pin the calling thread's allocations to a heap, e.g. its NUMA node once you've pinned the thread there.
+void Q_allocator_set_thread_heap(_In_ functional_unsigned_size_t _Heap) {
+	gs_iThreadHeap = _Heap % FUNCTIONAL_ALLOCATOR_HEAP_COUNT;
+}
+
+#define FUNCTIONAL_ALLOCATOR_CURRENT_HEAP() gs_iThreadHeap
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1 && !defined(FUNCTIONAL_ALLOCATOR_CURRENT_HEAP)
+
+//Which heap a block came from, by address range.
+inline CAllocator* Q_allocator_owner(_In_ void* _Pointer) {
+	CAllocator* heaps = Q_allocator_heaps();
+#if FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+	for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_HEAP_COUNT; idx++) {
+		if (heaps[idx].Owns(_Pointer)) return &heaps[idx];
+	}
+	Q_SLOWASSERT(!"The pointer doesn't belong to any of our heaps");
+#else
+	(void)_Pointer;
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+
+	return heaps;
+}
+
+//The calling thread's heap first, then the others in turn once it's full.
+inline void* Q_allocate_from_heaps(_In_ functional_size_t _Size) {
+	CAllocator* heaps = Q_allocator_heaps();
+#if FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+	const functional_unsigned_size_t first = FUNCTIONAL_ALLOCATOR_CURRENT_HEAP() % FUNCTIONAL_ALLOCATOR_HEAP_COUNT;
+	for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_HEAP_COUNT; idx++) {
+		CAllocator* heap = &heaps[(first + idx) % FUNCTIONAL_ALLOCATOR_HEAP_COUNT];
+		CAllocator::CScopedLock lock(heap);
+		if (void* result = heap->Allocate(_Size)) return result;
+	}
+
+	return Q_nullptr;
+#else
+	return heaps->Allocate(_Size);
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+}
+
+void* Q_malloc(_In_ functional_size_t _Size) {
+	void* result = Q_allocate_from_heaps(_Size);
+	Q_TRACE_ALLOCATION(Q_ALLOCATION_MALLOC, result, Q_nullptr, _Size);
+
+	return result;
+}
+
+void Q_free(_In_ void* _Pointer) {
+	//How did you manage to use free without initializing the allocator, huh?
 	//Is your code bugsafe/bugless?
 	Q_SLOWASSERT(gs_lpAllocator && reinterpret_cast<functional_uintptr_t>(gs_lpAllocator) != 1);
-	if (!gs_lpAllocator || reinterpret_cast<functional_uintptr_t>(gs_lpAllocator) == 1) gs_lpAllocator = CAllocator::Init();
+	if (!_Pointer) return;
+
+	Q_TRACE_ALLOCATION(Q_ALLOCATION_FREE, _Pointer, Q_nullptr, 0);
+	CAllocator* heap = Q_allocator_owner(_Pointer);
+	CAllocator::CScopedLock lock(heap);
+	heap->Free(_Pointer);
+}
+
+void* Q_realloc(_In_ void* _Pointer, _In_ functional_size_t _Size) {
+	//How did you manage to use realloc without initializing the allocator, huh?
+	//Is your code bugsafe/bugless?
+	Q_SLOWASSERT(gs_lpAllocator && reinterpret_cast<functional_uintptr_t>(gs_lpAllocator) != 1);
+	if (!_Pointer) return Q_malloc(_Size);
+
+	CAllocator* heap = Q_allocator_owner(_Pointer);
+	heap->Lock();
+	void* result = heap->Reallocate(_Pointer, _Size);
+	heap->Unlock();
+#if FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+	//The block's own heap is full, move it wherever there's room.
+	if (!result && _Size) {
+		result = Q_allocate_from_heaps(_Size);
+		if (result) {
+			CAllocator::CScopedLock lock(heap);
+			const functional_unsigned_size_t usable = heap->UsableSize(_Pointer);
+			Q_memcpy(result, _Pointer, static_cast<unsigned int>(usable < static_cast<functional_unsigned_size_t>(_Size) ? usable : _Size));
+			heap->Free(_Pointer);
+		}
+	}
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+	Q_TRACE_ALLOCATION(Q_ALLOCATION_REALLOC, result, _Pointer, _Size);
+
+	return result;
+}
+
+functional_unsigned_size_t Q_malloc_usable_size(_In_opt_ void* _Pointer) {
+	if (!_Pointer) return 0;
+
+	CAllocator* heap = Q_allocator_owner(_Pointer);
+	CAllocator::CScopedLock lock(heap);
+	return heap->UsableSize(_Pointer);
+}
+
+void Q_free_sized(_In_opt_ void* _Pointer, _In_ functional_size_t _Size) {
+	Q_SLOWASSERT(gs_lpAllocator && reinterpret_cast<functional_uintptr_t>(gs_lpAllocator) != 1);
+	if (!_Pointer) return;
+
+	Q_TRACE_ALLOCATION(Q_ALLOCATION_FREE, _Pointer, Q_nullptr, _Size);
+	CAllocator* heap = Q_allocator_owner(_Pointer);
+	CAllocator::CScopedLock lock(heap);
+	heap->FreeSized(_Pointer, _Size);
+}
+
+//Returns how many of the _Count pointers were allocated, the rest of _Out is left untouched.
+functional_size_t Q_malloc_batch(_In_ functional_size_t _Size, _In_ functional_size_t _Count, _Out_writes_(_Count) void** _Out) {
+	CAllocator* heaps = Q_allocator_heaps();
+	functional_size_t count = 0;
+#if FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+	const functional_unsigned_size_t first = FUNCTIONAL_ALLOCATOR_CURRENT_HEAP() % FUNCTIONAL_ALLOCATOR_HEAP_COUNT;
+	for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_HEAP_COUNT && count < _Count; idx++) {
+		CAllocator* heap = &heaps[(first + idx) % FUNCTIONAL_ALLOCATOR_HEAP_COUNT];
+		CAllocator::CScopedLock lock(heap);
+		count += heap->AllocateBatch(_Size, _Count - count, _Out + count);
+	}
+#else
+	count = heaps->AllocateBatch(_Size, _Count, _Out);
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+#ifdef FUNCTIONAL_ALLOCATOR_TRACE
+	for (functional_size_t idx = 0; idx < count; idx++) Q_TRACE_ALLOCATION(Q_ALLOCATION_MALLOC, _Out[idx], Q_nullptr, _Size);
+#endif //FUNCTIONAL_ALLOCATOR_TRACE
+
+	return count;
+}
+
+//Reorders _Pointers.
+void Q_free_batch(_Inout_updates_(_Count) void** _Pointers, _In_ functional_size_t _Count) {
+	Q_SLOWASSERT(gs_lpAllocator && reinterpret_cast<functional_uintptr_t>(gs_lpAllocator) != 1);
+	CAllocator* heaps = Q_allocator_heaps();
+#ifdef FUNCTIONAL_ALLOCATOR_TRACE
+	for (functional_size_t idx = 0; idx < _Count; idx++) {
+		if (_Pointers[idx]) Q_TRACE_ALLOCATION(Q_ALLOCATION_FREE, _Pointers[idx], Q_nullptr, 0);
+	}
+#endif //FUNCTIONAL_ALLOCATOR_TRACE
+#if FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+	//Partition by owner, then each heap frees its share in one go.
+	functional_size_t done = 0;
+	for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_HEAP_COUNT && done < _Count; idx++) {
+		functional_size_t end = done;
+		for (functional_size_t it = done; it < _Count; it++) {
+			if (_Pointers[it] && heaps[idx].Owns(_Pointers[it])) {
+				void* temp = _Pointers[end];
+				_Pointers[end++] = _Pointers[it];
+				_Pointers[it] = temp;
+			}
+		}
+		CAllocator::CScopedLock lock(&heaps[idx]);
+		heaps[idx].FreeBatch(_Pointers + done, end - done);
+		done = end;
+	}
+#else
+	heaps->FreeBatch(_Pointers, _Count);
+#endif //FUNCTIONAL_ALLOCATOR_HEAP_COUNT > 1
+}
+
+//Call it from your idle loop until it returns Q_TRUE, a small _Budget keeps each pause short. Every heap gets _Budget.
+Q_bool Q_allocator_maintain(_In_ functional_size_t _Budget) {
+	CAllocator* heaps = Q_allocator_heaps();
+	Q_bool done = Q_TRUE;
+	for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_HEAP_COUNT; idx++) {
+		CAllocator::CScopedLock lock(&heaps[idx]);
+		if (!heaps[idx].Maintain(_Budget)) done = Q_FALSE;
+	}
+
+	return done;
+}
+
+//Writes the heaps as an image you can Q_allocator_restore at the next start instead of rebuilding them. Pointers stored inside
+//your blocks are absolute, so unless the pool lands at the same address (no ASLR) keep your structures offset based.
+Q_bool Q_allocator_snapshot(_In_ Q_allocator_writer_t _Writer, _In_opt_ void* _Context = Q_nullptr) {
+	CAllocator* heaps = Q_allocator_heaps();
+	for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_HEAP_COUNT; idx++) {
+		CAllocator::CScopedLock lock(&heaps[idx]);
+		if (!heaps[idx].Snapshot(_Writer, _Context)) return Q_FALSE;
+	}
+
+	return Q_TRUE;
+}
+
+//Call it before anything else allocates, the current heaps are replaced.
+Q_bool Q_allocator_restore(_In_ Q_allocator_reader_t _Reader, _In_opt_ void* _Context = Q_nullptr) {
+	CAllocator* heaps = Q_allocator_heaps();
+	for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_HEAP_COUNT; idx++) {
+		CAllocator::CScopedLock lock(&heaps[idx]);
+		if (!heaps[idx].Restore(_Reader, _Context)) return Q_FALSE;
+	}
+
+	return Q_TRUE;
+}
+
+//Summed over all heaps, except the largest free block which is the largest of any heap.
+Q_bool Q_allocator_statistics(_Out_ CAllocatorStatistics& _Statistics) {
+	CAllocator* heaps = Q_allocator_heaps();
+	Q_memset(&_Statistics, 0, sizeof(_Statistics));
+	for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_HEAP_COUNT; idx++) {
+		CAllocatorStatistics heap;
+		{
+			CAllocator::CScopedLock lock(&heaps[idx]);
+			heaps[idx].Statistics(heap);
+		}
+		_Statistics.m_iUsedBytes += heap.m_iUsedBytes;
+		_Statistics.m_iFreeBytes += heap.m_iFreeBytes;
+		if (heap.m_iLargestFreeBytes > _Statistics.m_iLargestFreeBytes) _Statistics.m_iLargestFreeBytes = heap.m_iLargestFreeBytes;
+		_Statistics.m_iPeakFootprint += heap.m_iPeakFootprint;
+		_Statistics.m_iSegments += heap.m_iSegments;
+		_Statistics.m_iFreeSegments += heap.m_iFreeSegments;
+	}
 
-	return gs_lpAllocator->Reallocate(_Pointer, _Size);
+	return Q_TRUE;
 }
 
 void Q_clear_allocator() {
-	gs_lpAllocator->ClearPool();
-	gs_lpAllocator = CAllocator::Init();
+	CAllocator* heaps = Q_allocator_heaps();
+	for (functional_unsigned_size_t idx = 0; idx < FUNCTIONAL_ALLOCATOR_HEAP_COUNT; idx++) {
+		CAllocator::CScopedLock lock(&heaps[idx]);
+		heaps[idx].ClearPool();
+		heaps[idx].Reset(idx);
+	}
 }
 #endif //FUNCTIONAL_NO_ALLOCATOR
 
@@ -593,19 +1934,103 @@ void Q_clear_allocator() {
 #endif //FUNCTIONAL_CUSTOM_REALLOC
 
 void* Q_malloc(_In_ functional_size_t _Size) {
-	return FUNCTIONAL_CUSTOM_MALLOC(_Size);
+	void* result = FUNCTIONAL_CUSTOM_MALLOC(_Size);
+	Q_TRACE_ALLOCATION(Q_ALLOCATION_MALLOC, result, Q_nullptr, _Size);
+
+	return result;
 }
 
 void Q_free(_In_ void* _Pointer) {
+	if (_Pointer) Q_TRACE_ALLOCATION(Q_ALLOCATION_FREE, _Pointer, Q_nullptr, 0);
 	FUNCTIONAL_CUSTOM_FREE(_Pointer);
 }
 
 void* Q_realloc(_In_ void* _Pointer, _In_ functional_size_t _Size) {
-	FUNCTIONAL_CUSTOM_REALLOC(_Pointer, _Size);
+	void* result = FUNCTIONAL_CUSTOM_REALLOC(_Pointer, _Size);
+	Q_TRACE_ALLOCATION(Q_ALLOCATION_REALLOC, result, _Pointer, _Size);
+
+	return result;
+}
+
+//0 means unknown, the caller should stick to the size it asked for.
+functional_unsigned_size_t Q_malloc_usable_size(_In_opt_ void* _Pointer) {
+#ifdef FUNCTIONAL_CUSTOM_MALLOC_USABLE_SIZE
+	return _Pointer ? FUNCTIONAL_CUSTOM_MALLOC_USABLE_SIZE(_Pointer) : 0;
+#else
+	(void)_Pointer;
+	return 0;
+#endif //FUNCTIONAL_CUSTOM_MALLOC_USABLE_SIZE
+}
+
+void Q_free_sized(_In_opt_ void* _Pointer, _In_ functional_size_t _Size) {
+	if (_Pointer) Q_TRACE_ALLOCATION(Q_ALLOCATION_FREE, _Pointer, Q_nullptr, _Size);
+#ifdef FUNCTIONAL_CUSTOM_FREE_SIZED
+	FUNCTIONAL_CUSTOM_FREE_SIZED(_Pointer, _Size);
+#else
+	(void)_Size;
+	FUNCTIONAL_CUSTOM_FREE(_Pointer);
+#endif //FUNCTIONAL_CUSTOM_FREE_SIZED
+}
+
+functional_size_t Q_malloc_batch(_In_ functional_size_t _Size, _In_ functional_size_t _Count, _Out_writes_(_Count) void** _Out) {
+	for (functional_size_t idx = 0; idx < _Count; idx++) {
+		_Out[idx] = Q_malloc(_Size);
+		if (!_Out[idx]) return idx;
+	}
+
+	return _Count;
+}
+
+void Q_free_batch(_Inout_updates_(_Count) void** _Pointers, _In_ functional_size_t _Count) {
+	for (functional_size_t idx = 0; idx < _Count; idx++) Q_free(_Pointers[idx]);
+}
+
+//Your allocator does its own housekeeping.
+Q_bool Q_allocator_maintain(_In_ functional_size_t _Budget) {
+	(void)_Budget;
+	return Q_TRUE;
+}
+
+//Your allocator's heap isn't ours to persist.
+Q_bool Q_allocator_snapshot(_In_ Q_allocator_writer_t _Writer, _In_opt_ void* _Context = Q_nullptr) {
+	(void)_Writer;
+	(void)_Context;
+	return Q_FALSE;
+}
+
+Q_bool Q_allocator_restore(_In_ Q_allocator_reader_t _Reader, _In_opt_ void* _Context = Q_nullptr) {
+	(void)_Reader;
+	(void)_Context;
+	return Q_FALSE;
+}
+
+//We can't look inside your allocator.
+Q_bool Q_allocator_statistics(_Out_ CAllocatorStatistics& _Statistics) {
+	Q_memset(&_Statistics, 0, sizeof(_Statistics));
+	return Q_FALSE;
 }
 
 #endif //FUNCTIONAL_NO_ALLOCATOR
 
+//_Alignment must be a power of two. Over-allocates and keeps the original pointer right in front of the aligned one,
+//so it works on top of any Q_malloc backend. Release with Q_aligned_free only.
+void* Q_aligned_malloc(_In_ functional_unsigned_size_t _Size, _In_ functional_unsigned_size_t _Alignment) {
+	Q_ASSERT(_Alignment && !(_Alignment & (_Alignment - 1)) && "Q_aligned_malloc: alignment must be a power of two");
+	if (_Alignment < sizeof(void*)) _Alignment = sizeof(void*);
+
+	auto raw = static_cast<char*>(Q_malloc(_Size + _Alignment - 1 + sizeof(void*)));
+	if (!raw) return Q_nullptr;
+
+	const functional_uintptr_t aligned = (reinterpret_cast<functional_uintptr_t>(raw) + sizeof(void*) + _Alignment - 1) & ~static_cast<functional_uintptr_t>(_Alignment - 1);
+	reinterpret_cast<void**>(aligned)[-1] = raw;
+
+	return reinterpret_cast<void*>(aligned);
+}
+
+void Q_aligned_free(_In_opt_ void* _Pointer) {
+	if (_Pointer) Q_free(static_cast<void**>(_Pointer)[-1]);
+}
+
 //We don't have any new operators since they're defined in CRT library. Instead we define our own which cannot be predefined by anything other because of the interface "INewWrapper"
 typedef struct INewWrapper {} INewWrapper;
 inline void* operator new(_In_opt_ functional_unsigned_size_t _Count, _In_ INewWrapper _Wrapper, _In_ void* _Pointer) {
@@ -626,6 +2051,150 @@ template<class _Ty> void Q_delete(_In_ _Ty* _Pointer) {
 	}
 }
 
+//Allocation policy used by our containers. Anything with these three members can be passed instead (an arena, a pool &c), stateful or not.
+//An optional UsableSize(pointer, size) lets containers grow into the slack the allocator rounded up to.
+typedef struct CDefaultAllocator {
+	void* Allocate(_In_ functional_unsigned_size_t _Size) {
+		return Q_malloc(_Size);
+	}
+
+	functional_unsigned_size_t UsableSize(_In_ void* _Pointer, _In_ functional_unsigned_size_t _Size) {
+		const functional_unsigned_size_t usable = Q_malloc_usable_size(_Pointer);
+		return usable > _Size ? usable : _Size;
+	}
+
+	void* Reallocate(_In_opt_ void* _Pointer, _In_ functional_unsigned_size_t _OldSize, _In_ functional_unsigned_size_t _NewSize) {
+		(void)_OldSize;
+
+		return _Pointer ? Q_realloc(_Pointer, _NewSize) : Q_malloc(_NewSize);
+	}
+
+	void Free(_In_opt_ void* _Pointer, _In_ functional_unsigned_size_t _Size) {
+		Q_free_sized(_Pointer, static_cast<functional_size_t>(_Size));
+	}
+} CDefaultAllocator;
+
+//_Allocator::UsableSize when the allocator has one, _Size otherwise.
+template<class _Allocator> auto Q_allocator_usable_size(_In_ _Allocator& _Which, _In_ void* _Pointer, _In_ functional_unsigned_size_t _Size, int) -> decltype(_Which.UsableSize(_Pointer, _Size)) {
+	return _Which.UsableSize(_Pointer, _Size);
+}
+
+template<class _Allocator> functional_unsigned_size_t Q_allocator_usable_size(_In_ _Allocator&, _In_ void*, _In_ functional_unsigned_size_t _Size, long) {
+	return _Size;
+}
+
+//Bump allocator over a list of Q_malloc'd chunks. Individual frees are no-ops, everything goes away at once in Reset or the destructor.
+//Non-copyable
+typedef struct CArena {
+	explicit CArena(_In_opt_ functional_unsigned_size_t _ChunkSize = FUNCTIONAL_ARENA_CHUNK_SIZE) {
+		Q_ASSERT(_ChunkSize > 0 && "Expected positive _ChunkSize at CArena::CArena");
+		this->_m_lpChunks = Q_nullptr;
+		this->_m_lpLastAllocation = Q_nullptr;
+		this->_m_iChunkSize = _ChunkSize;
+	}
+
+	~CArena() {
+		this->Reset();
+	}
+
+	void* Allocate(_In_ functional_unsigned_size_t _Size, _In_opt_ functional_unsigned_size_t _Alignment = sizeof(void*)) {
+		Q_SLOWASSERT(_Alignment && !(_Alignment & (_Alignment - 1)) && "CArena::Allocate: _Alignment must be a power of two");
+		CChunk* chunk = this->_m_lpChunks;
+		//Aligned by address, the chunk data itself is only as aligned as Q_malloc plus our header.
+		functional_unsigned_size_t offset = chunk ? AlignedOffset(chunk, chunk->m_iUsed, _Alignment) : 0;
+
+		if (!chunk || offset + _Size > chunk->m_iCapacity) {
+			const functional_unsigned_size_t capacity = _Size + _Alignment > this->_m_iChunkSize ? _Size + _Alignment : this->_m_iChunkSize;
+			chunk = static_cast<CChunk*>(Q_malloc(sizeof(CChunk) + capacity));
+			if (!chunk) return Q_nullptr;
+			chunk->m_lpNext = this->_m_lpChunks;
+			chunk->m_iCapacity = capacity;
+			this->_m_lpChunks = chunk;
+			offset = AlignedOffset(chunk, 0, _Alignment);
+		}
+
+		chunk->m_iUsed = offset + _Size;
+		this->_m_lpLastAllocation = chunk->Data() + offset;
+
+		return this->_m_lpLastAllocation;
+	}
+
+	//The latest allocation grows in place while its chunk has room, anything else is copied (pass the _Alignment it was allocated with).
+	void* Reallocate(_In_opt_ void* _Pointer, _In_ functional_unsigned_size_t _OldSize, _In_ functional_unsigned_size_t _NewSize,
+		_In_opt_ functional_unsigned_size_t _Alignment = sizeof(void*)) {
+		if (_Pointer && _Pointer == this->_m_lpLastAllocation) {
+			CChunk* chunk = this->_m_lpChunks;
+			const functional_unsigned_size_t offset = static_cast<char*>(_Pointer) - chunk->Data();
+			if (offset + _NewSize <= chunk->m_iCapacity) {
+				chunk->m_iUsed = offset + _NewSize;
+				return _Pointer;
+			}
+		}
+
+		void* result = this->Allocate(_NewSize, _Alignment);
+		if (result && _Pointer) Q_memcpy(result, _Pointer, static_cast<unsigned int>(_OldSize < _NewSize ? _OldSize : _NewSize));
+
+		return result;
+	}
+
+	void Free(_In_opt_ void* _Pointer, _In_ functional_unsigned_size_t _Size) {
+		(void)_Pointer;
+		(void)_Size;
+	}
+
+	void Reset() {
+		while (this->_m_lpChunks) {
+			CChunk* next = this->_m_lpChunks->m_lpNext;
+			Q_free_sized(this->_m_lpChunks, static_cast<functional_size_t>(sizeof(CChunk) + this->_m_lpChunks->m_iCapacity));
+			this->_m_lpChunks = next;
+		}
+		this->_m_lpLastAllocation = Q_nullptr;
+	}
+private:
+	CArena(CArena const&);
+	CArena& operator=(CArena const&);
+
+	struct CChunk {
+		CChunk* m_lpNext;
+		functional_unsigned_size_t m_iCapacity, m_iUsed;
+
+		char* Data() {
+			return reinterpret_cast<char*>(this + 1);
+		}
+	};
+
+	static functional_unsigned_size_t AlignedOffset(_In_ CChunk* _Chunk, _In_ functional_unsigned_size_t _Used, _In_ functional_unsigned_size_t _Alignment) {
+		const functional_uintptr_t data = reinterpret_cast<functional_uintptr_t>(_Chunk->Data());
+		return static_cast<functional_unsigned_size_t>(((data + _Used + _Alignment - 1) & ~static_cast<functional_uintptr_t>(_Alignment - 1)) - data);
+	}
+
+	CChunk* _m_lpChunks;
+	void* _m_lpLastAllocation;
+	functional_unsigned_size_t _m_iChunkSize;
+} CArena;
+
+//Lets containers take their memory from a CArena: CVector<int, CArenaAllocator> numbers(CArenaAllocator(&arena));
+typedef struct CArenaAllocator {
+	CArenaAllocator(_In_opt_ CArena* _Arena = Q_nullptr) : m_lpArena(_Arena) {}
+
+	void* Allocate(_In_ functional_unsigned_size_t _Size) {
+		Q_ASSERT(this->m_lpArena && "CArenaAllocator used without an arena");
+		return this->m_lpArena->Allocate(_Size, 16);
+	}
+
+	void* Reallocate(_In_opt_ void* _Pointer, _In_ functional_unsigned_size_t _OldSize, _In_ functional_unsigned_size_t _NewSize) {
+		Q_ASSERT(this->m_lpArena && "CArenaAllocator used without an arena");
+		return this->m_lpArena->Reallocate(_Pointer, _OldSize, _NewSize, 16);
+	}
+
+	void Free(_In_opt_ void* _Pointer, _In_ functional_unsigned_size_t _Size) {
+		(void)_Pointer;
+		(void)_Size;
+	}
+
+	CArena* m_lpArena;
+} CArenaAllocator;
+
 template<class _To, class _From> _To union_cast(_From&& _What) {
 	union {
 		remove_reference_t<_From>* m_lpFrom;
@@ -658,13 +2227,158 @@ template<class _Callee, class _ReturnType, class... _Ts> auto functional_cast_in
 	};
 }
 
+//Turns a callable into a plain function pointer, for C style callbacks. The callee is kept in one static slot per callee type, so converting
+//a second callee of the same type replaces the first and this isn't thread-safe. Use CFunction/CFunctionRef unless you need the raw pointer.
 //Deduction is disabled here using enable_if and typeof - xWhitey
 template<class _ReturnType, class _Which, class = enable_if_t<true, _ReturnType>, class = typename CTypeOf<_ReturnType>::type> _ReturnType* functional_cast(_Which&& c) {
 	return functional_cast_internal(forward<_Which>(c), (_ReturnType*)Q_nullptr);
 }
 
+//What CFunction and CFunctionRef store for a callee: the callee itself, or a pointer when given a plain function.
+template<class _Ty> struct CFunctionTarget { typedef typename remove_cv<remove_reference_t<_Ty>>::type type; };
+template<class _ReturnType, class... _Ts> struct CFunctionTarget<_ReturnType(_Ts...)> { typedef _ReturnType(*type)(_Ts...); };
+template<class _ReturnType, class... _Ts> struct CFunctionTarget<_ReturnType(&)(_Ts...)> { typedef _ReturnType(*type)(_Ts...); };
+
+template<class _Signature> struct CFunction;
+
+//Owning, move-only callable. Callees up to FUNCTIONAL_FUNCTION_INLINE_SIZE bytes (16 byte aligned at most) live inside the object,
+//bigger ones go through Q_malloc. A call is one indirect call through a plain function pointer, no virtual dispatch.
+template<class _ReturnType, class... _Ts> struct CFunction<_ReturnType(_Ts...)> {
+	CFunction() : _m_lpInvoke(0), _m_lpOps(Q_nullptr) {}
+
+	template<class _Callee, class = enable_if_t<!is_same_v<typename CFunctionTarget<_Callee>::type, CFunction>>> CFunction(_In_ _Callee&& _Func) {
+		typedef typename CFunctionTarget<_Callee>::type target;
+		typedef CManager<target, (sizeof(target) <= FUNCTIONAL_FUNCTION_INLINE_SIZE && alignof(target) <= 16)> manager;
+
+		manager::Create(this->_m_a_cStorage, forward<_Callee>(_Func));
+		this->_m_lpInvoke = &manager::Invoke;
+		this->_m_lpOps = &manager::m_Ops;
+	}
+
+	CFunction(_In_ CFunction&& _Other) : _m_lpInvoke(_Other._m_lpInvoke), _m_lpOps(_Other._m_lpOps) {
+		if (this->_m_lpOps) this->_m_lpOps->m_lpMove(this->_m_a_cStorage, _Other._m_a_cStorage);
+		_Other._m_lpInvoke = 0;
+		_Other._m_lpOps = Q_nullptr;
+	}
+
+	CFunction& operator=(_In_ CFunction&& _Other) {
+		if (this != &_Other) {
+			this->reset();
+			this->_m_lpInvoke = _Other._m_lpInvoke;
+			this->_m_lpOps = _Other._m_lpOps;
+			if (this->_m_lpOps) this->_m_lpOps->m_lpMove(this->_m_a_cStorage, _Other._m_a_cStorage);
+			_Other._m_lpInvoke = 0;
+			_Other._m_lpOps = Q_nullptr;
+		}
+
+		return *this;
+	}
+
+	~CFunction() {
+		this->reset();
+	}
+
+	_ReturnType operator()(_In_opt_ _Ts... _Args) const {
+		Q_ASSERT(this->_m_lpInvoke && "Calling an empty CFunction");
+		return this->_m_lpInvoke(const_cast<unsigned char*>(this->_m_a_cStorage), forward<_Ts>(_Args)...);
+	}
+
+	explicit operator bool() const {
+		return this->_m_lpInvoke != 0;
+	}
+
+	void reset() {
+		if (this->_m_lpOps) this->_m_lpOps->m_lpDestroy(this->_m_a_cStorage);
+		this->_m_lpInvoke = 0;
+		this->_m_lpOps = Q_nullptr;
+	}
+private:
+	typedef struct COps {
+		void(*m_lpMove)(void* _Destination, void* _Source);
+		void(*m_lpDestroy)(void* _Storage);
+	} COps;
+
+	template<class _Target, bool _Inline> struct CManager {
+		template<class _Callee> static void Create(_Out_ void* _Storage, _In_ _Callee&& _Func) {
+			if constexpr (_Inline) {
+				new (INewWrapper(), _Storage) _Target(forward<_Callee>(_Func));
+			} else {
+				void* memory = Q_malloc(sizeof(_Target));
+				Q_ASSERT(memory && "Failed to allocate the callee of a CFunction");
+				*static_cast<_Target**>(_Storage) = new (INewWrapper(), memory) _Target(forward<_Callee>(_Func));
+			}
+		}
+
+		static _Target* Get(_In_ void* _Storage) {
+			if constexpr (_Inline) return static_cast<_Target*>(_Storage);
+			else return *static_cast<_Target**>(_Storage);
+		}
+
+		static _ReturnType Invoke(_In_ void* _Storage, _Ts&&... _Args) {
+			return (*Get(_Storage))(forward<_Ts>(_Args)...);
+		}
+
+		static void Move(_Out_ void* _Destination, _Inout_ void* _Source) {
+			if constexpr (_Inline) {
+				new (INewWrapper(), _Destination) _Target(move(*Get(_Source)));
+				Get(_Source)->~_Target();
+			} else {
+				*static_cast<_Target**>(_Destination) = Get(_Source);
+			}
+		}
+
+		static void Destroy(_Inout_ void* _Storage) {
+			Get(_Storage)->~_Target();
+			if constexpr (!_Inline) Q_free(Get(_Storage));
+		}
+
+		static inline constexpr COps m_Ops = { &Move, &Destroy };
+	};
+
+	alignas(16) unsigned char _m_a_cStorage[FUNCTIONAL_FUNCTION_INLINE_SIZE < sizeof(void*) ? sizeof(void*) : FUNCTIONAL_FUNCTION_INLINE_SIZE];
+	_ReturnType(*_m_lpInvoke)(void*, _Ts&&...);
+	const COps* _m_lpOps;
+
+	CFunction(const CFunction&) = delete;
+	CFunction& operator=(const CFunction&) = delete;
+};
+
+template<class _Signature> struct CFunctionRef;
+
+//Non-owning view of a callable: two pointers, trivially copyable, never allocates. The callee has to outlive the view,
+//so take it as a parameter (void ForEach(CFunctionRef<void(int)> _Visitor)) rather than storing it.
+template<class _ReturnType, class... _Ts> struct CFunctionRef<_ReturnType(_Ts...)> {
+	template<class _Callee, class = enable_if_t<!is_same_v<typename CFunctionTarget<_Callee>::type, CFunctionRef>>> CFunctionRef(_In_ _Callee&& _Func) {
+		typedef typename CFunctionTarget<_Callee>::type target;
+
+		if constexpr (is_pointer<target>::value) {
+			this->_m_uCallee.m_lpFunction = reinterpret_cast<void(*)()>(static_cast<target>(_Func));
+			this->_m_lpInvoke = [](_In_ CCallee _Target, _Ts&&... _Args) -> _ReturnType {
+				return reinterpret_cast<target>(_Target.m_lpFunction)(forward<_Ts>(_Args)...);
+			};
+		} else {
+			this->_m_uCallee.m_lpObject = const_cast<void*>(static_cast<const void*>(&_Func));
+			this->_m_lpInvoke = [](_In_ CCallee _Target, _Ts&&... _Args) -> _ReturnType {
+				return (*static_cast<remove_reference_t<_Callee>*>(_Target.m_lpObject))(forward<_Ts>(_Args)...);
+			};
+		}
+	}
+
+	_ReturnType operator()(_In_opt_ _Ts... _Args) const {
+		return this->_m_lpInvoke(this->_m_uCallee, forward<_Ts>(_Args)...);
+	}
+private:
+	typedef union CCallee {
+		void* m_lpObject;
+		void(*m_lpFunction)();
+	} CCallee;
+
+	CCallee _m_uCallee;
+	_ReturnType(*_m_lpInvoke)(CCallee, _Ts&&...);
+};
+
 template<class _To, class _From, class = enable_if_t<true, _To>, class = CTypeOf<_To>> _To indirect_cast(_From&& _What) {
-	return functional_cast<_To()>([_What]() { return _What; })();
+	return CFunction<_To()>([_What]() { return _What; })();
 }
 
 #ifndef INT_MAX
@@ -689,15 +2403,28 @@ extern "C" Q_bool _fltused = Q_TRUE;
 //(-)3.402823466e+38F
 #define FLOAT_STR_SIZE (sizeof(float) * CHAR_BIT / 3 + 18)
 
-template<class _Function> void expand(_Function&& _Func) {
+//(-)18446744073709551615
+#define LONG_LONG_STR_SIZE (sizeof(long long) * CHAR_BIT / 3 + 3)
 
-}
+//(-)1.7976931348623157e+308 written out in full, with FUNCTIONAL_FTOA_MAX_PRECISION decimals
+#define FUNCTIONAL_FTOA_MAX_PRECISION 17
+#define DOUBLE_STR_SIZE (309 + FUNCTIONAL_FTOA_MAX_PRECISION + 3)
+
+//Size of the scratch buffer Q_sprintf formats into. Also the largest output a single Q_sprintf call can produce.
+#ifndef FUNCTIONAL_SPRINTF_BUFFER_SIZE
+#define FUNCTIONAL_SPRINTF_BUFFER_SIZE 2048
+#endif //FUNCTIONAL_SPRINTF_BUFFER_SIZE
+
+template<class _Function> void expand(_Function&& _Func) {
+
+}
 
 template<class _Function, class _Arg, class... _Rest> void expand(_Function&& _Func, _Arg& _Argument, _Rest&... _RestArgs) {
 	_Func(_Argument);
 	expand(_Func, _RestArgs...);
 }
 
+//Kept for existing code: heap allocated and unchecked (Q_pp_arg trusts the type you give it). Prefer CArgPack below.
 typedef struct CParameterPackExpander {
 	functional_size_t m_iArgsSize, m_iCurrentArg;
 	void** m_a_lpTotalArgs;
@@ -742,20 +2469,169 @@ typedef struct CParameterPackExpander {
 	Q_pp_end(list);
 }*/
 
-#define Q_max(_Which, _To) ((_Which < _To) ? _To : _Which)
-#define FUNCTIONAL_abs(_Which) (_Which > 0 ? _Which : -_Which)
+//What an argument is, as far as formatting cares. CArgValue carries it next to the widened value.
+typedef enum : unsigned char {
+	Q_ARG_OTHER = 0x0,
+	Q_ARG_CHAR = 0x1,
+	Q_ARG_SIGNED = 0x2,
+	Q_ARG_UNSIGNED = 0x3,
+	Q_ARG_FLOAT = 0x4,
+	Q_ARG_STRING = 0x5,
+	Q_ARG_POINTER = 0x6
+} Q_arg_type;
+
+template<class _Ty> struct CArgType : integral_constant<Q_arg_type, __is_enum(_Ty) ? Q_ARG_SIGNED : Q_ARG_OTHER> {};
+template<class _Ty> struct CArgType<_Ty*> : integral_constant<Q_arg_type, Q_ARG_POINTER> {};
+template<> struct CArgType<char*> : integral_constant<Q_arg_type, Q_ARG_STRING> {};
+template<> struct CArgType<const char*> : integral_constant<Q_arg_type, Q_ARG_STRING> {};
+template<> struct CArgType<CString> : integral_constant<Q_arg_type, Q_ARG_STRING> {};
+template<> struct CArgType<char> : integral_constant<Q_arg_type, Q_ARG_CHAR> {};
+template<> struct CArgType<signed char> : integral_constant<Q_arg_type, Q_ARG_SIGNED> {};
+template<> struct CArgType<short> : integral_constant<Q_arg_type, Q_ARG_SIGNED> {};
+template<> struct CArgType<int> : integral_constant<Q_arg_type, Q_ARG_SIGNED> {};
+template<> struct CArgType<long> : integral_constant<Q_arg_type, Q_ARG_SIGNED> {};
+template<> struct CArgType<long long> : integral_constant<Q_arg_type, Q_ARG_SIGNED> {};
+template<> struct CArgType<bool> : integral_constant<Q_arg_type, Q_ARG_UNSIGNED> {};
+template<> struct CArgType<unsigned char> : integral_constant<Q_arg_type, Q_ARG_UNSIGNED> {};
+template<> struct CArgType<unsigned short> : integral_constant<Q_arg_type, Q_ARG_UNSIGNED> {};
+template<> struct CArgType<unsigned int> : integral_constant<Q_arg_type, Q_ARG_UNSIGNED> {};
+template<> struct CArgType<unsigned long> : integral_constant<Q_arg_type, Q_ARG_UNSIGNED> {};
+template<> struct CArgType<unsigned long long> : integral_constant<Q_arg_type, Q_ARG_UNSIGNED> {};
+template<> struct CArgType<float> : integral_constant<Q_arg_type, Q_ARG_FLOAT> {};
+template<> struct CArgType<double> : integral_constant<Q_arg_type, Q_ARG_FLOAT> {};
+template<> struct CArgType<long double> : integral_constant<Q_arg_type, Q_ARG_FLOAT> {};
+
+//One argument with its type tag, widened to 64 bits (m_iSize remembers the original width, so %u/%x of a negative int stay 32 bit).
+typedef struct CArgValue {
+	//Arrays passed by reference are taken as the pointer they decay to, so char buffers still format as strings.
+	template<class _Ty> static CArgValue From(_In_ const _Ty& _Value) {
+		typedef typename remove_cv<two_enable_if_t<is_array<_Ty>::value, const typename remove_extent<_Ty>::type*, _Ty>>::type type;
+		CArgValue result;
+		result.m_Type = CArgType<type>::value;
+		result.m_iSize = sizeof(type);
+		result.m_iUnsigned = 0;
+
+		if constexpr (is_same_v<type, CString>) result.m_lpPointer = _Value.c_str();
+		else if constexpr (CArgType<type>::value == Q_ARG_STRING || CArgType<type>::value == Q_ARG_POINTER) result.m_lpPointer = _Value;
+		else if constexpr (CArgType<type>::value == Q_ARG_FLOAT) result.m_flValue = static_cast<double>(_Value);
+		else if constexpr (CArgType<type>::value == Q_ARG_UNSIGNED) result.m_iUnsigned = static_cast<unsigned long long>(_Value);
+		else if constexpr (CArgType<type>::value != Q_ARG_OTHER) result.m_iSigned = static_cast<long long>(_Value);
+
+		return result;
+	}
+
+	long long AsSigned() const {
+		switch (this->m_Type) {
+		case Q_ARG_FLOAT: return static_cast<long long>(this->m_flValue);
+		case Q_ARG_STRING:
+		case Q_ARG_POINTER: return static_cast<long long>(reinterpret_cast<functional_uintptr_t>(this->m_lpPointer));
+		default: return this->m_iSigned;
+		}
+	}
+
+	unsigned long long AsUnsigned() const {
+		if (this->m_Type == Q_ARG_FLOAT) return static_cast<unsigned long long>(this->m_flValue);
+		const unsigned long long value = static_cast<unsigned long long>(this->AsSigned());
+		return this->m_iSize < sizeof(value) ? value & ((1ull << (this->m_iSize * 8)) - 1) : value;
+	}
+
+	double AsDouble() const {
+		switch (this->m_Type) {
+		case Q_ARG_FLOAT: return this->m_flValue;
+		case Q_ARG_UNSIGNED: return static_cast<double>(this->m_iUnsigned);
+		default: return static_cast<double>(this->AsSigned());
+		}
+	}
+
+	Q_arg_type m_Type;
+	functional_unsigned_size_t m_iSize;
+	union {
+		long long m_iSigned;
+		unsigned long long m_iUnsigned;
+		double m_flValue;
+		const void* m_lpPointer;
+	};
+} CArgValue;
+
+//A tuple of arguments kept by value on the stack, no heap involved: get<N>() at compile time, visit(index, fn) at runtime
+//(fn receives the argument with its real type) and value(index) for a type-tagged copy.
+//auto pack = Q_make_arg_pack(42, 1.5f, "text"); pack.visit(idx, [](auto& arg) { ... });
+template<class... _Ts> struct CArgPack;
+
+template<> struct CArgPack<> {
+	static constexpr functional_unsigned_size_t m_iCount = 0;
+
+	constexpr functional_unsigned_size_t size() const {
+		return 0;
+	}
+
+	template<class _Function> constexpr Q_bool visit(_In_ functional_unsigned_size_t, _In_ _Function&&) const {
+		return Q_FALSE;
+	}
+
+	CArgValue value(_In_ functional_unsigned_size_t) const {
+		Q_ASSERT(!"CArgPack::value: index out of range");
+		return CArgValue::From(0);
+	}
+};
+
+template<class _Head, class... _Tail> struct CArgPack<_Head, _Tail...> {
+	static constexpr functional_unsigned_size_t m_iCount = 1 + sizeof...(_Tail);
 
-#define RandomNumber_Stage1(_Counter) (_Counter * ((int) (_Counter / 2)) + __COUNTER__)
-#define RandomNumber_Stage2(_Counter) (RandomNumber_Stage1(_Counter) + RandomNumber_Stage1((__COUNTER__ % (_Counter + 1)) + 1))
-#define RandomNumber_Stage3(_Counter) (_Counter % 2 == 0 ? RandomNumber_Stage2(_Counter + ((int) (__COUNTER__ / 2))) : RandomNumber_Stage1(_Counter + ((int) (__COUNTER__ * 2))))
-#define RandomNumber_Stage4(_Counter) (__LINE__ % 2 == 0 ? RandomNumber_Stage3(_Counter + __LINE__) : RandomNumber_Stage2(_Counter + __LINE__ / 3))
-#define RandomNumber_Stage5(_Counter) (RandomNumber_Stage4(_Counter) * RandomNumber_Stage2(__LINE__))
-#define RandomNumber_Stage6(_Counter) (RandomNumber_Stage5(_Counter / 2) * RandomNumber_Stage4(_Counter / 3))
-#define RandomNumber_Stage7(_Counter) (RandomNumber_Stage6((_Counter)) + RandomNumber_Stage3(__LINE__ / 2))
-#define RandomNumber(_Min, _Max) (FUNCTIONAL_abs((RandomNumber_Stage7(__COUNTER__ + _Min + _Max) % (_Max + 1 - _Min) + _Min)))
+	constexpr CArgPack(_In_ const _Head& _First, _In_ const _Tail&... _Rest) : _m_Head(_First), _m_Tail(_Rest...) {}
 
-//FIXME
-#define RandomSeed() (RandomNumber_Stage7(((int) (__TIMESTAMP__[9] - '0' + __TIMESTAMP__[10] - '0' + __TIMESTAMP__[12] - '0' + __TIMESTAMP__[13] - '0' + __TIMESTAMP__[15] - '0' + __TIMESTAMP__[16] - '0' + __TIMESTAMP__[18] - '0' + __TIMESTAMP__[19] - '0'))) / 16777215)
+	constexpr functional_unsigned_size_t size() const {
+		return m_iCount;
+	}
+
+	template<functional_unsigned_size_t _Index> constexpr auto& get() {
+		static_assert(_Index < m_iCount, "CArgPack::get: index out of range");
+		if constexpr (_Index == 0) return this->_m_Head;
+		else return this->_m_Tail.template get<_Index - 1>();
+	}
+
+	template<functional_unsigned_size_t _Index> constexpr const auto& get() const {
+		static_assert(_Index < m_iCount, "CArgPack::get: index out of range");
+		if constexpr (_Index == 0) return this->_m_Head;
+		else return this->_m_Tail.template get<_Index - 1>();
+	}
+
+	//Calls _Func with the _Index-th argument. Q_FALSE if there's no such argument.
+	template<class _Function> constexpr Q_bool visit(_In_ functional_unsigned_size_t _Index, _In_ _Function&& _Func) {
+		if (!_Index) {
+			_Func(this->_m_Head);
+			return Q_TRUE;
+		}
+
+		return this->_m_Tail.visit(_Index - 1, _Func);
+	}
+
+	template<class _Function> constexpr Q_bool visit(_In_ functional_unsigned_size_t _Index, _In_ _Function&& _Func) const {
+		if (!_Index) {
+			_Func(this->_m_Head);
+			return Q_TRUE;
+		}
+
+		return this->_m_Tail.visit(_Index - 1, _Func);
+	}
+
+	CArgValue value(_In_ functional_unsigned_size_t _Index) const {
+		return _Index ? this->_m_Tail.value(_Index - 1) : CArgValue::From(this->_m_Head);
+	}
+private:
+	template<class... _Other> friend struct CArgPack;
+
+	_Head _m_Head;
+	CArgPack<_Tail...> _m_Tail;
+};
+
+//Arguments are taken by value, so arrays and string literals decay to pointers.
+template<class... _Ts> constexpr CArgPack<_Ts...> Q_make_arg_pack(_In_ _Ts... _Args) {
+	return CArgPack<_Ts...>(_Args...);
+}
+
+#define Q_max(_Which, _To) ((_Which < _To) ? _To : _Which)
+#define FUNCTIONAL_abs(_Which) (_Which > 0 ? _Which : -_Which)
 
 #define Q_RAND_MAX 32767
 
@@ -846,634 +2722,4048 @@ const int CTrustedRandom::_m_a_iDefaultSeedTable[1024] = {
 	9883, 27502, 13369, 10559, 23661, 19154, 27586, 30916, 9657, 30876, 12698, 29917, 5843, 2659, 3405, 28142, 18780, 21198, 26677, 17408, 2316, 27467, 16469, 24084, 15791, 1540, 645, 11191, 13934, 7183, 20432, 25815, 14928, 19428, 12826, 31701, 513, 31765, 1029, 30171, 32465, 5689, 4118, 7536, 4863, 28201, 11028, 17226, 7992, 10608, 19889, 355, 2395, 15100, 29037, 13391, 8319, 18202, 13494, 7884, 567, 929, 2644, 27547, 25877, 26732, 30724, 398, 27756, 17422, 10339, 24035, 26970, 2242, 21518, 26832, 11526, 26017, 17928, 30815, 20519, 24, 32604, 30076, 5062, 24984, 15875, 22348, 16196, 28047, 27399, 26817, 8094, 29592, 13289, 3180, 3056, 12782, 21313, 29330, 4920, 23591, 19620, 30081, 14173, 31263, 8138, 4132, 22896, 13106, 14064, 8918, 15153, 22958, 5244, 31348, 14805, 19079, 992, 19894, 9734, 30029, 20928, 9407, 23852, 8284, 20311, 24306, 2027, 15699, 9495, 19208, 8684, 25031, 14479, 1375, 12001, 14392, 10642, 4245, 16579, 32067, 10902, 23638, 13150, 23834, 14426, 11890, 16656, 17714, 29900, 8755, 21710, 32315, 10537, 12781, 15719, 8789, 13158, 32470, 9741, 17281, 25295, 19224, 30737, 22101, 2030, 23077, 2542, 13557, 15278, 11083, 16265, 20030, 8640, 17032, 32695, 21828, 10814, 29599, 8960, 1279, 5774, 25451, 16291, 19521, 17802, 13172, 30425, 30187, 2781, 3008, 10078, 8545, 5552, 30444, 10542, 7995, 10887, 17531, 30348, 1598, 13413, 25965, 26185, 5258, 28983, 30483, 23363, 12564, 15727, 28707, 3372, 8535, 17136, 9224, 20109, 18247, 3882, 4219, 29706, 31623, 21638, 10583, 16615, 22491, 23300, 5801, 31947, 1504, 25634, 6407, 5828, 26107, 1537, 2084, 31116, 8847, 16835, 8097, 29963, 883, 22839, 3621, 24860, 5539, 10168, 31407, 23956, 31541, 594, 29739, 21377, 30607, 25383, 32580, 7087, 3032, 25617, 13946, 28273, 14252, 19593, 12404, 157, 12820, 14024, 8343, 29145, 11957, 4139, 26071, 28693, 839, 30940, 31693, 13401, 16713, 18095, 522, 15553, 6131, 12106, 19884, 26566, 4717, 23945, 14639, 21694, 1598, 30241, 9861, 11686, 17927, 20355, 26472, 15904, 27761, 24835, 32751, 31672, 21348, 11577, 30559, 25451, 2938, 11175, 11076, 20586, 26547, 30109, 22721, 12315, 29034, 14938, 20517, 14177, 22663, 15988, 1726, 32029, 13303, 27258, 31474, 7669, 9817, 11479, 7819, 19796, 15098, 13049, 15187, 30641, 3844, 15795, 1505, 23061, 6898, 5344, 21170, 13015, 12359, 24138, 8572, 28586, 32640, 23498, 29374, 31963, 14919, 21680, 7068, 6611, 9705, 11876, 3050, 22243, 12810, 30798, 14983, 8257, 26520, 28404, 11244, 31309, 17405, 14946, 18180, 21273, 21657, 27599, 27711, 3369, 9839, 32381, 738, 10103, 24094, 24545, 28833, 9914, 3092, 17156, 12143, 9192, 4350, 17193, 30101, 9210, 9858, 6576, 9217, 7407, 24625, 27450, 28385, 19475, 14519, 28686, 29809, 16769, 32597, 31676, 13841, 17639, 14738, 10240, 10139, 30601, 19757, 9960, 18675, 22409, 1621, 57, 32224, 2149, 19996, 15888, 6170, 1217, 9514, 19653, 18340, 7527, 13998, 4628, 25947, 27020, 6043, 32639, 19408, 3157, 1552, 9198, 12883, 29593, 15639, 153, 15952, 29673, 12435, 9511, 16095, 26061, 17780, 22295, 18070, 10321, 23085, 18528, 6049, 11456, 13160, 8532, 5653, 28592, 8440, 25034, 13442, 830, 28431, 23932, 3784, 3739, 30641, 22446, 10027, 26312, 26728, 529, 31145, 9373, 4154, 25318, 22922, 23568, 18904, 26214, 19770, 22708, 22040, 8034, 23636, 896, 15013, 31527, 1023, 21970, 30965, 27812, 17789, 32179, 12668, 21199, 769, 5981, 1824, 7748, 7873, 8187, 22252, 31279, 4173, 1455, 6152, 31853, 25631, 30937, 30697, 8430, 22899, 25239, 1733, 5214, 4697, 9352, 2122, 4612, 2568, 1494, 15503, 22762, 17781, 29043, 13643, 31806, 29220, 27042, 2885, 4856, 26430, 21690, 2059, 2749, 15589, 1830, 6119, 8707, 28100, 11953, 6159, 19831, 14058, 769, 21788, 3227, 10712, 24416, 19901, 29108, 9432, 10691, 3501, 24803, 9617, 11012, 13538, 19090, 10713, 15475, 32520, 25873, 4810, 28301, 24365, 10625, 15896, 3339, 958, 6130, 18849, 9247, 22194, 1736, 13638, 27386, 19973, 355, 22266, 14225, 8296, 31231, 21784, 24481, 12855, 21208, 6906, 10992, 20139, 658, 31687, 15063, 337, 22489, 30604, 2813, 9146, 8261, 22159, 28517, 29556, 13952, 3808, 13227, 17466, 15274, 10288, 16266, 8808, 32764, 4582, 25762, 31154, 24236, 8048, 14712, 5140, 4369, 7895, 9663, 1292, 15624, 15767, 982, 21768, 17046, 12205, 31633, 282, 3279, 19697, 31292, 8947, 27126, 6310, 27613, 21775, 12005, 26448, 6586, 10029, 10671, 5829, 21019, 14082, 10117, 3207, 15697, 16686, 4566, 28241, 1015, 15983, 26298, 18672, 10872, 24853, 4241, 6484, 17874, 1718, 24807, 27623, 28057, 29218, 12956, 1566, 3902, 24985, 30529, 20045, 1681, 21820, 13252, 26047, 8069, 6594, 12368, 10502, 25907, 27500, 24431, 2704, 25122, 17723, 16498, 31611, 13766, 12384, 16658, 22186, 9030, 10228, 25175, 537, 32131, 25833, 9401, 14957, 5205, 9793, 32646, 15568, 1815, 18813, 26499, 17147, 8295, 18265, 10454, 1428, 7975, 26806, 6179, 14523, 4295, 18392, 24310, 14048, 8391, 29137, 26465, 19927, 375, 15421, 10982, 25134, 20994, 9008, 26774, 23742, 9642, 17261, 1659, 5760, 4181, 17625, 8756, 13986, 23625, 18735, 5343, 14042, 19764, 13044, 28220, 507, 5231, 22702, 11022, 24774, 23171, 30801, 10949, 10498, 493, 32506, 10331, 25295, 1822, 30943, 14972, 22583, 8646, 15750, 7913, 17158, 2898, 11318, 21790, 3291, 3763, 3244, 19507, 21888, 17762, 26638, 10240, 13175, 9633, 28197, 24964, 25301, 17923, 15046, 18056, 22100, 31278, 3985, 7295, 24227, 11488, 21983, 27313, 23552, 6960, 31989, 12184, 11785, 21783, 2174, 1418, 21967, 10030, 25400, 31385, 32301, 20921, 18925, 8120, 24152, 12517, 25253, 4895, 10934, 14926, 21530, 2544, 2036, 29636, 29036, 7450, 13395, 18255, 19990, 23933, 23362, 22640, 20001, 29520, 18226, 16042, 1687, 19648, 26022, 18753, 571, 8154, 20873, 12354, 15991, 17323, 22469, 22211, 29846, 9382, 10769, 620, 819, 22598, 13322, 11319, 3057, 5108, 18054, 20083, 6509, 2858, 3365, 21519, 24945, 30937, 553, 3349, 30571, 22536, 21639, 19573, 797, 4030, 29757, 4868, 20373, 5667, 14567, 27588, 18016, 20194, 22157, 23910, 11003, 10449, 5312, 5389, 10890, 16084, 31717, 11861, 5068, 32767, 27856, 15508, 19279, 8954, 22165, 31072, 20448, 26794, 32410, 15441, 25414, 29197, 3825, 8199, 11056, 11622, 24293, 30831, 24171, 7835, 10707, 32323, 21080, 1755, 10300, 21456, 31902, 12163, 16151, 18172, 15644, 23619, 14700, 29831, 1058, 10365, 16414, 12433, 10464, 21485, 1033, 22621, 1054, 17039, 20044, 29012, 9006, 13245, 27368, 14669, 10015, 29848, 8587, 3083, 9268, 4522, 12454, 16903, 5524, 19402, 32453, 27760, 14659, 21567, 30240, 4721, 26705, 5160, 15981, 21426, 16210, 795, 18681, 5153, 11022, 20748, 25335, 5362, 11641, 26480, 16920, 7908, 28389, 1443, 16220, 8647, 28534, 31879, 13351, 27963, 27862, 19823, 11671, 26298, 20523, 12347, 27157, 24793, 14406, 17604, 21802, 30666, 29725, 29562, 30100, 5926, 380, 16715, 410, 3305, 25591, 6855, 3484, 19903, 26659, 23170, 2286, 20094, 9990, 3770, 31975, 5875, 24011, 16954, 16948, 29153, 28090, 19582, 8306, 24135, 6248, 27928, 3069 
 };
 
-namespace
-#ifdef FUNCTIONAL_DONT_USE_ANONYMOUS_NAMESPACE
-	functional
-#endif //FUNCTIONAL_DONT_USE_ANONYMOUS_NAMESPACE
-{
-	functional_size_t Q_strlen(_In_z_ const char* _Str) {
-		const char* p = const_cast<char*>(&_Str[0]);
+constexpr functional_uint64_t Q_rotl64(_In_ functional_uint64_t _Value, _In_ int _Shift) {
+	return (_Value << _Shift) | (_Value >> ((64 - _Shift) & 63));
+}
 
-#ifdef FUNCTIONAL_USE_FASTEST_STRLEN
-		//Be careful: it was reverse engineered from hidden Windows API internals.
-		if (((unsigned char)(_Str) & 3) == 0)
-			goto main_loop;
-		do {
-			if (!*p++)
-				return p - 1 - _Str;
-		} while (((unsigned char) (p) & 3) != 0);
-		while (true) {
-			int v3;
-			do {
-			main_loop:
-				v3 = (*(unsigned long*)p + 0x7EFEFEFF) ^ ~*(unsigned long*)p;
-				p += 4;
-			} while ((v3 & 0x81010100) == 0);
-			int v4 = *((unsigned long*)p - 1);
-			if (!v4)
-				break;
-			if (!(*((unsigned char*)&(v4)+1)))
-				return p - 3 - _Str;
-			if ((v4 & 0xFF0000) == 0)
-				return p - 2 - _Str;
-			if ((v4 & 0xFF000000) == 0)
-				return p - 1 - _Str;
-		}
-		return p - 4 - _Str;
-#else
-		functional_size_t count = 0;
+constexpr functional_uint64_t Q_rotr64(_In_ functional_uint64_t _Value, _In_ int _Shift) {
+	return (_Value >> _Shift) | (_Value << ((64 - _Shift) & 63));
+}
 
-		for (; p[0] != '\0'; ++p, count++);
+//One step of splitmix64: advances _State by the golden gamma and returns the finalized value. Also our standard way to expand a seed.
+constexpr functional_uint64_t Q_splitmix64(_Inout_ functional_uint64_t& _State) {
+	functional_uint64_t z = (_State += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
 
-		return count;
-#endif //FUNCTIONAL_USE_FASTEST_STRLEN
+//Unbiased number in [0, _Range) with Lemire's multiply-shift: one multiplication, and a division only in the rare rejection case.
+template<class _Engine> constexpr functional_uint64_t Q_random_bounded(_Inout_ _Engine& _Generator, _In_ functional_uint64_t _Range) {
+	Q_SLOWASSERT(_Range && "Q_random_bounded: empty range");
+	functional_uint64_t high = 0;
+	functional_uint64_t low = Q_mul128(_Generator.rand(), _Range, high);
+	if (low < _Range) {
+		const functional_uint64_t threshold = (0 - _Range) % _Range;
+		while (low < threshold) low = Q_mul128(_Generator.rand(), _Range, high);
 	}
 
-	char* Q_strcpy(_Always_(_Post_z_) _Out_ char* _Destination, _In_z_ const char* _Source) {
-		if (!_Source) return _Destination;
-
-		if (_Source) {
-			const functional_size_t length = Q_strlen(_Source) + 1;
-			for (int idx = 0; idx < length; idx++) {
-				_Destination[idx] = _Source[idx];
-			}
-			_Destination[length + 1] = '\0';
-		}
+	return high;
+}
 
-		return _Destination;
+//The interface shared by our small-state engines, mirroring CTrustedRandom: srand(seed) to seed, rand() for raw 64 bits,
+//autorand(min, max) for a number in [min, max]. _Derived provides srand and rand.
+template<class _Derived> struct CRandomEngine {
+	constexpr functional_uint64_t autorand(_In_ functional_uint64_t _Min, _In_ functional_uint64_t _Max) {
+		Q_SLOWASSERT(_Min <= _Max && "autorand: _Min is greater than _Max");
+		const functional_uint64_t range = _Max - _Min + 1;
+		_Derived& self = static_cast<_Derived&>(*this);
+		//Only happens for the full [0, 2^64 - 1] range.
+		if (!range) return self.rand();
+
+		return _Min + Q_random_bounded(self, range);
 	}
+};
 
-	char* Q_strcat(_Inout_ char* _Destination, _In_z_ const char* _Source) {
-		if (!_Source) return _Destination;
+//splitmix64: 8 bytes of state, very fast, passes BigCrush. Mostly used to seed the other engines.
+typedef struct CSplitMix64 : CRandomEngine<CSplitMix64> {
+	constexpr explicit CSplitMix64(_In_opt_ functional_uint64_t _Seed = 0) : _m_iState(_Seed) {}
 
-		if (_Source) {
-			const int srcLength = Q_strlen(_Source);
-			const int destLength = Q_strlen(_Destination);
-			for (int idx = destLength; idx < destLength + srcLength; idx++) {
-				_Destination[idx] = _Source[idx - destLength];
-			}
-		}
+	constexpr void srand(_In_ functional_uint64_t _Seed) {
+		this->_m_iState = _Seed;
+	}
 
-		return _Destination;
+	constexpr functional_uint64_t rand() {
+		return Q_splitmix64(this->_m_iState);
 	}
+private:
+	functional_uint64_t _m_iState;
+} CSplitMix64;
 
-	functional_size_t Q_strcmp(_In_z_ const char* _Str1, _In_z_ const char* _Str2) {
-		for (; *_Str1 == *_Str2; ++_Str1, ++_Str2) {
-			if (*_Str1 == '\0') return 0;
-		}
+//xoshiro256**: 32 bytes of state, period 2^256 - 1, a handful of shifts/xors per number. Our default general purpose engine.
+typedef struct CXoshiro256 : CRandomEngine<CXoshiro256> {
+	constexpr explicit CXoshiro256(_In_opt_ functional_uint64_t _Seed = 0) : _m_a_iState{} {
+		this->srand(_Seed);
+	}
 
-		return Q_strlen(_Str1) < Q_strlen(_Str2) ? -1 : 1;
+	//Expands the seed with splitmix64, which never yields the forbidden all-zero state in practice.
+	constexpr void srand(_In_ functional_uint64_t _Seed) {
+		for (int idx = 0; idx < 4; idx++) this->_m_a_iState[idx] = Q_splitmix64(_Seed);
 	}
 
-	functional_size_t Q_strncmp(_In_reads_or_z_(_MaxCount) const char* _Str1, _In_reads_or_z_(_MaxCount) const char* _Str2, _In_ functional_unsigned_size_t _MaxCount) {
-		while (_MaxCount && *_Str1 && (*_Str1 == *_Str2)) ++_Str1, ++_Str2, --_MaxCount;
+	constexpr functional_uint64_t rand() {
+		functional_uint64_t* s = this->_m_a_iState;
+		const functional_uint64_t result = Q_rotl64(s[1] * 5, 7) * 9;
+		const functional_uint64_t t = s[1] << 17;
 
-		if (_MaxCount == 0) return 0;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = Q_rotl64(s[3], 45);
 
-		return(*(unsigned char*)_Str1 - *(unsigned char*)_Str2);
+		return result;
 	}
 
-	char* Q_strdup(_In_z_ const char* _Source) {
-		const auto buffer = static_cast<char*>(Q_malloc(Q_strlen(_Source) + 1));
-		Q_SLOWASSERT(buffer && "Failed to allocate buffer (size is dynamic) at Q_strdup");
-
-		Q_memcpy(buffer, _Source, Q_strlen(_Source));
-
-		buffer[Q_strlen(_Source) + 1] = '\0';
+	//Same as 2^128 calls to rand(). Every jump lands on a new non-overlapping substream of length 2^128.
+	constexpr void jump() {
+		constexpr functional_uint64_t polynomial[4] = { 0x180EC6D33CFD0ABAull, 0xD5A61266F0C9392Cull, 0xA9582618E03FC9AAull, 0x39ABDC4529B1661Cull };
+		this->JumpBy(polynomial);
+	}
 
-		return buffer;
+	//Same as 2^192 calls to rand(): 2^64 long jumps apart, each of them holding 2^64 jump() substreams.
+	constexpr void long_jump() {
+		constexpr functional_uint64_t polynomial[4] = { 0x76E15D3EFEFDCBBFull, 0xC5004E441C522FB3ull, 0x77710069854EE241ull, 0x39109BB02ACBE635ull };
+		this->JumpBy(polynomial);
 	}
 
-	int Q_abs(_In_ functional_size_t _Number) {
-		return _Number < 0 ? -_Number : _Number;
+	//Hands out the current substream and moves ourselves to the next one: no allocation, reproducible, and children never overlap.
+	//CXoshiro256 worker = master.Split(); for each worker thread.
+	constexpr CXoshiro256 Split() {
+		CXoshiro256 child = *this;
+		this->jump();
+		return child;
+	}
+private:
+	friend struct CXoshiro256x8;
+
+	constexpr void JumpBy(_In_reads_(4) const functional_uint64_t* _Polynomial) {
+		functional_uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+		for (int word = 0; word < 4; word++) {
+			for (int bit = 0; bit < 64; bit++) {
+				if (_Polynomial[word] & (1ull << bit)) {
+					s0 ^= this->_m_a_iState[0];
+					s1 ^= this->_m_a_iState[1];
+					s2 ^= this->_m_a_iState[2];
+					s3 ^= this->_m_a_iState[3];
+				}
+				this->rand();
+			}
+		}
+		this->_m_a_iState[0] = s0;
+		this->_m_a_iState[1] = s1;
+		this->_m_a_iState[2] = s2;
+		this->_m_a_iState[3] = s3;
 	}
 
-	char* Q_itoa_internal(_Pre_notnull_ _Always_(_Post_z_) _Out_opt_ char* _Dest, _In_ functional_unsigned_size_t _Size, _In_ int _Value) {
-		char buf[INT_STR_SIZE];
-		char* p = &buf[INT_STR_SIZE - 1];
-		*p = '\0';
-		int i = _Value;
+	functional_uint64_t _m_a_iState[4];
+} CXoshiro256;
 
-		do {
-			*(--p) = Q_abs(i % 10) + '0';
-			i /= 10;
-		} while (i);
+//PCG64 (XSL RR output over a 128 bit LCG): 32 bytes of state, period 2^128 per stream, 2^127 selectable streams.
+typedef struct CPcg64 : CRandomEngine<CPcg64> {
+	constexpr explicit CPcg64(_In_opt_ functional_uint64_t _Seed = 0, _In_opt_ functional_uint64_t _Stream = 0) : _m_iStateHigh(0), _m_iStateLow(0), _m_iIncrementHigh(0), _m_iIncrementLow(1) {
+		this->srand(_Seed, _Stream);
+	}
 
-		if (_Value < 0) {
-			*(--p) = '-';
-		}
-		const auto len = static_cast<functional_unsigned_size_t>(&buf[INT_STR_SIZE] - p);
-		if (len > _Size) {
-			return Q_nullptr;
-		}
-		return static_cast<char*>(Q_memcpy(_Dest, p, len));
+	constexpr void srand(_In_ functional_uint64_t _Seed, _In_opt_ functional_uint64_t _Stream = 0) {
+		functional_uint64_t mixer = _Stream;
+		const functional_uint64_t streamHigh = Q_splitmix64(mixer), streamLow = Q_splitmix64(mixer);
+		//The increment has to be odd: (stream << 1) | 1.
+		this->_m_iIncrementHigh = (streamHigh << 1) | (streamLow >> 63);
+		this->_m_iIncrementLow = (streamLow << 1) | 1;
+
+		this->_m_iStateHigh = this->_m_iStateLow = 0;
+		this->Step();
+		mixer = _Seed;
+		this->Add(this->_m_iStateHigh, this->_m_iStateLow, Q_splitmix64(mixer), Q_splitmix64(mixer));
+		this->Step();
 	}
 
-	functional_size_t Q_integer_to_octal(_In_ functional_size_t _Number) {
-		functional_size_t modulo, octal = 0, idx = 1;
+	constexpr functional_uint64_t rand() {
+		this->Step();
+		return Q_rotr64(this->_m_iStateHigh ^ this->_m_iStateLow, static_cast<int>(this->_m_iStateHigh >> 58));
+	}
 
-		while (_Number != 0) {
-			modulo = _Number % 8;
-			_Number = _Number / 8;
-			octal = octal + (modulo * idx);
-			idx = idx * 10;
+	//Same as _Delta calls to rand(), in O(log _Delta) (Brown's LCG jump-ahead).
+	constexpr void advance(_In_ functional_uint64_t _Delta) {
+		functional_uint64_t multiplierHigh = m_iMultiplierHigh, multiplierLow = m_iMultiplierLow;
+		functional_uint64_t incrementHigh = this->_m_iIncrementHigh, incrementLow = this->_m_iIncrementLow;
+		functional_uint64_t totalMultiplierHigh = 0, totalMultiplierLow = 1, totalIncrementHigh = 0, totalIncrementLow = 0;
+
+		for (; _Delta; _Delta >>= 1) {
+			if (_Delta & 1) {
+				Multiply(totalMultiplierHigh, totalMultiplierLow, multiplierHigh, multiplierLow);
+				Multiply(totalIncrementHigh, totalIncrementLow, multiplierHigh, multiplierLow);
+				Add(totalIncrementHigh, totalIncrementLow, incrementHigh, incrementLow);
+			}
+			//increment = (multiplier + 1) * increment, multiplier = multiplier^2
+			functional_uint64_t nextHigh = multiplierHigh, nextLow = multiplierLow;
+			Add(nextHigh, nextLow, 0, 1);
+			Multiply(incrementHigh, incrementLow, nextHigh, nextLow);
+			Multiply(multiplierHigh, multiplierLow, multiplierHigh, multiplierLow);
 		}
 
-		return octal;
+		Multiply(this->_m_iStateHigh, this->_m_iStateLow, totalMultiplierHigh, totalMultiplierLow);
+		Add(this->_m_iStateHigh, this->_m_iStateLow, totalIncrementHigh, totalIncrementLow);
 	}
 
-	char* Q_itoa(_In_ functional_size_t _Number) {
-		const auto buffer = static_cast<char*>(Q_malloc(INT_STR_SIZE));
-		Q_SLOWASSERT(buffer && "Failed to allocate buffer (size=INT_STR_SIZE) at Q_itoa");
-		Q_itoa_internal(buffer, INT_STR_SIZE, _Number);
-		return buffer;
+	//A child generator on its own stream (own LCG increment), seeded from our output. O(1), no allocation, reproducible:
+	//CPcg64 worker = master.Split(workerIndex);
+	constexpr CPcg64 Split(_In_ functional_uint64_t _Stream) {
+		return CPcg64(this->rand(), _Stream);
 	}
+private:
+	static constexpr functional_uint64_t m_iMultiplierHigh = 0x2360ED051FC65DA4ull;
+	static constexpr functional_uint64_t m_iMultiplierLow = 0x4385DF649FCCF645ull;
 
-	functional_size_t Q_atoi(char* s) {
-		int c = 1, a = 0, sign, end, base = 1;
+	static constexpr void Add(_Inout_ functional_uint64_t& _High, _Inout_ functional_uint64_t& _Low, _In_ functional_uint64_t _AddHigh, _In_ functional_uint64_t _AddLow) {
+		const functional_uint64_t low = _Low + _AddLow;
+		_High += _AddHigh + (low < _Low ? 1 : 0);
+		_Low = low;
+	}
 
-		if (s[0] == '-')
-			sign = -1;
-		else if (s[0] <= '9' && s[0] >= '0')
-			sign = 1;
-		else if (s[0] == '+')
-			sign = 2;
-		else
-			return 0;
+	//Multiplication modulo 2^128 only needs the low half of the cross products.
+	static constexpr void Multiply(_Inout_ functional_uint64_t& _High, _Inout_ functional_uint64_t& _Low, _In_ functional_uint64_t _ByHigh, _In_ functional_uint64_t _ByLow) {
+		functional_uint64_t high = 0;
+		const functional_uint64_t low = Q_mul128(_Low, _ByLow, high);
+		_High = high + _High * _ByLow + _Low * _ByHigh;
+		_Low = low;
+	}
 
-		while (s[c] != '\n' && s[c] <= '9' && s[c] >= '0')
-			c++;
+	constexpr void Step() {
+		Multiply(this->_m_iStateHigh, this->_m_iStateLow, m_iMultiplierHigh, m_iMultiplierLow);
+		Add(this->_m_iStateHigh, this->_m_iStateLow, this->_m_iIncrementHigh, this->_m_iIncrementLow);
+	}
 
-		if (sign == -1)
-			end = 1;
-		else if (sign == 1)
-			end = 0;
-		else {
-			end = 1;
-			sign = 1;
-		}
+	functional_uint64_t _m_iStateHigh, _m_iStateLow;
+	functional_uint64_t _m_iIncrementHigh, _m_iIncrementLow;
+} CPcg64;
 
-		for (int i = c - 1; i >= end; i--) {
-			a += (s[i] - '0') * base;
-			base *= 10;
-		}
+//Eight independent xoshiro256** lanes stepped together. The state is laid out lane by lane (structure of arrays), so one step is
+//a few vector shifts/xors/adds over all lanes: with FUNCTIONAL_USE_AVX2 two 256 bit registers per state word, otherwise plain loops
+//the compiler vectorizes on its own. Meant for filling big buffers; for one number at a time CXoshiro256 is cheaper.
+typedef struct CXoshiro256x8 {
+	static constexpr functional_unsigned_size_t m_iLanes = 8;
 
-		return sign * a;
+	explicit CXoshiro256x8(_In_opt_ functional_uint64_t _Seed = 0) {
+		this->srand(_Seed);
 	}
 
-	functional_size_t Q_pow(_In_ functional_size_t _Base, _In_ functional_size_t _Power) {
-		if (_Power == 0) return 1;
-		else if ((_Power % 2) == 0)
-			return Q_pow(_Base, _Power / 2) * Q_pow(_Base, _Power / 2);
-		else
-			return _Base * Q_pow(_Base, _Power / 2) * Q_pow(_Base, _Power / 2);
-	}
+	//Lanes are consecutive jump() substreams of one CXoshiro256, so they're guaranteed not to overlap.
+	void srand(_In_ functional_uint64_t _Seed) {
+		CXoshiro256 lane(_Seed);
+		this->_m_Fallback = lane;
+		this->_m_Fallback.long_jump();
 
-	char* Q_ftoa(_In_ float _Value, _In_opt_ functional_size_t _Precision = 2) {
-		const auto buffer = static_cast<char*>(Q_malloc(FLOAT_STR_SIZE));
-		int b, l, i = 0;
-		if (_Value < 0.f) {
-			buffer[i++] = '-';
-			_Value *= -1;
+		for (functional_unsigned_size_t idx = 0; idx < m_iLanes; idx++) {
+			for (functional_unsigned_size_t word = 0; word < 4; word++) this->_m_a_iState[word][idx] = lane._m_a_iState[word];
+			lane.jump();
 		}
-		int a = (int)_Value;
-		_Value -= a;
-		int k = 0;
-		while (true) {
-			l = Q_pow(10, k);
-			int m = a / l;
-			if (m == 0) {
-				break;
+	}
+
+	//Uniform integers in [_Min, _Max], unbiased (Lemire's multiply-shift on the upper 32 bits, rare rejections redrawn from a scalar engine).
+	void FillRandom(_Out_writes_(_Count) int* _Output, _In_ functional_unsigned_size_t _Count, _In_ int _Min, _In_ int _Max) {
+		Q_ASSERT(_Min <= _Max && "FillRandom: _Min is greater than _Max");
+		const functional_uint64_t range = static_cast<functional_uint64_t>(static_cast<long long>(_Max) - _Min) + 1;
+		const functional_uint64_t threshold = ((1ull << 32) - range) % range;
+		functional_uint64_t block[m_iLanes];
+
+		for (functional_unsigned_size_t done = 0; done < _Count; done += m_iLanes) {
+			this->Next(block);
+			const functional_unsigned_size_t count = _Count - done < m_iLanes ? _Count - done : m_iLanes;
+			for (functional_unsigned_size_t lane = 0; lane < count; lane++) {
+				functional_uint64_t product = (block[lane] >> 32) * range;
+				while ((product & 0xFFFFFFFF) < threshold) product = (this->_m_Fallback.rand() >> 32) * range;
+				_Output[done + lane] = static_cast<int>(static_cast<long long>(_Min) + static_cast<long long>(product >> 32));
 			}
-			k++;
 		}
-		k--;
-		for (l = k + 1; l > 0; l--) {
-			b = Q_pow(10, l - 1);
-			const int c = a / b;
-			buffer[i++] = c + '0';
-			a %= b;
+	}
+
+	//Uniform floats in [0, 1) with all 24 mantissa bits random.
+	void FillRandomFloat(_Out_writes_(_Count) float* _Output, _In_ functional_unsigned_size_t _Count) {
+		functional_uint64_t block[m_iLanes];
+
+		for (functional_unsigned_size_t done = 0; done < _Count; done += m_iLanes) {
+			this->Next(block);
+			const functional_unsigned_size_t count = _Count - done < m_iLanes ? _Count - done : m_iLanes;
+			for (functional_unsigned_size_t lane = 0; lane < count; lane++) _Output[done + lane] = static_cast<float>(block[lane] >> 40) * (1.0f / 16777216.0f);
 		}
+	}
 
-		if (_Precision != 0)
-			buffer[i++] = '.';
+	//Uniform doubles in [0, 1) with all 53 mantissa bits random.
+	void FillRandomDouble(_Out_writes_(_Count) double* _Output, _In_ functional_unsigned_size_t _Count) {
+		functional_uint64_t block[m_iLanes];
 
-		for (l = 0; l < _Precision; l++) {
-			_Value *= 10.0;
-			b = (int)_Value;
-			buffer[i++] = b + '0';
-			_Value -= b;
+		for (functional_unsigned_size_t done = 0; done < _Count; done += m_iLanes) {
+			this->Next(block);
+			const functional_unsigned_size_t count = _Count - done < m_iLanes ? _Count - done : m_iLanes;
+			for (functional_unsigned_size_t lane = 0; lane < count; lane++) _Output[done + lane] = static_cast<double>(block[lane] >> 11) * (1.0 / 9007199254740992.0);
 		}
+	}
 
-		buffer[i] = '\0';
+	void FillBytes(_Out_writes_bytes_(_Size) void* _Output, _In_ functional_unsigned_size_t _Size) {
+		auto output = static_cast<unsigned char*>(_Output);
+		functional_uint64_t block[m_iLanes];
 
-		return buffer;
+		while (_Size) {
+			this->Next(block);
+			const functional_unsigned_size_t count = _Size < sizeof(block) ? _Size : sizeof(block);
+			for (functional_unsigned_size_t idx = 0; idx < count; idx++) output[idx] = static_cast<unsigned char>(block[idx >> 3] >> ((idx & 7) * 8));
+			output += count;
+			_Size -= count;
+		}
 	}
 
-	functional_size_t Q_toupper(_In_ functional_size_t _C) {
-		if (_C >= 'a' && _C <= 'z') {
-			_C -= ('a' - 'A');
+	//One step of every lane.
+	void Next(_Out_writes_(m_iLanes) functional_uint64_t* _Output) {
+#ifdef FUNCTIONAL_USE_AVX2
+		for (functional_unsigned_size_t half = 0; half < m_iLanes; half += 4) {
+			__m256i s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&this->_m_a_iState[0][half]));
+			__m256i s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&this->_m_a_iState[1][half]));
+			__m256i s2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&this->_m_a_iState[2][half]));
+			__m256i s3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&this->_m_a_iState[3][half]));
+
+			//rotl(s1 * 5, 7) * 9 without a 64 bit vector multiply: x * 5 = (x << 2) + x, x * 9 = (x << 3) + x.
+			__m256i result = _mm256_add_epi64(_mm256_slli_epi64(s1, 2), s1);
+			result = _mm256_or_si256(_mm256_slli_epi64(result, 7), _mm256_srli_epi64(result, 57));
+			result = _mm256_add_epi64(_mm256_slli_epi64(result, 3), result);
+			const __m256i t = _mm256_slli_epi64(s1, 17);
+
+			s2 = _mm256_xor_si256(s2, s0);
+			s3 = _mm256_xor_si256(s3, s1);
+			s1 = _mm256_xor_si256(s1, s2);
+			s0 = _mm256_xor_si256(s0, s3);
+			s2 = _mm256_xor_si256(s2, t);
+			s3 = _mm256_or_si256(_mm256_slli_epi64(s3, 45), _mm256_srli_epi64(s3, 19));
+
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(&this->_m_a_iState[0][half]), s0);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(&this->_m_a_iState[1][half]), s1);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(&this->_m_a_iState[2][half]), s2);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(&this->_m_a_iState[3][half]), s3);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(&_Output[half]), result);
+		}
+#else
+		functional_uint64_t(&s)[4][m_iLanes] = this->_m_a_iState;
+		for (functional_unsigned_size_t lane = 0; lane < m_iLanes; lane++) {
+			_Output[lane] = Q_rotl64(s[1][lane] * 5, 7) * 9;
+			const functional_uint64_t t = s[1][lane] << 17;
+
+			s[2][lane] ^= s[0][lane];
+			s[3][lane] ^= s[1][lane];
+			s[1][lane] ^= s[2][lane];
+			s[0][lane] ^= s[3][lane];
+			s[2][lane] ^= t;
+			s[3][lane] = Q_rotl64(s[3][lane], 45);
 		}
+#endif //FUNCTIONAL_USE_AVX2
+	}
+private:
+	functional_uint64_t _m_a_iState[4][m_iLanes];
+	CXoshiro256 _m_Fallback;
+} CXoshiro256x8;
 
-		return _C;
+//Compile-time randomness: every constexpr engine above works in constant expressions, Q_CONSTEXPR_SEED() gives them a seed
+//unique to the translation unit, line and use (__COUNTER__). Change FUNCTIONAL_CONSTEXPR_SEED to reshuffle a whole build.
+#define Q_CONSTEXPR_SEED() (Q_hash_literal(__FILE__, FUNCTIONAL_CONSTEXPR_SEED) ^ Q_hash_integer((static_cast<functional_uint64_t>(__LINE__) << 32) | __COUNTER__))
+
+template<class _Ty> constexpr _Ty Q_constexpr_random_number(_In_ functional_uint64_t _Seed, _In_ _Ty _Min, _In_ _Ty _Max) {
+	CSplitMix64 generator(_Seed);
+	return static_cast<_Ty>(static_cast<long long>(_Min) + static_cast<long long>(generator.autorand(0, static_cast<functional_uint64_t>(static_cast<long long>(_Max) - static_cast<long long>(_Min)))));
+}
+
+//A number in [_Min, _Max] folded at compile time, e.g. int key = RandomNumber(0, 70000). The integral_constant forces the evaluation.
+#define RandomNumber(_Min, _Max) (integral_constant<decltype((_Min) + (_Max)), Q_constexpr_random_number<decltype((_Min) + (_Max))>(Q_CONSTEXPR_SEED(), (_Min), (_Max))>::value)
+
+//A compile-time CTrustedRandom::srand position in [0, 1023], different on each build of the file (__TIMESTAMP__).
+//Use Q_random_seed() for a runtime one.
+#define RandomSeed() (integral_constant<int, Q_constexpr_random_number<int>(Q_CONSTEXPR_SEED() ^ Q_hash_literal(__TIMESTAMP__), 0, 1023)>::value)
+
+//Fixed size array usable in constant expressions, for the tables below.
+template<class _Ty, functional_unsigned_size_t _Size> struct CConstexprArray {
+	constexpr _Ty& operator[](_In_ functional_unsigned_size_t _Index) {
+		return this->m_a_Data[_Index];
 	}
 
-	char Q_toupper(_In_ char _C) {
-		if (_C >= 'a' && _C <= 'z') {
-			_C -= ('a' - 'A');
-		}
+	constexpr const _Ty& operator[](_In_ functional_unsigned_size_t _Index) const {
+		return this->m_a_Data[_Index];
+	}
 
-		return _C;
+	constexpr const _Ty* data() const {
+		return this->m_a_Data;
 	}
 
-	char* Q_itohexa_helper(_In_ char* _Dest, _In_ functional_uintptr_t _Val) {
-		if (_Val >= 16) {
-			_Dest = Q_itohexa_helper(_Dest, _Val / 16);
-		}
-		*_Dest++ = "0123456789abcdef"[_Val & 15];
-		return _Dest;
+	constexpr functional_unsigned_size_t size() const {
+		return _Size;
 	}
 
-	char* Q_itohexa(_In_ functional_uintptr_t _Val) {
-		const auto buffer = static_cast<char*>(Q_malloc(32));
-		Q_SLOWASSERT(buffer && "Failed to allocate buffer (size=32) at Q_itohexa");
-		*Q_itohexa_helper(buffer, _Val) = '\0';
+	constexpr const _Ty* begin() const {
+		return this->m_a_Data;
+	}
 
-		return buffer;
+	constexpr const _Ty* end() const {
+		return this->m_a_Data + _Size;
 	}
 
-	char* Q_itohexa_upper(_In_ functional_uintptr_t _Val) {
-		char* buffer = Q_itohexa(_Val);
-		const functional_size_t len = Q_strlen(buffer);
+	_Ty m_a_Data[_Size];
+};
+
+//Fisher-Yates shuffle of 0 .. _Size - 1: static constexpr auto order = Q_constexpr_permutation<256>(Q_CONSTEXPR_SEED());
+template<functional_unsigned_size_t _Size, class _Ty = functional_unsigned_size_t> constexpr CConstexprArray<_Ty, _Size> Q_constexpr_permutation(_In_ functional_uint64_t _Seed) {
+	CConstexprArray<_Ty, _Size> result{};
+	for (functional_unsigned_size_t idx = 0; idx < _Size; idx++) result[idx] = static_cast<_Ty>(idx);
+
+	CXoshiro256 generator(_Seed);
+	for (functional_unsigned_size_t idx = _Size; idx > 1; idx--) {
+		const functional_unsigned_size_t other = static_cast<functional_unsigned_size_t>(Q_random_bounded(generator, idx));
+		const _Ty swap = result[idx - 1];
+		result[idx - 1] = result[other];
+		result[other] = swap;
+	}
+
+	return result;
+}
+
+//_Size numbers in [_Min, _Max], e.g. a seed table that costs nothing at runtime.
+template<functional_unsigned_size_t _Size, class _Ty = int> constexpr CConstexprArray<_Ty, _Size> Q_constexpr_random_table(_In_ functional_uint64_t _Seed, _In_ _Ty _Min, _In_ _Ty _Max) {
+	CConstexprArray<_Ty, _Size> result{};
+	CXoshiro256 generator(_Seed);
+	for (functional_unsigned_size_t idx = 0; idx < _Size; idx++) {
+		result[idx] = static_cast<_Ty>(static_cast<long long>(_Min) + static_cast<long long>(generator.autorand(0, static_cast<functional_uint64_t>(static_cast<long long>(_Max) - static_cast<long long>(_Min)))));
+	}
+
+	return result;
+}
+
+//A fresh 64 bit seed on every call, computed at runtime (unlike RandomSeed(), which is baked into the binary).
+//Mixes whatever entropy we can reach without the CRT: the OS (FUNCTIONAL_OS_ENTROPY hook or getrandom with FUNCTIONAL_USE_LINUX_SYSCALLS),
+//RDRAND (FUNCTIONAL_USE_RDRAND), the cycle counter, stack and image addresses (ASLR) and a per-process call counter, all through splitmix64.
+inline functional_uint64_t Q_random_seed() {
+	static volatile functional_uint64_t counter = 0;
+	const functional_uint64_t invocation = Q_atomic_fetch_add(&counter, 1ull);
+	int onStack = 0;
+
+	functional_uint64_t state = Q_read_cycle_counter();
+	functional_uint64_t seed = Q_splitmix64(state);
+	state ^= reinterpret_cast<functional_uintptr_t>(&onStack);
+	seed ^= Q_splitmix64(state);
+	state ^= reinterpret_cast<functional_uintptr_t>(&counter) + invocation;
+	seed ^= Q_splitmix64(state);
+
+#ifdef FUNCTIONAL_OS_ENTROPY
+	functional_uint64_t os = 0;
+	//Expected to fill the buffer with _Size random bytes, e.g a wrapper around getrandom/BCryptGenRandom.
+	FUNCTIONAL_OS_ENTROPY(&os, sizeof(os));
+	state ^= os;
+	seed ^= Q_splitmix64(state);
+#elif defined(FUNCTIONAL_USE_LINUX_SYSCALLS)
+	functional_uint64_t os = 0;
+	if (Q_linux_syscall(Q_LINUX_SYS_GETRANDOM, reinterpret_cast<long>(&os), sizeof(os), 0) == sizeof(os)) {
+		state ^= os;
+		seed ^= Q_splitmix64(state);
+	}
+#endif //FUNCTIONAL_OS_ENTROPY
+
+#if defined(FUNCTIONAL_USE_RDRAND) && (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+	unsigned long long hardware = 0;
+	if (__builtin_ia32_rdrand64_step(&hardware)) {
+		state ^= hardware;
+		seed ^= Q_splitmix64(state);
+	}
+#endif //FUNCTIONAL_USE_RDRAND
+
+	//Timing jitter of everything above.
+	state ^= Q_read_cycle_counter();
+	return seed ^ Q_splitmix64(state);
+}
+
+//Floating point helpers for the distributions below. constexpr and CRT free, accurate to an ulp or two, no errno.
+//_Value * 2^_Exponent.
+constexpr double Q_ldexp(_In_ double _Value, _In_ int _Exponent) {
+	for (; _Exponent > 32; _Exponent -= 32) _Value *= 0x1p32;
+	for (; _Exponent < -32; _Exponent += 32) _Value *= 0x1p-32;
+
+	const double scale = static_cast<double>(1ull << (_Exponent < 0 ? -_Exponent : _Exponent));
+	return _Exponent < 0 ? _Value / scale : _Value * scale;
+}
+
+//Splits a positive finite _Value into mantissa [1, 2) and exponent, by a binary search over powers of two.
+constexpr double Q_frexp(_In_ double _Value, _Out_ int& _Exponent) {
+	_Exponent = 0;
+	if (_Value < 0x1p-1000) {
+		_Value *= 0x1p64;
+		_Exponent -= 64;
+	}
+
+	for (int shift = 512; shift; shift >>= 1) {
+		const double power = Q_ldexp(1.0, shift);
+		if (_Value >= power) {
+			_Value /= power;
+			_Exponent += shift;
+		}
+		if (_Value * power < 2.0) {
+			_Value *= power;
+			_Exponent -= shift;
+		}
+	}
+
+	return _Value;
+}
+
+constexpr double Q_sqrt(_In_ double _Value) {
+	if (!(_Value > 0.0) || _Value == __builtin_huge_val()) return _Value < 0.0 ? __builtin_nan("") : _Value;
+
+	int exponent = 0;
+	double mantissa = Q_frexp(_Value, exponent);
+	if (exponent & 1) {
+		mantissa *= 2.0;
+		exponent--;
+	}
+
+	//Newton from above on [1, 4): 25% error at worst, squared on every step.
+	double root = (mantissa + 1.0) * 0.5;
+	for (int idx = 0; idx < 6; idx++) root = (root + mantissa / root) * 0.5;
+
+	return Q_ldexp(root, exponent / 2);
+}
+
+//Natural logarithm: reduce to [sqrt(1/2), sqrt(2)) and sum the atanh series 2 * (s + s^3 / 3 + ...), s = (m - 1) / (m + 1).
+constexpr double Q_log(_In_ double _Value) {
+	if (!(_Value > 0.0)) return _Value == 0.0 ? -__builtin_huge_val() : __builtin_nan("");
+	if (_Value == __builtin_huge_val()) return _Value;
+
+	int exponent = 0;
+	double mantissa = Q_frexp(_Value, exponent);
+	if (mantissa > 1.4142135623730951) {
+		mantissa *= 0.5;
+		exponent++;
+	}
+
+	const double s = (mantissa - 1.0) / (mantissa + 1.0), square = s * s;
+	double series = 0.0;
+	for (int term = 23; term > 1; term -= 2) series = (series + 1.0 / term) * square;
+
+	return exponent * 0.6931471805599453 + 2.0 * s * (1.0 + series);
+}
+
+//e^_Value: reduce by k * ln(2) (split in two parts so the reduction is exact), Taylor on |r| <= ln(2) / 2, scale by 2^k.
+constexpr double Q_exp(_In_ double _Value) {
+	if (_Value != _Value) return _Value;
+	if (_Value > 709.782712893384) return __builtin_huge_val();
+	if (_Value < -745.1332191019412) return 0.0;
+
+	const long long k = static_cast<long long>(_Value * 1.4426950408889634 + (_Value < 0.0 ? -0.5 : 0.5));
+	const double r = (_Value - k * 6.93147180369123816490e-01) - k * 1.90821492927058770002e-10;
+
+	double series = 1.0;
+	for (int term = 14; term; term--) series = 1.0 + series * r / term;
+
+	return Q_ldexp(series, static_cast<int>(k));
+}
+
+//log(Gamma(_Value)) for _Value > 0: Stirling series, shifting small arguments up to 7 first.
+constexpr double Q_lgamma(_In_ double _Value) {
+	constexpr double coefficients[10] = {
+		8.333333333333333e-02, -2.777777777777778e-03, 7.936507936507937e-04, -5.952380952380952e-04, 8.417508417508418e-04,
+		-1.917526917526918e-03, 6.410256410256410e-03, -2.955065359477124e-02, 1.796443723688307e-01, -1.39243221690590e+00
+	};
+
+	if (_Value == 1.0 || _Value == 2.0) return 0.0;
+
+	const int shift = _Value < 7.0 ? static_cast<int>(7.0 - _Value) : 0;
+	double x = _Value + shift;
+	const double inverseSquare = 1.0 / (x * x);
+
+	double series = coefficients[9];
+	for (int idx = 8; idx >= 0; idx--) series = series * inverseSquare + coefficients[idx];
+
+	double result = series / x + 0.9189385332046727 + (x - 0.5) * Q_log(x) - x;
+	for (int idx = 0; idx < shift; idx++) {
+		x -= 1.0;
+		result -= Q_log(x);
+	}
+
+	return result;
+}
+
+//Raw 64 random bits from any of our engines. Distributions draw through this, so they accept every generator.
+template<class _Engine> constexpr functional_uint64_t Q_random_bits(_Inout_ _Engine& _Generator) {
+	return _Generator.rand();
+}
+
+//CTrustedRandom has no raw output, glue four 16 bit draws together.
+inline functional_uint64_t Q_random_bits(_Inout_ CTrustedRandom& _Generator) {
+	functional_uint64_t result = 0;
+	for (int idx = 0; idx < 4; idx++) result = (result << 16) | (static_cast<functional_uint64_t>(_Generator.autorand(0, 0xFFFF)) & 0xFFFF);
+
+	return result;
+}
+
+//Uniform double in [0, 1) with all 53 mantissa bits random.
+template<class _Engine> constexpr double Q_random_double(_Inout_ _Engine& _Generator) {
+	return static_cast<double>(Q_random_bits(_Generator) >> 11) * 0x1p-53;
+}
+
+//Uniform float in [0, 1) with all 24 mantissa bits random.
+template<class _Engine> constexpr float Q_random_float(_Inout_ _Engine& _Generator) {
+	return static_cast<float>(Q_random_bits(_Generator) >> 40) * 0x1p-24f;
+}
+
+//Uniform double in (0, 1), safe to take the logarithm of.
+template<class _Engine> constexpr double Q_random_double_open(_Inout_ _Engine& _Generator) {
+	return (static_cast<double>(Q_random_bits(_Generator) >> 12) + 0.5) * 0x1p-52;
+}
+
+//Ziggurat layer tables (Marsaglia & Tsang, 256 layers as in Doornik's ZIGNOR), built at compile time.
+//m_a_flX[0] is the width of the virtual base strip, m_a_flX[1] the start of the tail, m_a_flX[256] is 0, m_a_flF holds the unnormalized density at m_a_flX.
+typedef struct CZigguratTable {
+	double m_a_flX[257];
+	double m_a_flF[257];
+} CZigguratTable;
+
+constexpr double Q_ziggurat_density(_In_ Q_bool _Normal, _In_ double _Value) {
+	return _Normal ? Q_exp(-0.5 * _Value * _Value) : Q_exp(-_Value);
+}
+
+constexpr CZigguratTable Q_ziggurat_table(_In_ Q_bool _Normal, _In_ double _Tail, _In_ double _Area) {
+	CZigguratTable table{};
+	table.m_a_flX[0] = _Area / Q_ziggurat_density(_Normal, _Tail);
+	table.m_a_flX[1] = _Tail;
+
+	for (int idx = 2; idx < 256; idx++) {
+		const double density = _Area / table.m_a_flX[idx - 1] + Q_ziggurat_density(_Normal, table.m_a_flX[idx - 1]);
+		table.m_a_flX[idx] = _Normal ? Q_sqrt(-2.0 * Q_log(density)) : -Q_log(density);
+	}
+
+	table.m_a_flX[256] = 0.0;
+	for (int idx = 0; idx < 257; idx++) table.m_a_flF[idx] = Q_ziggurat_density(_Normal, table.m_a_flX[idx]);
+
+	return table;
+}
+
+#define FUNCTIONAL_ZIGGURAT_NORMAL_TAIL 3.6541528853610088
+#define FUNCTIONAL_ZIGGURAT_EXPONENTIAL_TAIL 7.69711747013104972
+
+inline constexpr CZigguratTable gs_ZigguratNormal = Q_ziggurat_table(Q_TRUE, FUNCTIONAL_ZIGGURAT_NORMAL_TAIL, 0.00492867323399);
+inline constexpr CZigguratTable gs_ZigguratExponential = Q_ziggurat_table(Q_FALSE, FUNCTIONAL_ZIGGURAT_EXPONENTIAL_TAIL, 0.0039496598225815571993);
+
+//Standard normal: one 64 bit draw, a multiply and a compare in ~99% of the calls; wedges and the tail fall back to exp/log.
+template<class _Engine> constexpr double Q_random_normal(_Inout_ _Engine& _Generator) {
+	const CZigguratTable& table = gs_ZigguratNormal;
+
+	for (;;) {
+		//Low byte picks the layer, the top 53 bits give a signed position inside it.
+		const functional_uint64_t bits = Q_random_bits(_Generator);
+		const int layer = static_cast<int>(bits & 0xFF);
+		const double position = static_cast<double>(bits >> 11) * 0x1p-52 - 1.0;
+		const double x = position * table.m_a_flX[layer];
+
+		if ((x < 0.0 ? -x : x) < table.m_a_flX[layer + 1]) return x;
+
+		if (layer == 0) {
+			//Marsaglia's tail algorithm beyond FUNCTIONAL_ZIGGURAT_NORMAL_TAIL.
+			double tail = 0.0, height = 0.0;
+			do {
+				tail = Q_log(Q_random_double_open(_Generator)) / FUNCTIONAL_ZIGGURAT_NORMAL_TAIL;
+				height = Q_log(Q_random_double_open(_Generator));
+			} while (-2.0 * height < tail * tail);
+
+			return position < 0.0 ? tail - FUNCTIONAL_ZIGGURAT_NORMAL_TAIL : FUNCTIONAL_ZIGGURAT_NORMAL_TAIL - tail;
+		}
+
+		if (table.m_a_flF[layer + 1] + (table.m_a_flF[layer] - table.m_a_flF[layer + 1]) * Q_random_double(_Generator) < Q_exp(-0.5 * x * x)) return x;
+	}
+}
+
+//Standard exponential (rate 1), same ziggurat scheme as Q_random_normal.
+template<class _Engine> constexpr double Q_random_exponential(_Inout_ _Engine& _Generator) {
+	const CZigguratTable& table = gs_ZigguratExponential;
+
+	for (;;) {
+		const functional_uint64_t bits = Q_random_bits(_Generator);
+		const int layer = static_cast<int>(bits & 0xFF);
+		const double x = static_cast<double>(bits >> 11) * 0x1p-53 * table.m_a_flX[layer];
+
+		if (x < table.m_a_flX[layer + 1]) return x;
+
+		//The tail of an exponential is an exponential again.
+		if (layer == 0) return FUNCTIONAL_ZIGGURAT_EXPONENTIAL_TAIL - Q_log(Q_random_double_open(_Generator));
+
+		if (table.m_a_flF[layer + 1] + (table.m_a_flF[layer] - table.m_a_flF[layer + 1]) * Q_random_double(_Generator) < Q_exp(-x)) return x;
+	}
+}
+
+//Distribution objects: construct with the parameters, then call with any engine, or Fill a whole array at once.
+template<class _Real = double> struct CUniformRealDistribution {
+	static_assert(sizeof(_Real) == sizeof(float) || sizeof(_Real) == sizeof(double), "CUniformRealDistribution: float or double only");
+
+	constexpr CUniformRealDistribution(_In_opt_ _Real _Min = 0, _In_opt_ _Real _Max = 1) : _m_flMin(_Min), _m_flRange(_Max - _Min) {
+		Q_SLOWASSERT(_Min < _Max && "CUniformRealDistribution: empty range");
+	}
+
+	//Number in [_Min, _Max).
+	template<class _Engine> constexpr _Real operator()(_Inout_ _Engine& _Generator) const {
+		return this->Scale(sizeof(_Real) == sizeof(float) ? static_cast<_Real>(Q_random_float(_Generator)) : static_cast<_Real>(Q_random_double(_Generator)));
+	}
+
+	template<class _Engine> void Fill(_Inout_ _Engine& _Generator, _Out_writes_(_Count) _Real* _Output, _In_ functional_unsigned_size_t _Count) const {
+		for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) _Output[idx] = (*this)(_Generator);
+	}
+
+	//The eight lane engine fills the unit numbers in bulk, we only scale them.
+	void Fill(_Inout_ CXoshiro256x8& _Generator, _Out_writes_(_Count) _Real* _Output, _In_ functional_unsigned_size_t _Count) const {
+		if constexpr (sizeof(_Real) == sizeof(float)) _Generator.FillRandomFloat(_Output, _Count);
+		else _Generator.FillRandomDouble(_Output, _Count);
+
+		for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) _Output[idx] = this->Scale(_Output[idx]);
+	}
+private:
+	constexpr _Real Scale(_In_ _Real _Unit) const {
+		const _Real result = this->_m_flMin + this->_m_flRange * _Unit;
+		//Rounding can land exactly on _Max.
+		return result < this->_m_flMin + this->_m_flRange ? result : this->_m_flMin;
+	}
+
+	_Real _m_flMin, _m_flRange;
+};
+
+typedef struct CNormalDistribution {
+	constexpr CNormalDistribution(_In_opt_ double _Mean = 0.0, _In_opt_ double _Deviation = 1.0) : _m_flMean(_Mean), _m_flDeviation(_Deviation) {}
+
+	template<class _Engine> constexpr double operator()(_Inout_ _Engine& _Generator) const {
+		return this->_m_flMean + this->_m_flDeviation * Q_random_normal(_Generator);
+	}
+
+	template<class _Engine> void Fill(_Inout_ _Engine& _Generator, _Out_writes_(_Count) double* _Output, _In_ functional_unsigned_size_t _Count) const {
+		for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) _Output[idx] = (*this)(_Generator);
+	}
+private:
+	double _m_flMean, _m_flDeviation;
+} CNormalDistribution;
+
+typedef struct CExponentialDistribution {
+	constexpr CExponentialDistribution(_In_opt_ double _Rate = 1.0) : _m_flScale(1.0 / _Rate) {
+		Q_SLOWASSERT(_Rate > 0.0 && "CExponentialDistribution: rate must be positive");
+	}
+
+	template<class _Engine> constexpr double operator()(_Inout_ _Engine& _Generator) const {
+		return this->_m_flScale * Q_random_exponential(_Generator);
+	}
+
+	template<class _Engine> void Fill(_Inout_ _Engine& _Generator, _Out_writes_(_Count) double* _Output, _In_ functional_unsigned_size_t _Count) const {
+		for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) _Output[idx] = (*this)(_Generator);
+	}
+private:
+	double _m_flScale;
+} CExponentialDistribution;
+
+//Poisson: Knuth's product of uniforms for small means, Hormann's PTRS (transformed rejection, ~1.1 draws per number) from 10 up.
+typedef struct CPoissonDistribution {
+	static constexpr double m_flRejectionThreshold = 10.0;
+
+	constexpr CPoissonDistribution(_In_opt_ double _Mean = 1.0) : _m_flMean(_Mean), _m_flExpMean(0.0), _m_flLogMean(0.0), _m_flB(0.0), _m_flA(0.0), _m_flLogInverseAlpha(0.0), _m_flVr(0.0) {
+		Q_SLOWASSERT(_Mean >= 0.0 && "CPoissonDistribution: mean must be non-negative");
+
+		if (_Mean < m_flRejectionThreshold) {
+			this->_m_flExpMean = Q_exp(-_Mean);
+			return;
+		}
+
+		this->_m_flLogMean = Q_log(_Mean);
+		this->_m_flB = 0.931 + 2.53 * Q_sqrt(_Mean);
+		this->_m_flA = -0.059 + 0.02483 * this->_m_flB;
+		this->_m_flLogInverseAlpha = Q_log(1.1239 + 1.1328 / (this->_m_flB - 3.4));
+		this->_m_flVr = 0.9277 - 3.6224 / (this->_m_flB - 2.0);
+	}
+
+	template<class _Engine> constexpr functional_uint64_t operator()(_Inout_ _Engine& _Generator) const {
+		if (this->_m_flMean < m_flRejectionThreshold) {
+			functional_uint64_t result = 0;
+			for (double product = Q_random_double(_Generator); product > this->_m_flExpMean; product *= Q_random_double(_Generator)) result++;
+
+			return result;
+		}
+
+		for (;;) {
+			const double u = Q_random_double(_Generator) - 0.5, v = Q_random_double(_Generator);
+			const double us = 0.5 - (u < 0.0 ? -u : u);
+			const double candidate = (2.0 * this->_m_flA / us + this->_m_flB) * u + this->_m_flMean + 0.43;
+			if (candidate < 0.0) continue;
+
+			const functional_uint64_t k = static_cast<functional_uint64_t>(candidate);
+			if (us >= 0.07 && v <= this->_m_flVr) return k;
+			if (us < 0.013 && v > us) continue;
+
+			const double kd = static_cast<double>(k);
+			if (Q_log(v) + this->_m_flLogInverseAlpha - Q_log(this->_m_flA / (us * us) + this->_m_flB) <= -this->_m_flMean + kd * this->_m_flLogMean - Q_lgamma(kd + 1.0)) return k;
+		}
+	}
+
+	template<class _Engine> void Fill(_Inout_ _Engine& _Generator, _Out_writes_(_Count) functional_uint64_t* _Output, _In_ functional_unsigned_size_t _Count) const {
+		for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) _Output[idx] = (*this)(_Generator);
+	}
+private:
+	double _m_flMean, _m_flExpMean, _m_flLogMean;
+	//PTRS constants, see Hormann, "The transformed rejection method for generating Poisson random variables" (1993).
+	double _m_flB, _m_flA, _m_flLogInverseAlpha, _m_flVr;
+} CPoissonDistribution;
+
+namespace
+#ifdef FUNCTIONAL_DONT_USE_ANONYMOUS_NAMESPACE
+	functional
+#endif //FUNCTIONAL_DONT_USE_ANONYMOUS_NAMESPACE
+{
+	functional_size_t Q_strlen(_In_z_ const char* _Str) {
+		const char* p = const_cast<char*>(&_Str[0]);
+
+#ifdef FUNCTIONAL_USE_FASTEST_STRLEN
+		//Be careful: it was reverse engineered from hidden Windows API internals.
+		if (((unsigned char)(_Str) & 3) == 0)
+			goto main_loop;
+		do {
+			if (!*p++)
+				return p - 1 - _Str;
+		} while (((unsigned char) (p) & 3) != 0);
+		while (true) {
+			int v3;
+			do {
+			main_loop:
+				v3 = (*(unsigned long*)p + 0x7EFEFEFF) ^ ~*(unsigned long*)p;
+				p += 4;
+			} while ((v3 & 0x81010100) == 0);
+			int v4 = *((unsigned long*)p - 1);
+			if (!v4)
+				break;
+			if (!(*((unsigned char*)&(v4)+1)))
+				return p - 3 - _Str;
+			if ((v4 & 0xFF0000) == 0)
+				return p - 2 - _Str;
+			if ((v4 & 0xFF000000) == 0)
+				return p - 1 - _Str;
+		}
+		return p - 4 - _Str;
+#else
+		functional_size_t count = 0;
+
+		for (; p[0] != '\0'; ++p, count++);
+
+		return count;
+#endif //FUNCTIONAL_USE_FASTEST_STRLEN
+	}
+
+	char* Q_strcpy(_Always_(_Post_z_) _Out_ char* _Destination, _In_z_ const char* _Source) {
+		if (!_Source) return _Destination;
+
+		if (_Source) {
+			const functional_size_t length = Q_strlen(_Source) + 1;
+			//length counts the terminator, so it's copied too.
+			for (int idx = 0; idx < length; idx++) {
+				_Destination[idx] = _Source[idx];
+			}
+		}
+
+		return _Destination;
+	}
+
+	char* Q_strcat(_Inout_ char* _Destination, _In_z_ const char* _Source) {
+		if (!_Source) return _Destination;
+
+		if (_Source) {
+			const int srcLength = Q_strlen(_Source);
+			const int destLength = Q_strlen(_Destination);
+			for (int idx = destLength; idx < destLength + srcLength; idx++) {
+				_Destination[idx] = _Source[idx - destLength];
+			}
+			_Destination[destLength + srcLength] = '\0';
+		}
+
+		return _Destination;
+	}
+
+	functional_size_t Q_strcmp(_In_z_ const char* _Str1, _In_z_ const char* _Str2) {
+		for (; *_Str1 == *_Str2; ++_Str1, ++_Str2) {
+			if (*_Str1 == '\0') return 0;
+		}
+
+		return Q_strlen(_Str1) < Q_strlen(_Str2) ? -1 : 1;
+	}
+
+	functional_size_t Q_strncmp(_In_reads_or_z_(_MaxCount) const char* _Str1, _In_reads_or_z_(_MaxCount) const char* _Str2, _In_ functional_unsigned_size_t _MaxCount) {
+		while (_MaxCount && *_Str1 && (*_Str1 == *_Str2)) ++_Str1, ++_Str2, --_MaxCount;
+
+		if (_MaxCount == 0) return 0;
+
+		return(*(unsigned char*)_Str1 - *(unsigned char*)_Str2);
+	}
+
+	char* Q_strdup(_In_z_ const char* _Source) {
+		const functional_size_t length = Q_strlen(_Source);
+		const auto buffer = static_cast<char*>(Q_malloc(length + 1));
+		Q_SLOWASSERT(buffer && "Failed to allocate buffer (size is dynamic) at Q_strdup");
+
+		Q_memcpy(buffer, _Source, length);
+
+		buffer[length] = '\0';
+
+		return buffer;
+	}
+
+	int Q_abs(_In_ functional_size_t _Number) {
+		return _Number < 0 ? -_Number : _Number;
+	}
+
+	char* Q_itoa_internal(_Pre_notnull_ _Always_(_Post_z_) _Out_opt_ char* _Dest, _In_ functional_unsigned_size_t _Size, _In_ int _Value) {
+		char buf[INT_STR_SIZE];
+		char* p = &buf[INT_STR_SIZE - 1];
+		*p = '\0';
+		int i = _Value;
+
+		do {
+			*(--p) = Q_abs(i % 10) + '0';
+			i /= 10;
+		} while (i);
+
+		if (_Value < 0) {
+			*(--p) = '-';
+		}
+		const auto len = static_cast<functional_unsigned_size_t>(&buf[INT_STR_SIZE] - p);
+		if (len > _Size) {
+			return Q_nullptr;
+		}
+		return static_cast<char*>(Q_memcpy(_Dest, p, len));
+	}
+
+	//Same as Q_itoa_internal, but for 64-bit values. _Dest must hold at least LONG_LONG_STR_SIZE characters to be safe.
+	char* Q_i64toa_internal(_Pre_notnull_ _Always_(_Post_z_) _Out_opt_ char* _Dest, _In_ functional_unsigned_size_t _Size, _In_ unsigned long long _Magnitude, _In_ Q_bool _Negative) {
+		char buf[LONG_LONG_STR_SIZE];
+		char* p = &buf[LONG_LONG_STR_SIZE - 1];
+		*p = '\0';
+
+		do {
+			*(--p) = static_cast<char>(_Magnitude % 10) + '0';
+			_Magnitude /= 10;
+		} while (_Magnitude);
+
+		if (_Negative) {
+			*(--p) = '-';
+		}
+		const auto len = static_cast<functional_unsigned_size_t>(&buf[LONG_LONG_STR_SIZE] - p);
+		if (len > _Size) {
+			return Q_nullptr;
+		}
+		return static_cast<char*>(Q_memcpy(_Dest, p, len));
+	}
+
+	inline functional_size_t Q_integer_to_octal(_In_ functional_size_t _Number) {
+		functional_size_t modulo, octal = 0, idx = 1;
+
+		while (_Number != 0) {
+			modulo = _Number % 8;
+			_Number = _Number / 8;
+			octal = octal + (modulo * idx);
+			idx = idx * 10;
+		}
+
+		return octal;
+	}
+
+	inline char* Q_itoa(_In_ functional_size_t _Number) {
+		const auto buffer = static_cast<char*>(Q_malloc(INT_STR_SIZE));
+		Q_SLOWASSERT(buffer && "Failed to allocate buffer (size=INT_STR_SIZE) at Q_itoa");
+		Q_itoa_internal(buffer, INT_STR_SIZE, _Number);
+		return buffer;
+	}
+
+	inline functional_size_t Q_atoi(char* s) {
+		int c = 1, a = 0, sign, end, base = 1;
+
+		if (s[0] == '-')
+			sign = -1;
+		else if (s[0] <= '9' && s[0] >= '0')
+			sign = 1;
+		else if (s[0] == '+')
+			sign = 2;
+		else
+			return 0;
+
+		while (s[c] != '\n' && s[c] <= '9' && s[c] >= '0')
+			c++;
+
+		if (sign == -1)
+			end = 1;
+		else if (sign == 1)
+			end = 0;
+		else {
+			end = 1;
+			sign = 1;
+		}
+
+		for (int i = c - 1; i >= end; i--) {
+			a += (s[i] - '0') * base;
+			base *= 10;
+		}
+
+		return sign * a;
+	}
+
+	functional_size_t Q_pow(_In_ functional_size_t _Base, _In_ functional_size_t _Power) {
+		if (_Power == 0) return 1;
+		else if ((_Power % 2) == 0)
+			return Q_pow(_Base, _Power / 2) * Q_pow(_Base, _Power / 2);
+		else
+			return _Base * Q_pow(_Base, _Power / 2) * Q_pow(_Base, _Power / 2);
+	}
+
+	//Fixed notation with _Precision decimals (rounded, at most FUNCTIONAL_FTOA_MAX_PRECISION), e.g -0.5 -> "-0.50".
+	//Digits past the 19th of huge numbers come out as zeros. _Dest must hold at least DOUBLE_STR_SIZE characters to be safe.
+	char* Q_ftoa_internal(_Pre_notnull_ _Always_(_Post_z_) _Out_opt_ char* _Dest, _In_ functional_unsigned_size_t _Size, _In_ double _Value, _In_opt_ functional_size_t _Precision = 2) {
+		char buf[DOUBLE_STR_SIZE];
+		functional_unsigned_size_t len = 0;
+
+		if (_Value != _Value) {
+			Q_memcpy(buf, "nan", sizeof("nan"));
+			len = sizeof("nan") - 1;
+		} else {
+			double magnitude = _Value;
+			if (_Value < 0.0) {
+				buf[len++] = '-';
+				magnitude = -_Value;
+			}
+
+			if (magnitude > 1.7976931348623157e+308) {
+				Q_memcpy(buf + len, "inf", sizeof("inf"));
+				len += sizeof("inf") - 1;
+			} else {
+				if (_Precision < 0) _Precision = 0;
+				if (_Precision > FUNCTIONAL_FTOA_MAX_PRECISION) _Precision = FUNCTIONAL_FTOA_MAX_PRECISION;
+
+				double rounding = 0.5;
+				for (functional_size_t idx = 0; idx < _Precision; idx++) rounding /= 10.0;
+				magnitude += rounding;
+
+				functional_size_t zeros = 0;
+				for (; magnitude >= 1e19; zeros++) magnitude /= 10.0;
+
+				const auto integer = static_cast<unsigned long long>(magnitude);
+				double fraction = zeros ? 0.0 : magnitude - static_cast<double>(integer);
+
+				Q_i64toa_internal(buf + len, LONG_LONG_STR_SIZE, integer, Q_FALSE);
+				len += Q_strlen(buf + len);
+				for (; zeros; zeros--) buf[len++] = '0';
+
+				if (_Precision) buf[len++] = '.';
+				for (functional_size_t idx = 0; idx < _Precision; idx++) {
+					fraction *= 10.0;
+					const int digit = static_cast<int>(fraction);
+					buf[len++] = static_cast<char>(digit + '0');
+					fraction -= digit;
+				}
+				buf[len] = '\0';
+			}
+		}
+
+		if (len + 1 > _Size) {
+			return Q_nullptr;
+		}
+		return static_cast<char*>(Q_memcpy(_Dest, buf, len + 1));
+	}
+
+	inline char* Q_ftoa(_In_ float _Value, _In_opt_ functional_size_t _Precision = 2) {
+		const auto buffer = static_cast<char*>(Q_malloc(DOUBLE_STR_SIZE));
+		Q_SLOWASSERT(buffer && "Failed to allocate buffer (size=DOUBLE_STR_SIZE) at Q_ftoa");
+		Q_ftoa_internal(buffer, DOUBLE_STR_SIZE, _Value, _Precision);
+
+		return buffer;
+	}
+
+	functional_size_t Q_toupper(_In_ functional_size_t _C) {
+		if (_C >= 'a' && _C <= 'z') {
+			_C -= ('a' - 'A');
+		}
+
+		return _C;
+	}
+
+	char Q_toupper(_In_ char _C) {
+		if (_C >= 'a' && _C <= 'z') {
+			_C -= ('a' - 'A');
+		}
+
+		return _C;
+	}
+
+	char* Q_itohexa_helper(_In_ char* _Dest, _In_ functional_uintptr_t _Val) {
+		if (_Val >= 16) {
+			_Dest = Q_itohexa_helper(_Dest, _Val / 16);
+		}
+		*_Dest++ = "0123456789abcdef"[_Val & 15];
+		return _Dest;
+	}
+
+	char* Q_itohexa(_In_ functional_uintptr_t _Val) {
+		const auto buffer = static_cast<char*>(Q_malloc(32));
+		Q_SLOWASSERT(buffer && "Failed to allocate buffer (size=32) at Q_itohexa");
+		*Q_itohexa_helper(buffer, _Val) = '\0';
+
+		return buffer;
+	}
+
+	inline char* Q_itohexa_upper(_In_ functional_uintptr_t _Val) {
+		char* buffer = Q_itohexa(_Val);
+		const functional_size_t len = Q_strlen(buffer);
 
 		for (functional_size_t idx = 0; idx < len; idx++) {
 			buffer[idx] = Q_toupper(buffer[idx]);
 		}
 
-		return buffer;
+		return buffer;
+	}
+
+	//Whether the conversion character takes an argument.
+	Q_bool Q_format_consumes(_In_ char _Conversion) {
+		switch (_Conversion) {
+		case 'd': case 'i': case 'u': case 'o': case 'f': case 'c': case 'x': case 'X': case 's': case 'p':
+			return Q_TRUE;
+		default:
+			return Q_FALSE;
+		}
+	}
+
+	//The formatting core of Q_sprintf. Works on type-erased arguments, so it's compiled once rather than for every argument list.
+	//Writes at most _Capacity - 1 characters and always terminates the output.
+	functional_size_t Q_format_internal(_Always_(_Post_z_) _Out_writes_z_(_Capacity) char* const _Buffer, _In_ functional_unsigned_size_t _Capacity,
+		_Printf_format_string_ _In_z_ const char* const _Format, _In_reads_(_Count) const CArgValue* _Args, _In_ functional_unsigned_size_t _Count) {
+		//Handling the case when not all arguments are present, i.e there are too much format specifiers but not enough args to format the string
+		functional_unsigned_size_t required = 0;
+		for (const char* p = _Format; p[0] != '\0'; ++p) {
+			if (p[0] != '%') continue;
+			if (p[1] == '.') {
+				++p;
+				if (p[1] == '*') {
+					++required;
+					++p;
+				}
+				while (p[1] >= '0' && p[1] <= '9') ++p;
+			}
+			if (p[1] == '\0') break;
+			if (Q_format_consumes(*++p)) ++required;
+		}
+
+		if (required > _Count) {
+			Q_strcpy(_Buffer, "Q_sprintf: Not all arguments are present.\n");
+			return sizeof("Q_sprintf: Not all arguments are present.\n") - 1;
+		}
+
+		functional_unsigned_size_t written = 0, next = 0;
+		const auto put = [&](_In_reads_(_Length) const char* _Text, _In_ functional_unsigned_size_t _Length) {
+			for (; _Length && written + 1 < _Capacity; _Length--) _Buffer[written++] = *_Text++;
+		};
+
+		char scratch[DOUBLE_STR_SIZE];
+		for (const char* p = _Format; p[0] != '\0'; ++p) {
+			if (p[0] != '%' || p[1] == '\0') {
+				put(p, 1);
+				continue;
+			}
+
+			++p;
+			functional_size_t precision = 6;
+			if (p[0] == '.') {
+				++p;
+				if (p[0] == '*') {
+					precision = static_cast<functional_size_t>(_Args[next++].AsSigned());
+					++p;
+				} else {
+					for (precision = 0; p[0] >= '0' && p[0] <= '9'; ++p) precision = precision * 10 + (p[0] - '0');
+				}
+				if (p[0] == '\0') break;
+			}
+
+			switch (p[0]) {
+			case 'd':
+			case 'i': {
+				const CArgValue& arg = _Args[next++];
+				if (arg.m_Type == Q_ARG_UNSIGNED) {
+					Q_i64toa_internal(scratch, sizeof(scratch), arg.m_iUnsigned, Q_FALSE);
+				} else {
+					const long long value = arg.AsSigned();
+					Q_i64toa_internal(scratch, sizeof(scratch), value < 0 ? 0ull - static_cast<unsigned long long>(value) : static_cast<unsigned long long>(value), value < 0 ? Q_TRUE : Q_FALSE);
+				}
+				put(scratch, Q_strlen(scratch));
+			}
+					break;
+			case 'u': {
+				Q_i64toa_internal(scratch, sizeof(scratch), _Args[next++].AsUnsigned(), Q_FALSE);
+				put(scratch, Q_strlen(scratch));
+			}
+					break;
+			case 'o': {
+				unsigned long long value = _Args[next++].AsUnsigned();
+				char* digit = &scratch[sizeof(scratch) - 1];
+				do {
+					*--digit = static_cast<char>('0' + (value & 7));
+					value >>= 3;
+				} while (value);
+				put(digit, static_cast<functional_unsigned_size_t>(&scratch[sizeof(scratch) - 1] - digit));
+			}
+					break;
+			case 'f': {
+				Q_ftoa_internal(scratch, sizeof(scratch), _Args[next++].AsDouble(), precision);
+				put(scratch, Q_strlen(scratch));
+			}
+					break;
+			case 'c': {
+				const char character = static_cast<char>(_Args[next++].AsSigned());
+				put(&character, 1);
+			}
+					break;
+			case 'x':
+			case 'X': {
+				if (const unsigned long long value = _Args[next++].AsUnsigned()) {
+					const char* end = Q_itohexa_helper(scratch, static_cast<functional_uintptr_t>(value));
+					if (p[0] == 'X') {
+						for (char* digit = scratch; digit != end; digit++) *digit = Q_toupper(*digit);
+					}
+					put(scratch, static_cast<functional_unsigned_size_t>(end - scratch));
+				} else {
+					put("0x0", sizeof("0x0") - 1);
+				}
+			}
+					break;
+			case 's': {
+				const CArgValue& arg = _Args[next++];
+				const char* str = arg.m_Type == Q_ARG_STRING ? static_cast<const char*>(arg.m_lpPointer) : Q_nullptr;
+				if (!str) str = "(null)";
+				put(str, Q_strlen(str));
+			}
+					break;
+			case 'p': {
+				if (const unsigned long long addr = _Args[next++].AsUnsigned()) {
+					const char* end = Q_itohexa_helper(scratch, static_cast<functional_uintptr_t>(addr));
+					put(scratch, static_cast<functional_unsigned_size_t>(end - scratch));
+				} else {
+					put("(null)", sizeof("(null)") - 1);
+				}
+			}
+					break;
+			default: {
+				//Unknown conversions, %% included, print the character itself.
+				put(p, 1);
+			}
+				   break;
+			}
+		}
+
+		_Buffer[written] = '\0';
+
+		return static_cast<functional_size_t>(written);
+	}
+
+	template<class... _Ts> _Success_(return >= 0) functional_size_t Q_sprintf(_Always_(_Post_z_) _Out_ char* const _Buffer,
+		_Printf_format_string_ _In_z_ const char* const _Format, _In_opt_ _Ts... _Args) {
+		Q_SLOWASSERT(_Buffer && "Q_sprintf: Where do you want me to store the output string?");
+		Q_SLOWASSERT(_Format && "Q_sprintf: What should I print into your buffer?");
+		if constexpr (sizeof...(_Args) > 0) {
+			//Each argument keeps its real type and width, everything lives on the stack.
+			const CArgValue arguments[] = { CArgValue::From(_Args)... };
+
+			return Q_format_internal(_Buffer, FUNCTIONAL_SPRINTF_BUFFER_SIZE, _Format, arguments, sizeof...(_Args));
+		} else {
+			//Still formatted: %% has to collapse and the output is capped the same as with arguments.
+			if (_Format) return Q_format_internal(_Buffer, FUNCTIONAL_SPRINTF_BUFFER_SIZE, _Format, Q_nullptr, 0);
+		}
+
+		return -1;
+	}
+}
+
+/*CString::CString(_In_z_ char* _Which) {
+	Q_ASSERT(_Which && "Expected a non-null string at CString::CString(char*)");
+	this->_m_iLength = Q_strlen(_Which);
+	this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(this->_m_iLength + 1));
+	Q_strcpy(this->_m_lp_cStorage, _Which);
+}*/
+
+CString::CString(_In_z_ const char* _Which) {
+	Q_ASSERT(_Which && "Expected a non-null string at CString::CString(const char*)");
+	this->_m_iLength = Q_strlen(_Which);
+	this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(this->_m_iLength + 1));
+	Q_strcpy(this->_m_lp_cStorage, _Which);
+}
+
+//Starts out empty so callers can Q_strcat into it.
+CString::CString(_In_ functional_unsigned_size_t _Length) : _m_iLength(_Length) {
+	Q_ASSERT(_Length > 0 && "Expected positive _Length at CString::CString(functional_unsigned_size_t)");
+	this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(_Length + 1));
+	this->_m_lp_cStorage[0] = '\0';
+	this->_m_lp_cStorage[_Length] = '\0';
+}
+
+CString::CString(_In_ const CString& _Other) {
+	this->_m_iLength = _Other._m_iLength;
+	this->_m_lp_cStorage = Q_nullptr;
+	if (_Other._m_lp_cStorage) {
+		this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(this->_m_iLength + 1));
+		Q_memcpy(this->_m_lp_cStorage, _Other._m_lp_cStorage, this->_m_iLength);
+		this->_m_lp_cStorage[this->_m_iLength] = '\0';
+	}
+}
+
+CString& CString::operator=(_In_ const CString& _Rhs) {
+	if (this != &_Rhs) {
+		CString copy(_Rhs);
+		*this = move(copy);
+	}
+
+	return *this;
+}
+
+CString::~CString() {
+	if (this->_m_lp_cStorage) Q_free(this->_m_lp_cStorage);
+	this->_m_iLength = 0;
+}
+
+CString& CString::operator=(_In_z_ const char* _String) {
+	Q_ASSERT(_String && "Expected a non-null string.");
+	this->_m_iLength = Q_strlen(_String);
+
+	if (this->_m_lp_cStorage) {
+		Q_free(this->_m_lp_cStorage);
+	}
+
+	this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(this->_m_iLength + 1));
+
+	Q_strcpy(this->_m_lp_cStorage, _String);
+
+	return *this;
+}
+
+CString& CString::operator=(_In_ char _Character) {
+	this->_m_iLength = 1;
+
+	if (this->_m_lp_cStorage) {
+		Q_free(this->_m_lp_cStorage);
+	}
+
+	this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(2));
+
+	this->_m_lp_cStorage[0] = _Character;
+	this->_m_lp_cStorage[1] = '\0';
+
+	return *this;
+}
+
+CString& CString::operator+=(_In_z_ const char* _String) {
+	Q_ASSERT(_String && "Expected a non-null string. To add a character into CString, refer to CString#operator+=(char)");
+	this->_m_iLength += Q_strlen(_String);
+
+	//Q_realloc may move the block.
+	if (this->_m_lp_cStorage) {
+		this->_m_lp_cStorage = reinterpret_cast<char*>(Q_realloc(this->_m_lp_cStorage, this->_m_iLength + 1));
+	}
+	else {
+		this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(this->_m_iLength + 1));
+		this->_m_lp_cStorage[0] = '\0';
+	}
+
+	Q_strcat(this->_m_lp_cStorage, _String);
+	this->_m_lp_cStorage[this->_m_iLength] = '\0';
+
+	return *this;
+}
+
+CString& CString::operator+=(_In_ char _Character) {
+	this->_m_iLength++;
+
+	if (this->_m_lp_cStorage) {
+		this->_m_lp_cStorage = reinterpret_cast<char*>(Q_realloc(this->_m_lp_cStorage, this->_m_iLength + 1));
+	}
+	else {
+		this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(this->_m_iLength + 1));
+	}
+
+	this->_m_lp_cStorage[this->_m_iLength - 1] = _Character;
+	this->_m_lp_cStorage[this->_m_iLength] = '\0';
+
+	return *this;
+}
+
+CString& CString::operator+(_In_z_ const char* _Other) {
+	Q_ASSERT(_Other && "Expected a non-null string. To add a character into CString, refer to CString#operator+(char)");
+	CString* result = Q_new(CString)(this->_m_iLength + Q_strlen(_Other));
+
+	Q_strcat(result->_m_lp_cStorage, this->_m_lp_cStorage);
+	Q_strcat(result->_m_lp_cStorage, _Other);
+	result->_m_lp_cStorage[result->_m_iLength] = '\0';
+
+	return *result;
+}
+
+CString& CString::operator+(_In_ char _Character) {
+	CString* result = Q_new(CString)(this->_m_iLength + 1);
+
+	Q_strcat(result->_m_lp_cStorage, this->_m_lp_cStorage);
+	result->_m_lp_cStorage[this->_m_iLength] = _Character;
+	result->_m_lp_cStorage[result->_m_iLength] = '\0';
+
+	return *result;
+}
+
+functional_uint64_t CString::hash() const {
+	return Q_hash_bytes(this->_m_lp_cStorage, this->_m_iLength);
+}
+
+Q_bool CString::operator==(_In_ const CString& _Rhs) const {
+	return (Q_strcmp(this->_m_lp_cStorage, _Rhs._m_lp_cStorage) == 0) ? Q_TRUE : Q_FALSE;
+}
+
+Q_bool CString::operator==(_In_ const char* _Rhs) const {
+	return (Q_strcmp(this->_m_lp_cStorage, _Rhs) == 0) ? Q_TRUE : Q_FALSE;
+}
+
+Q_bool CString::operator!=(_In_ const CString& _Rhs) const {
+	return (Q_strcmp(this->_m_lp_cStorage, _Rhs._m_lp_cStorage) != 0) ? Q_TRUE : Q_FALSE;
+}
+
+Q_bool CString::operator!=(_In_ const char* _Rhs) const {
+	return (Q_strcmp(this->_m_lp_cStorage, _Rhs) != 0) ? Q_TRUE : Q_FALSE;
+}
+
+//Called by CStringBuilder each time it has a chunk ready (or when you call flush). _Data isn't null-terminated.
+typedef void(*Q_flush_callback)(_In_opt_ void* _Context, _In_reads_(_Size) const char* _Data, _In_ functional_unsigned_size_t _Size);
+
+//Accumulates text in one growable buffer. When a flush callback is given, the buffer is handed to it
+//each time it reaches _ChunkSize bytes, so the output never has to be contiguous as a whole.
+typedef struct CStringBuilder {
+	CStringBuilder(_In_opt_ Q_flush_callback _Callback = 0, _In_opt_ void* _Context = Q_nullptr, _In_opt_ functional_unsigned_size_t _ChunkSize = FUNCTIONAL_STRING_BUILDER_CHUNK_SIZE) {
+		Q_ASSERT(_ChunkSize > 0 && "Expected positive _ChunkSize at CStringBuilder::CStringBuilder");
+		this->_m_lp_cBuffer = Q_nullptr;
+		this->_m_iLength = this->_m_iCapacity = this->_m_iFlushed = 0;
+		this->_m_iChunkSize = _ChunkSize;
+		this->_m_lpCallback = _Callback;
+		this->_m_lpContext = _Context;
+	}
+
+	~CStringBuilder() {
+		if (this->_m_lpCallback) this->flush();
+		if (this->_m_lp_cBuffer) Q_free(this->_m_lp_cBuffer);
+		this->_m_lp_cBuffer = Q_nullptr;
+	}
+
+	CStringBuilder& append(_In_reads_(_Length) const char* _String, _In_ functional_unsigned_size_t _Length) {
+		Q_SLOWASSERT(_String && "CStringBuilder::append: What should I append?");
+		if (!_String || !_Length) return *this;
+
+		//Big inputs are streamed through in chunk-sized pieces instead of growing the buffer for them.
+		if (this->_m_lpCallback) {
+			while (this->_m_iLength + _Length > this->_m_iChunkSize) {
+				const functional_unsigned_size_t part = this->_m_iChunkSize - this->_m_iLength;
+				this->Reserve(part);
+				Q_memcpy(this->_m_lp_cBuffer + this->_m_iLength, _String, part);
+				this->_m_iLength += part;
+				this->flush();
+				_String += part;
+				_Length -= part;
+			}
+		}
+
+		this->Reserve(_Length);
+		Q_memcpy(this->_m_lp_cBuffer + this->_m_iLength, _String, _Length);
+		this->_m_iLength += _Length;
+		this->_m_lp_cBuffer[this->_m_iLength] = '\0';
+		this->FlushIfFull();
+
+		return *this;
+	}
+
+	CStringBuilder& append(_In_z_ const char* _String) {
+		Q_ASSERT(_String && "Expected a non-null string. To add a character into CStringBuilder, refer to CStringBuilder#append(char)");
+		return this->append(_String, Q_strlen(_String));
+	}
+
+	CStringBuilder& append(_In_ char _Character) {
+		this->Reserve(1);
+		this->_m_lp_cBuffer[this->_m_iLength++] = _Character;
+		this->_m_lp_cBuffer[this->_m_iLength] = '\0';
+		this->FlushIfFull();
+
+		return *this;
+	}
+
+	//Formats straight into the tail of our buffer, so no intermediate copy is made. There's no per-call cap like Q_sprintf's,
+	//output that fills the room we reserved is formatted again into twice the room.
+	template<class... _Ts> CStringBuilder& appendf(_Printf_format_string_ _In_z_ const char* const _Format, _In_opt_ const _Ts&... _Args) {
+		Q_ASSERT(_Format && "Expected a non-null format string at CStringBuilder::appendf");
+		if constexpr (sizeof...(_Args) == 0) {
+			return this->vappendf(_Format, Q_nullptr, 0);
+		} else {
+			const CArgValue arguments[] = { CArgValue::From(_Args)... };
+
+			return this->vappendf(_Format, arguments, sizeof...(_Args));
+		}
+	}
+
+	//appendf for arguments that were captured earlier.
+	CStringBuilder& vappendf(_Printf_format_string_ _In_z_ const char* const _Format, _In_reads_(_Count) const CArgValue* _Args, _In_ functional_unsigned_size_t _Count) {
+		functional_unsigned_size_t room = FUNCTIONAL_SPRINTF_BUFFER_SIZE;
+		for (;;) {
+			this->Reserve(room);
+			const functional_unsigned_size_t written = static_cast<functional_unsigned_size_t>(Q_format_internal(this->_m_lp_cBuffer + this->_m_iLength, room, _Format, _Args, _Count));
+			if (written + 1 < room) {
+				this->_m_iLength += written;
+				break;
+			}
+			room *= 2;
+		}
+		this->FlushIfFull();
+
+		return *this;
+	}
+
+	CStringBuilder& operator<<(_In_z_ const char* _String) {
+		return this->append(_String);
+	}
+
+	CStringBuilder& operator<<(_In_ char _Character) {
+		return this->append(_Character);
+	}
+
+	CStringBuilder& operator<<(_In_ const CString& _String) {
+		return this->append(_String.c_str(), _String.length());
+	}
+
+	CStringBuilder& operator<<(_In_ int _Number) {
+		char buffer[INT_STR_SIZE];
+		Q_itoa_internal(buffer, INT_STR_SIZE, _Number);
+		return this->append(buffer);
+	}
+
+	CStringBuilder& operator<<(_In_ unsigned int _Number) {
+		return this->AppendInteger(_Number, Q_FALSE);
+	}
+
+	CStringBuilder& operator<<(_In_ long long _Number) {
+		return this->AppendInteger(_Number < 0 ? 0ull - static_cast<unsigned long long>(_Number) : static_cast<unsigned long long>(_Number), _Number < 0 ? Q_TRUE : Q_FALSE);
+	}
+
+	CStringBuilder& operator<<(_In_ unsigned long long _Number) {
+		return this->AppendInteger(_Number, Q_FALSE);
+	}
+
+	//long is its own type next to int and long long (and size_t is unsigned long on LP64), without these they're ambiguous.
+	CStringBuilder& operator<<(_In_ long _Number) {
+		return *this << static_cast<long long>(_Number);
+	}
+
+	CStringBuilder& operator<<(_In_ unsigned long _Number) {
+		return *this << static_cast<unsigned long long>(_Number);
+	}
+
+	CStringBuilder& operator<<(_In_ float _Number) {
+		return this->AppendFloat(_Number, 6);
+	}
+
+	CStringBuilder& operator<<(_In_ double _Number) {
+		return this->AppendFloat(_Number, 6);
+	}
+
+	CStringBuilder& AppendFloat(_In_ double _Number, _In_opt_ functional_size_t _Precision = 6) {
+		char converted[DOUBLE_STR_SIZE];
+		Q_ftoa_internal(converted, sizeof(converted), _Number, _Precision);
+
+		return this->append(converted);
+	}
+
+	//Hands everything buffered so far to the flush callback. Without a callback, does nothing.
+	void flush() {
+		if (!this->_m_lpCallback || !this->_m_iLength) return;
+
+		this->_m_lpCallback(this->_m_lpContext, this->_m_lp_cBuffer, this->_m_iLength);
+		this->_m_iFlushed += this->_m_iLength;
+		this->_m_iLength = 0;
+		this->_m_lp_cBuffer[0] = '\0';
+	}
+
+	void clear() {
+		this->_m_iLength = this->_m_iFlushed = 0;
+		if (this->_m_lp_cBuffer) this->_m_lp_cBuffer[0] = '\0';
+	}
+
+	//The part that is not flushed yet, always null-terminated.
+	const char* c_str() {
+		return this->_m_lp_cBuffer ? this->_m_lp_cBuffer : "";
+	}
+
+	functional_unsigned_size_t length() {
+		return this->_m_iLength;
+	}
+
+	//Including the bytes already handed to the flush callback.
+	functional_unsigned_size_t total_length() {
+		return this->_m_iFlushed + this->_m_iLength;
+	}
+
+	//Moves our buffer into a CString without copying it. The builder is empty afterwards.
+	CString ToString() {
+		Q_ASSERT(!this->_m_iFlushed && "CStringBuilder::ToString: part of the output was already flushed");
+		if (!this->_m_lp_cBuffer) return CString("");
+
+		CString result;
+		result._m_lp_cStorage = this->_m_lp_cBuffer;
+		result._m_iLength = this->_m_iLength;
+		this->_m_lp_cBuffer = Q_nullptr;
+		this->_m_iLength = this->_m_iCapacity = 0;
+
+		return result;
+	}
+private:
+	CStringBuilder(CStringBuilder const&);
+	CStringBuilder& operator=(CStringBuilder const&);
+
+	//Makes room for _Extra more characters plus the null terminator. Grows geometrically.
+	void Reserve(_In_ functional_unsigned_size_t _Extra) {
+		const functional_unsigned_size_t required = this->_m_iLength + _Extra + 1;
+		if (required <= this->_m_iCapacity) return;
+
+		functional_unsigned_size_t capacity = this->_m_iCapacity ? this->_m_iCapacity : 64;
+		while (capacity < required) capacity *= 2;
+
+		if (this->_m_lp_cBuffer) {
+			this->_m_lp_cBuffer = static_cast<char*>(Q_realloc(this->_m_lp_cBuffer, capacity));
+		} else {
+			this->_m_lp_cBuffer = static_cast<char*>(Q_malloc(capacity));
+			this->_m_lp_cBuffer[0] = '\0';
+		}
+		Q_ASSERT(this->_m_lp_cBuffer && "Failed to allocate buffer at CStringBuilder::Reserve");
+		const functional_unsigned_size_t usable = Q_malloc_usable_size(this->_m_lp_cBuffer);
+		this->_m_iCapacity = usable > capacity ? usable : capacity;
+	}
+
+	void FlushIfFull() {
+		if (this->_m_lpCallback && this->_m_iLength >= this->_m_iChunkSize) this->flush();
+	}
+
+	CStringBuilder& AppendInteger(_In_ unsigned long long _Magnitude, _In_ Q_bool _Negative) {
+		char buffer[LONG_LONG_STR_SIZE];
+		Q_i64toa_internal(buffer, LONG_LONG_STR_SIZE, _Magnitude, _Negative);
+		return this->append(buffer);
+	}
+
+	char* _m_lp_cBuffer;
+	functional_unsigned_size_t _m_iLength, _m_iCapacity, _m_iChunkSize, _m_iFlushed;
+	Q_flush_callback _m_lpCallback;
+	void* _m_lpContext;
+} CStringBuilder;
+
+template<class... _Ts> _Success_(return != Q_nullptr) CString& CString::Format(_Printf_format_string_ _In_z_ const char* const _Format, _In_opt_ _Ts... _Args) {
+	CStringBuilder builder;
+	builder.appendf(_Format, _Args...);
+
+	CString* result = Q_new(CString)(builder.ToString());
+
+	return *result;
+}
+
+//Where a CWriter's bytes end up. Return Q_FALSE on an error, the writer then drops its output until you call ClearError.
+typedef Q_bool(*Q_write_sink_t)(_In_reads_bytes_(_Size) const void* _Data, _In_ functional_unsigned_size_t _Size, _In_opt_ void* _Context);
+
+typedef enum Q_buffer_mode {
+	//Written through on every call.
+	Q_BUFFER_NONE,
+	//Flushed whenever a newline was written (what a terminal wants).
+	Q_BUFFER_LINE,
+	//Flushed only when the buffer is full or on flush() (what a file or a pipe wants).
+	Q_BUFFER_FULL
+} Q_buffer_mode;
+
+//Buffered output on top of Q_sprintf's formatter, so many small prints turn into few large writes. The buffer is inline, a writer never allocates.
+//There's no destructor (a static one would need atexit): flush() before a writer goes away.
+typedef struct CWriter {
+	static_assert(FUNCTIONAL_WRITER_BUFFER_SIZE >= FUNCTIONAL_SPRINTF_BUFFER_SIZE, "FUNCTIONAL_WRITER_BUFFER_SIZE must hold at least one Q_sprintf output");
+
+	//constexpr, so a static writer is ready before any code runs, without a guard or an initializer.
+	constexpr CWriter(_In_ Q_write_sink_t _Sink, _In_opt_ void* _Context = Q_nullptr, _In_opt_ Q_buffer_mode _Mode = Q_BUFFER_FULL)
+		: _m_lpSink(_Sink), _m_lpContext(_Context), _m_Mode(_Mode), _m_bFailed(Q_FALSE), _m_iLength(0), _m_acBuffer() {}
+
+	Q_bool write(_In_reads_bytes_(_Size) const void* _Data, _In_ functional_unsigned_size_t _Size) {
+		if (this->_m_bFailed) return Q_FALSE;
+		if (!_Size) return Q_TRUE;
+
+		//Anything that doesn't fit next to what we have goes out as one write of its own instead of being copied in pieces.
+		if (this->_m_iLength + _Size > FUNCTIONAL_WRITER_BUFFER_SIZE) {
+			if (!this->flush()) return Q_FALSE;
+			if (_Size >= FUNCTIONAL_WRITER_BUFFER_SIZE) return this->Emit(_Data, _Size);
+		}
+
+		Q_memcpy(this->_m_acBuffer + this->_m_iLength, _Data, static_cast<unsigned int>(_Size));
+		this->_m_iLength += _Size;
+
+		return this->FlushIfNeeded(this->_m_iLength - _Size);
+	}
+
+	Q_bool write(_In_z_ const char* _String) {
+		Q_SLOWASSERT(_String && "CWriter::write: What should I write?");
+		return this->write(_String, Q_strlen(_String));
+	}
+
+	Q_bool write(_In_ char _Character) {
+		return this->write(&_Character, 1);
+	}
+
+	//Formats straight into the tail of our buffer. Like Q_sprintf, one call produces at most FUNCTIONAL_SPRINTF_BUFFER_SIZE - 1 characters.
+	template<class... _Ts> Q_bool printf(_Printf_format_string_ _In_z_ const char* const _Format, _In_opt_ _Ts... _Args) {
+		Q_SLOWASSERT(_Format && "CWriter::printf: What should I print?");
+		if constexpr (sizeof...(_Args) == 0) {
+			return this->vprintf(_Format, Q_nullptr, 0);
+		} else {
+			const CArgValue arguments[] = { CArgValue::From(_Args)... };
+
+			return this->vprintf(_Format, arguments, sizeof...(_Args));
+		}
+	}
+
+	//printf for arguments that were captured earlier (CLogger).
+	Q_bool vprintf(_Printf_format_string_ _In_z_ const char* const _Format, _In_reads_(_Count) const CArgValue* _Args, _In_ functional_unsigned_size_t _Count) {
+		if (this->_m_bFailed) return Q_FALSE;
+		if (FUNCTIONAL_WRITER_BUFFER_SIZE - this->_m_iLength < FUNCTIONAL_SPRINTF_BUFFER_SIZE && !this->flush()) return Q_FALSE;
+
+		const functional_unsigned_size_t start = this->_m_iLength;
+		this->_m_iLength += static_cast<functional_unsigned_size_t>(Q_format_internal(this->_m_acBuffer + start, FUNCTIONAL_SPRINTF_BUFFER_SIZE, _Format, _Args, _Count));
+
+		return this->FlushIfNeeded(start);
+	}
+
+	//Hands everything buffered to the sink.
+	Q_bool flush() {
+		if (this->_m_bFailed) return Q_FALSE;
+		if (!this->_m_iLength) return Q_TRUE;
+
+		const functional_unsigned_size_t length = this->_m_iLength;
+		this->_m_iLength = 0;
+
+		return this->Emit(this->_m_acBuffer, length);
+	}
+
+	void SetMode(_In_ Q_buffer_mode _Mode) {
+		this->_m_Mode = _Mode;
+		this->FlushIfNeeded(0);
+	}
+
+	Q_buffer_mode GetMode() const {
+		return this->_m_Mode;
+	}
+
+	Q_bool Failed() const {
+		return this->_m_bFailed;
+	}
+
+	//Whatever was buffered when the sink failed is lost.
+	void ClearError() {
+		this->_m_bFailed = Q_FALSE;
+	}
+
+	functional_unsigned_size_t buffered() const {
+		return this->_m_iLength;
+	}
+private:
+	CWriter(CWriter const&);
+	CWriter& operator=(CWriter const&);
+
+	Q_bool Emit(_In_reads_bytes_(_Size) const void* _Data, _In_ functional_unsigned_size_t _Size) {
+		if (!this->_m_lpSink(_Data, _Size, this->_m_lpContext)) {
+			this->_m_bFailed = Q_TRUE;
+			this->_m_iLength = 0;
+			return Q_FALSE;
+		}
+
+		return Q_TRUE;
+	}
+
+	//_From is where the bytes just written start, only those are looked at for a newline.
+	Q_bool FlushIfNeeded(_In_ functional_unsigned_size_t _From) {
+		if (this->_m_Mode == Q_BUFFER_NONE) return this->flush();
+		if (this->_m_Mode == Q_BUFFER_LINE) {
+			for (functional_unsigned_size_t idx = this->_m_iLength; idx > _From; idx--) {
+				if (this->_m_acBuffer[idx - 1] == '\n') return this->flush();
+			}
+		}
+
+		return this->_m_iLength == FUNCTIONAL_WRITER_BUFFER_SIZE ? this->flush() : Q_TRUE;
+	}
+
+	Q_write_sink_t _m_lpSink;
+	void* _m_lpContext;
+	Q_buffer_mode _m_Mode;
+	Q_bool _m_bFailed;
+	functional_unsigned_size_t _m_iLength;
+	char _m_acBuffer[FUNCTIONAL_WRITER_BUFFER_SIZE];
+} CWriter;
+
+//Writes to a standard stream. FUNCTIONAL_STANDARD_WRITE wins over the raw write syscall, with neither of them the output is discarded.
+inline Q_bool Q_standard_write(_In_ int _Descriptor, _In_reads_bytes_(_Size) const void* _Data, _In_ functional_unsigned_size_t _Size) {
+#ifdef FUNCTIONAL_STANDARD_WRITE
+	return FUNCTIONAL_STANDARD_WRITE(_Descriptor, _Data, _Size) ? Q_TRUE : Q_FALSE;
+#elif defined(FUNCTIONAL_USE_LINUX_SYSCALLS)
+	const char* data = static_cast<const char*>(_Data);
+	while (_Size) {
+		const long written = Q_linux_syscall(Q_LINUX_SYS_WRITE, _Descriptor, reinterpret_cast<long>(data), static_cast<long>(_Size));
+		//-EINTR, try again.
+		if (written == -4) continue;
+		if (written <= 0) return Q_FALSE;
+		data += written;
+		_Size -= static_cast<functional_unsigned_size_t>(written);
+	}
+
+	return Q_TRUE;
+#else
+	(void)_Descriptor;
+	(void)_Data;
+	(void)_Size;
+
+	return Q_TRUE;
+#endif //FUNCTIONAL_STANDARD_WRITE
+}
+
+inline Q_bool Q_stdout_sink(_In_reads_bytes_(_Size) const void* _Data, _In_ functional_unsigned_size_t _Size, _In_opt_ void*) {
+	return Q_standard_write(1, _Data, _Size);
+}
+
+inline Q_bool Q_stderr_sink(_In_reads_bytes_(_Size) const void* _Data, _In_ functional_unsigned_size_t _Size, _In_opt_ void*) {
+	return Q_standard_write(2, _Data, _Size);
+}
+
+//Constant-initialized, so printing from a static constructor is fine. Nothing flushes them at exit: Q_stdout is line buffered,
+//call Q_flush(Q_stdout()) before you return if the last line has no newline.
+static CWriter gs_Stdout(Q_stdout_sink, Q_nullptr, Q_BUFFER_LINE);
+static CWriter gs_Stderr(Q_stderr_sink, Q_nullptr, Q_BUFFER_NONE);
+
+inline CWriter& Q_stdout() {
+	return gs_Stdout;
+}
+
+inline CWriter& Q_stderr() {
+	return gs_Stderr;
+}
+
+template<class... _Ts> Q_bool Q_fprintf(_In_ CWriter& _Writer, _Printf_format_string_ _In_z_ const char* const _Format, _In_opt_ _Ts... _Args) {
+	return _Writer.printf(_Format, _Args...);
+}
+
+template<class... _Ts> Q_bool Q_printf(_Printf_format_string_ _In_z_ const char* const _Format, _In_opt_ _Ts... _Args) {
+	return Q_stdout().printf(_Format, _Args...);
+}
+
+inline Q_bool Q_write(_In_ CWriter& _Writer, _In_reads_bytes_(_Size) const void* _Data, _In_ functional_unsigned_size_t _Size) {
+	return _Writer.write(_Data, _Size);
+}
+
+inline Q_bool Q_flush(_In_ CWriter& _Writer) {
+	return _Writer.flush();
+}
+
+//What a producer does when its ring is full.
+typedef enum Q_log_policy {
+	//Throw the new message away (counted in Dropped()).
+	Q_LOG_DROP,
+	//Wait for the consumer. If nobody else is draining, the producer drains itself, so this can't deadlock a single thread.
+	Q_LOG_BLOCK,
+	//Throw the oldest messages away to make room (counted in Dropped()).
+	Q_LOG_OVERWRITE
+} Q_log_policy;
+
+//Deferred logging: Log() only copies the format pointer and the arguments into the producer's ring, formatting and I/O happen in Drain().
+//Run Drain from a thread of your own (we don't create any) or from your main loop, give it a fully buffered writer.
+//Every producer has its own single-producer single-consumer ring, so Log() takes no lock. You number the producers (0 to _Producers - 1),
+//a number must only be used by one thread at a time. Messages of one producer come out in order, there is no order between producers.
+//The format string must outlive the message (a literal), string arguments are copied.
+typedef struct CLogger {
+	CLogger(_In_ CWriter& _Writer, _In_opt_ Q_log_policy _Policy = Q_LOG_DROP, _In_opt_ functional_unsigned_size_t _Producers = 8,
+		_In_opt_ functional_unsigned_size_t _RingSize = FUNCTIONAL_LOG_RING_SIZE) : _m_Writer(_Writer) {
+		Q_ASSERT(_RingSize && !(_RingSize & (_RingSize - 1)) && "CLogger: the ring size must be a power of two");
+		Q_ASSERT(_RingSize >= 4 * FUNCTIONAL_LOG_RECORD_SIZE && "CLogger: the ring must hold at least four records");
+		this->_m_Policy = _Policy;
+		this->_m_iRingSize = _RingSize;
+		this->_m_iProducers = _Producers;
+		//Everything is allocated here, Q_malloc isn't thread-safe and the producers are threads.
+		this->_m_a_lpChannels = static_cast<CChannel**>(Q_malloc(_Producers * sizeof(CChannel*)));
+		Q_ASSERT(this->_m_a_lpChannels && "Failed to allocate the channels at CLogger::CLogger");
+		for (functional_unsigned_size_t idx = 0; idx < _Producers; idx++) {
+			CChannel* channel = static_cast<CChannel*>(Q_aligned_malloc(sizeof(CChannel), FUNCTIONAL_CACHE_LINE_SIZE));
+			Q_ASSERT(channel && "Failed to allocate a channel at CLogger::CLogger");
+			Q_memset(channel, 0, sizeof(CChannel));
+			channel->m_lpRing = static_cast<char*>(Q_aligned_malloc(_RingSize, FUNCTIONAL_CACHE_LINE_SIZE));
+			Q_ASSERT(channel->m_lpRing && "Failed to allocate a ring at CLogger::CLogger");
+			this->_m_a_lpChannels[idx] = channel;
+		}
+		this->_m_lpScratch = static_cast<char*>(Q_malloc(FUNCTIONAL_LOG_RECORD_SIZE));
+		Q_ASSERT(this->_m_lpScratch && "Failed to allocate the scratch record at CLogger::CLogger");
+	}
+
+	//The producers must be done by now.
+	~CLogger() {
+		this->Drain();
+		for (functional_unsigned_size_t idx = 0; idx < this->_m_iProducers; idx++) {
+			Q_aligned_free(this->_m_a_lpChannels[idx]->m_lpRing);
+			Q_aligned_free(this->_m_a_lpChannels[idx]);
+		}
+		Q_free(this->_m_a_lpChannels);
+		Q_free(this->_m_lpScratch);
+	}
+
+	//Returns Q_FALSE when the message was dropped because the ring was full under Q_LOG_DROP.
+	//Strings that don't fit into FUNCTIONAL_LOG_RECORD_SIZE are cut. Arguments are taken by reference: a CString copy would go through Q_malloc.
+	template<class... _Ts> Q_bool Log(_In_ functional_unsigned_size_t _Producer, _Printf_format_string_ _In_z_ const char* const _Format, _In_opt_ const _Ts&... _Args) {
+		Q_SLOWASSERT(_Format && "CLogger::Log: What should I log?");
+		Q_SLOWASSERT(_Producer < this->_m_iProducers && "CLogger::Log: no such producer");
+		CChannel* channel = this->_m_a_lpChannels[_Producer];
+
+		if constexpr (sizeof...(_Args) == 0) {
+			return this->Push(channel, _Format, Q_nullptr, 0);
+		} else {
+			CArgValue arguments[] = { CArgValue::From(_Args)... };
+			return this->Push(channel, _Format, arguments, sizeof...(_Args));
+		}
+	}
+
+	//Formats and writes everything logged so far, then flushes the writer. Returns how many messages were written.
+	functional_unsigned_size_t Drain() {
+		this->_m_DrainLock.Lock();
+		const functional_unsigned_size_t written = this->DrainLocked();
+		this->_m_DrainLock.Unlock();
+
+		return written;
+	}
+
+	//Messages lost to a full ring, Q_LOG_DROP and Q_LOG_OVERWRITE only.
+	functional_uint64_t Dropped() const {
+		functional_uint64_t dropped = 0;
+		for (functional_unsigned_size_t idx = 0; idx < this->_m_iProducers; idx++) dropped += Q_atomic_load_relaxed(&this->_m_a_lpChannels[idx]->m_iDropped);
+
+		return dropped;
+	}
+private:
+	CLogger(CLogger const&);
+	CLogger& operator=(CLogger const&);
+
+	//Followed by m_iCount CArgValues and the copied strings. A null format marks padding up to the end of the ring.
+	typedef struct CRecord {
+		const char* m_lpszFormat;
+		functional_uint32_t m_iSize;
+		functional_uint32_t m_iCount;
+	} CRecord;
+
+	//Positions are running byte counts, the producer owns m_iHead and the consumer m_iTail (Q_LOG_OVERWRITE moves it from the producer side too).
+	//Each side sits on its own cache line.
+	typedef struct CChannel {
+		char* m_lpRing;
+		volatile functional_uint64_t m_iDropped;
+		char m_acPadding0[FUNCTIONAL_CACHE_LINE_SIZE];
+		volatile functional_uint64_t m_iHead;
+		//The producer's last look at m_iTail, so it only touches the consumer's line when the ring seems full.
+		functional_uint64_t m_iCachedTail;
+		char m_acPadding1[FUNCTIONAL_CACHE_LINE_SIZE];
+		volatile functional_uint64_t m_iTail;
+		char m_acPadding2[FUNCTIONAL_CACHE_LINE_SIZE];
+	} CChannel;
+
+	Q_bool Push(_In_ CChannel* _Channel, _In_z_ const char* _Format, _Inout_updates_opt_(_Count) CArgValue* _Args, _In_ functional_unsigned_size_t _Count) {
+		//Strings are stored with their terminator, the offset goes where the pointer was. Their (cut) lengths are kept in m_iSize meanwhile.
+		functional_unsigned_size_t size = sizeof(CRecord) + _Count * sizeof(CArgValue);
+		for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) {
+			if (_Args[idx].m_Type == Q_ARG_STRING && _Args[idx].m_lpPointer) ++size;
+		}
+		Q_ASSERT(size + 7 <= FUNCTIONAL_LOG_RECORD_SIZE && "CLogger::Log: too many arguments for FUNCTIONAL_LOG_RECORD_SIZE");
+		for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) {
+			if (_Args[idx].m_Type != Q_ARG_STRING || !_Args[idx].m_lpPointer) continue;
+
+			const functional_unsigned_size_t room = FUNCTIONAL_LOG_RECORD_SIZE - 7 - size;
+			const functional_unsigned_size_t length = Q_strlen(static_cast<const char*>(_Args[idx].m_lpPointer));
+			_Args[idx].m_iSize = length < room ? length : room;
+			size += _Args[idx].m_iSize;
+		}
+		size = (size + 7) & ~static_cast<functional_unsigned_size_t>(7);
+
+		const functional_uint64_t head = _Channel->m_iHead;
+		const functional_unsigned_size_t position = static_cast<functional_unsigned_size_t>(head & (this->_m_iRingSize - 1));
+		//Records never wrap around, the rest of the ring is skipped when the record doesn't fit.
+		const functional_unsigned_size_t skip = this->_m_iRingSize - position < size ? this->_m_iRingSize - position : 0;
+		if (!this->Reserve(_Channel, head, skip + size)) return Q_FALSE;
+
+		if (skip >= sizeof(CRecord)) {
+			CRecord* padding = reinterpret_cast<CRecord*>(_Channel->m_lpRing + position);
+			padding->m_lpszFormat = Q_nullptr;
+			padding->m_iSize = static_cast<functional_uint32_t>(skip);
+			padding->m_iCount = 0;
+		}
+
+		char* record = _Channel->m_lpRing + ((head + skip) & (this->_m_iRingSize - 1));
+		reinterpret_cast<CRecord*>(record)->m_lpszFormat = _Format;
+		reinterpret_cast<CRecord*>(record)->m_iSize = static_cast<functional_uint32_t>(size);
+		reinterpret_cast<CRecord*>(record)->m_iCount = static_cast<functional_uint32_t>(_Count);
+		CArgValue* arguments = reinterpret_cast<CArgValue*>(record + sizeof(CRecord));
+		functional_unsigned_size_t offset = sizeof(CRecord) + _Count * sizeof(CArgValue);
+		for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) {
+			arguments[idx] = _Args[idx];
+			if (_Args[idx].m_Type != Q_ARG_STRING) continue;
+			if (!_Args[idx].m_lpPointer) {
+				arguments[idx].m_iUnsigned = ~0ull;
+				continue;
+			}
+
+			Q_memcpy(record + offset, _Args[idx].m_lpPointer, static_cast<unsigned int>(_Args[idx].m_iSize));
+			record[offset + _Args[idx].m_iSize] = '\0';
+			arguments[idx].m_iUnsigned = offset;
+			arguments[idx].m_iSize = sizeof(const char*);
+			offset += _Args[idx].m_iSize + 1;
+		}
+
+		Q_atomic_store(&_Channel->m_iHead, head + skip + size);
+
+		return Q_TRUE;
+	}
+
+	//Makes _Size bytes from _Head on free, according to the policy.
+	Q_bool Reserve(_In_ CChannel* _Channel, _In_ functional_uint64_t _Head, _In_ functional_unsigned_size_t _Size) {
+		if (_Head + _Size - _Channel->m_iCachedTail <= this->_m_iRingSize) return Q_TRUE;
+
+		for (;;) {
+			_Channel->m_iCachedTail = Q_atomic_load(&_Channel->m_iTail);
+			if (_Head + _Size - _Channel->m_iCachedTail <= this->_m_iRingSize) return Q_TRUE;
+
+			switch (this->_m_Policy) {
+			case Q_LOG_DROP:
+				Q_atomic_store_relaxed(&_Channel->m_iDropped, _Channel->m_iDropped + 1);
+				return Q_FALSE;
+			case Q_LOG_BLOCK:
+				if (this->_m_DrainLock.TryLock()) {
+					this->DrainLocked();
+					this->_m_DrainLock.Unlock();
+				} else {
+					Q_cpu_relax();
+				}
+				break;
+			case Q_LOG_OVERWRITE: {
+				//We wrote everything behind the tail ourselves, so the sizes there are safe to read. Losing the race means the consumer took it.
+				functional_uint64_t tail = _Channel->m_iCachedTail;
+				if (Q_atomic_compare_exchange(&_Channel->m_iTail, tail, tail + this->RecordSpan(_Channel, tail))) {
+					const CRecord* record = reinterpret_cast<const CRecord*>(_Channel->m_lpRing + (tail & (this->_m_iRingSize - 1)));
+					if (this->_m_iRingSize - (tail & (this->_m_iRingSize - 1)) >= sizeof(CRecord) && record->m_lpszFormat) {
+						Q_atomic_store_relaxed(&_Channel->m_iDropped, _Channel->m_iDropped + 1);
+					}
+				}
+			}
+				break;
+			}
+		}
+	}
+
+	//How far the record (or padding) at _Tail reaches.
+	functional_unsigned_size_t RecordSpan(_In_ CChannel* _Channel, _In_ functional_uint64_t _Tail) {
+		const functional_unsigned_size_t position = static_cast<functional_unsigned_size_t>(_Tail & (this->_m_iRingSize - 1));
+		if (this->_m_iRingSize - position < sizeof(CRecord)) return this->_m_iRingSize - position;
+
+		return reinterpret_cast<const CRecord*>(_Channel->m_lpRing + position)->m_iSize;
+	}
+
+	functional_unsigned_size_t DrainLocked() {
+		functional_unsigned_size_t written = 0;
+		for (functional_unsigned_size_t idx = 0; idx < this->_m_iProducers; idx++) {
+			CChannel* channel = this->_m_a_lpChannels[idx];
+			for (;;) {
+				functional_uint64_t tail = Q_atomic_load(&channel->m_iTail);
+				const functional_uint64_t head = Q_atomic_load(&channel->m_iHead);
+				if (tail == head) break;
+
+				const functional_unsigned_size_t position = static_cast<functional_unsigned_size_t>(tail & (this->_m_iRingSize - 1));
+				const functional_unsigned_size_t size = this->RecordSpan(channel, tail);
+				//Under Q_LOG_OVERWRITE the producer may be writing over this record while we read it, so it's copied out
+				//first and only used if the tail didn't move in the meantime.
+				const Q_bool message = this->_m_iRingSize - position >= sizeof(CRecord) && reinterpret_cast<const CRecord*>(channel->m_lpRing + position)->m_lpszFormat ? Q_TRUE : Q_FALSE;
+				const Q_bool sane = size && size <= FUNCTIONAL_LOG_RECORD_SIZE && size <= head - tail && size <= this->_m_iRingSize - position ? Q_TRUE : Q_FALSE;
+				if (message && sane) Q_memcpy(this->_m_lpScratch, channel->m_lpRing + position, static_cast<unsigned int>(size));
+				if (!sane || !Q_atomic_compare_exchange(&channel->m_iTail, tail, tail + size) || !message) continue;
+
+				const CRecord* record = reinterpret_cast<const CRecord*>(this->_m_lpScratch);
+				CArgValue* arguments = reinterpret_cast<CArgValue*>(this->_m_lpScratch + sizeof(CRecord));
+				for (functional_unsigned_size_t arg = 0; arg < record->m_iCount; arg++) {
+					if (arguments[arg].m_Type == Q_ARG_STRING) {
+						arguments[arg].m_lpPointer = arguments[arg].m_iUnsigned == ~0ull ? Q_nullptr : this->_m_lpScratch + arguments[arg].m_iUnsigned;
+					}
+				}
+				this->_m_Writer.vprintf(record->m_lpszFormat, arguments, record->m_iCount);
+				++written;
+			}
+		}
+		if (written) this->_m_Writer.flush();
+
+		return written;
+	}
+
+	CWriter& _m_Writer;
+	Q_log_policy _m_Policy;
+	functional_unsigned_size_t _m_iRingSize;
+	functional_unsigned_size_t _m_iProducers;
+	CChannel** _m_a_lpChannels;
+	char* _m_lpScratch;
+	CSpinLock _m_DrainLock;
+} CLogger;
+
+//Rounds a queue capacity up to a power of two, at least 2.
+inline functional_unsigned_size_t Q_queue_capacity(_In_ functional_unsigned_size_t _Capacity) {
+	functional_unsigned_size_t capacity = 2;
+	while (capacity < _Capacity) capacity <<= 1;
+
+	return capacity;
+}
+
+//Bounded lock-free queue for exactly one producer thread and one consumer thread (Lamport's ring). Each side keeps its index on its own
+//cache line together with a cached copy of the other side's index, so the lines only bounce when the queue looks full or empty.
+//Storage is either Q_aligned_malloc'd or yours (StorageSize(capacity) bytes, aligned for _Ty, it must outlive the queue).
+template<class _Ty> struct CSpscQueue {
+	explicit CSpscQueue(_In_ functional_unsigned_size_t _Capacity) {
+		const functional_unsigned_size_t capacity = Q_queue_capacity(_Capacity);
+		this->_m_lpSlots = static_cast<_Ty*>(Q_aligned_malloc(StorageSize(capacity), FUNCTIONAL_CACHE_LINE_SIZE));
+		Q_ASSERT(this->_m_lpSlots && "Failed to allocate the slots at CSpscQueue::CSpscQueue");
+		this->Setup(capacity, Q_TRUE);
+	}
+
+	CSpscQueue(_In_ void* _Storage, _In_ functional_unsigned_size_t _Capacity) {
+		Q_ASSERT(_Storage && _Capacity >= 2 && !(_Capacity & (_Capacity - 1)) && "CSpscQueue: the capacity of your storage must be a power of two");
+		this->_m_lpSlots = static_cast<_Ty*>(_Storage);
+		this->Setup(_Capacity, Q_FALSE);
+	}
+
+	~CSpscQueue() {
+		for (functional_uint64_t idx = this->_m_iTail; idx != this->_m_iHead; idx++) this->_m_lpSlots[idx & this->_m_iMask].~_Ty();
+		if (this->_m_bOwnsStorage) Q_aligned_free(this->_m_lpSlots);
+	}
+
+	static constexpr functional_unsigned_size_t StorageSize(_In_ functional_unsigned_size_t _Capacity) {
+		return _Capacity * sizeof(_Ty);
+	}
+
+	//Producer side.
+	template<class _Arg> Q_bool push(_In_ _Arg&& _Value) {
+		const functional_uint64_t head = this->_m_iHead;
+		if (head - this->_m_iCachedTail > this->_m_iMask) {
+			this->_m_iCachedTail = Q_atomic_load(&this->_m_iTail);
+			if (head - this->_m_iCachedTail > this->_m_iMask) return Q_FALSE;
+		}
+
+		new (INewWrapper(), &this->_m_lpSlots[head & this->_m_iMask]) _Ty(forward<_Arg>(_Value));
+		Q_atomic_store(&this->_m_iHead, head + 1);
+
+		return Q_TRUE;
+	}
+
+	//Producer side. Pushes as many of _Values as fit, published with a single store. Returns how many.
+	functional_unsigned_size_t push(_In_reads_(_Count) const _Ty* _Values, _In_ functional_unsigned_size_t _Count) {
+		const functional_uint64_t head = this->_m_iHead;
+		functional_unsigned_size_t room = static_cast<functional_unsigned_size_t>(this->_m_iMask + 1 - (head - this->_m_iCachedTail));
+		if (room < _Count) {
+			this->_m_iCachedTail = Q_atomic_load(&this->_m_iTail);
+			room = static_cast<functional_unsigned_size_t>(this->_m_iMask + 1 - (head - this->_m_iCachedTail));
+		}
+		const functional_unsigned_size_t count = _Count < room ? _Count : room;
+
+		for (functional_unsigned_size_t idx = 0; idx < count; idx++) new (INewWrapper(), &this->_m_lpSlots[(head + idx) & this->_m_iMask]) _Ty(_Values[idx]);
+		if (count) Q_atomic_store(&this->_m_iHead, head + count);
+
+		return count;
+	}
+
+	//Consumer side.
+	Q_bool pop(_Out_ _Ty& _Value) {
+		const functional_uint64_t tail = this->_m_iTail;
+		if (tail == this->_m_iCachedHead) {
+			this->_m_iCachedHead = Q_atomic_load(&this->_m_iHead);
+			if (tail == this->_m_iCachedHead) return Q_FALSE;
+		}
+
+		_Ty& slot = this->_m_lpSlots[tail & this->_m_iMask];
+		_Value = move(slot);
+		slot.~_Ty();
+		Q_atomic_store(&this->_m_iTail, tail + 1);
+
+		return Q_TRUE;
+	}
+
+	//Consumer side. Pops up to _Count values, released with a single store. Returns how many.
+	functional_unsigned_size_t pop(_Out_writes_to_(_Count, return) _Ty* _Values, _In_ functional_unsigned_size_t _Count) {
+		const functional_uint64_t tail = this->_m_iTail;
+		functional_unsigned_size_t available = static_cast<functional_unsigned_size_t>(this->_m_iCachedHead - tail);
+		if (available < _Count) {
+			this->_m_iCachedHead = Q_atomic_load(&this->_m_iHead);
+			available = static_cast<functional_unsigned_size_t>(this->_m_iCachedHead - tail);
+		}
+		const functional_unsigned_size_t count = _Count < available ? _Count : available;
+
+		for (functional_unsigned_size_t idx = 0; idx < count; idx++) {
+			_Ty& slot = this->_m_lpSlots[(tail + idx) & this->_m_iMask];
+			_Values[idx] = move(slot);
+			slot.~_Ty();
+		}
+		if (count) Q_atomic_store(&this->_m_iTail, tail + count);
+
+		return count;
+	}
+
+	//Exact only when both sides are idle.
+	functional_unsigned_size_t size() const {
+		return static_cast<functional_unsigned_size_t>(Q_atomic_load(&this->_m_iHead) - Q_atomic_load(&this->_m_iTail));
+	}
+
+	Q_bool empty() const {
+		return this->size() ? Q_FALSE : Q_TRUE;
+	}
+
+	functional_unsigned_size_t capacity() const {
+		return static_cast<functional_unsigned_size_t>(this->_m_iMask + 1);
+	}
+private:
+	CSpscQueue(CSpscQueue const&);
+	CSpscQueue& operator=(CSpscQueue const&);
+
+	void Setup(_In_ functional_unsigned_size_t _Capacity, _In_ Q_bool _OwnsStorage) {
+		this->_m_iMask = _Capacity - 1;
+		this->_m_bOwnsStorage = _OwnsStorage;
+		this->_m_iHead = this->_m_iCachedTail = 0;
+		this->_m_iTail = this->_m_iCachedHead = 0;
+	}
+
+	_Ty* _m_lpSlots;
+	functional_uint64_t _m_iMask;
+	Q_bool _m_bOwnsStorage;
+	char _m_acPadding0[FUNCTIONAL_CACHE_LINE_SIZE];
+	volatile functional_uint64_t _m_iHead;
+	functional_uint64_t _m_iCachedTail;
+	char _m_acPadding1[FUNCTIONAL_CACHE_LINE_SIZE];
+	volatile functional_uint64_t _m_iTail;
+	functional_uint64_t _m_iCachedHead;
+	char _m_acPadding2[FUNCTIONAL_CACHE_LINE_SIZE];
+};
+
+//Bounded lock-free queue for any number of producers and consumers (Dmitry Vyukov's design). Every cell carries a sequence number
+//that tells whose turn it is, so a push or a pop is one CAS on its own index and never waits on the other side.
+//Storage is either Q_aligned_malloc'd or yours (StorageSize(capacity) bytes, 8 byte aligned at least, it must outlive the queue).
+template<class _Ty> struct CMpmcQueue {
+	explicit CMpmcQueue(_In_ functional_unsigned_size_t _Capacity) {
+		const functional_unsigned_size_t capacity = Q_queue_capacity(_Capacity);
+		this->_m_lpCells = static_cast<CCell*>(Q_aligned_malloc(StorageSize(capacity), FUNCTIONAL_CACHE_LINE_SIZE));
+		Q_ASSERT(this->_m_lpCells && "Failed to allocate the cells at CMpmcQueue::CMpmcQueue");
+		this->Setup(capacity, Q_TRUE);
+	}
+
+	CMpmcQueue(_In_ void* _Storage, _In_ functional_unsigned_size_t _Capacity) {
+		Q_ASSERT(_Storage && _Capacity >= 2 && !(_Capacity & (_Capacity - 1)) && "CMpmcQueue: the capacity of your storage must be a power of two");
+		this->_m_lpCells = static_cast<CCell*>(_Storage);
+		this->Setup(_Capacity, Q_FALSE);
+	}
+
+	~CMpmcQueue() {
+		for (functional_uint64_t idx = this->_m_iDequeue; idx != this->_m_iEnqueue; idx++) this->_m_lpCells[idx & this->_m_iMask].Value()->~_Ty();
+		if (this->_m_bOwnsStorage) Q_aligned_free(this->_m_lpCells);
+	}
+
+	static constexpr functional_unsigned_size_t StorageSize(_In_ functional_unsigned_size_t _Capacity) {
+		return _Capacity * sizeof(CCell);
+	}
+
+	template<class _Arg> Q_bool push(_In_ _Arg&& _Value) {
+		functional_uint64_t position = 0;
+		if (!this->Claim(this->_m_iEnqueue, 0, 1, position)) return Q_FALSE;
+
+		CCell& cell = this->_m_lpCells[position & this->_m_iMask];
+		new (INewWrapper(), cell.Value()) _Ty(forward<_Arg>(_Value));
+		Q_atomic_store(&cell.m_iSequence, position + 1);
+
+		return Q_TRUE;
+	}
+
+	//Claims as many consecutive cells as are free (up to _Count) with one CAS, then fills them. Returns how many were pushed.
+	functional_unsigned_size_t push(_In_reads_(_Count) const _Ty* _Values, _In_ functional_unsigned_size_t _Count) {
+		functional_uint64_t position = 0;
+		const functional_unsigned_size_t count = this->Claim(this->_m_iEnqueue, 0, _Count, position);
+
+		for (functional_unsigned_size_t idx = 0; idx < count; idx++) {
+			CCell& cell = this->_m_lpCells[(position + idx) & this->_m_iMask];
+			new (INewWrapper(), cell.Value()) _Ty(_Values[idx]);
+			Q_atomic_store(&cell.m_iSequence, position + idx + 1);
+		}
+
+		return count;
+	}
+
+	Q_bool pop(_Out_ _Ty& _Value) {
+		functional_uint64_t position = 0;
+		if (!this->Claim(this->_m_iDequeue, 1, 1, position)) return Q_FALSE;
+
+		CCell& cell = this->_m_lpCells[position & this->_m_iMask];
+		_Value = move(*cell.Value());
+		cell.Value()->~_Ty();
+		Q_atomic_store(&cell.m_iSequence, position + this->_m_iMask + 1);
+
+		return Q_TRUE;
+	}
+
+	//Pops up to _Count values that are ready in a row, with one CAS. Returns how many.
+	functional_unsigned_size_t pop(_Out_writes_to_(_Count, return) _Ty* _Values, _In_ functional_unsigned_size_t _Count) {
+		functional_uint64_t position = 0;
+		const functional_unsigned_size_t count = this->Claim(this->_m_iDequeue, 1, _Count, position);
+
+		for (functional_unsigned_size_t idx = 0; idx < count; idx++) {
+			CCell& cell = this->_m_lpCells[(position + idx) & this->_m_iMask];
+			_Values[idx] = move(*cell.Value());
+			cell.Value()->~_Ty();
+			Q_atomic_store(&cell.m_iSequence, position + idx + this->_m_iMask + 1);
+		}
+
+		return count;
+	}
+
+	//Approximate while other threads are at it.
+	functional_unsigned_size_t size() const {
+		const functional_uint64_t dequeue = Q_atomic_load(&this->_m_iDequeue);
+		const functional_uint64_t enqueue = Q_atomic_load(&this->_m_iEnqueue);
+
+		return enqueue > dequeue ? static_cast<functional_unsigned_size_t>(enqueue - dequeue) : 0;
+	}
+
+	Q_bool empty() const {
+		return this->size() ? Q_FALSE : Q_TRUE;
+	}
+
+	functional_unsigned_size_t capacity() const {
+		return static_cast<functional_unsigned_size_t>(this->_m_iMask + 1);
+	}
+private:
+	CMpmcQueue(CMpmcQueue const&);
+	CMpmcQueue& operator=(CMpmcQueue const&);
+
+	typedef struct CCell {
+		_Ty* Value() {
+			return reinterpret_cast<_Ty*>(this->m_a_cValue);
+		}
+
+		volatile functional_uint64_t m_iSequence;
+		alignas(_Ty) unsigned char m_a_cValue[sizeof(_Ty)];
+	} CCell;
+
+	void Setup(_In_ functional_unsigned_size_t _Capacity, _In_ Q_bool _OwnsStorage) {
+		this->_m_iMask = _Capacity - 1;
+		this->_m_bOwnsStorage = _OwnsStorage;
+		for (functional_unsigned_size_t idx = 0; idx < _Capacity; idx++) this->_m_lpCells[idx].m_iSequence = idx;
+		this->_m_iEnqueue = this->_m_iDequeue = 0;
+	}
+
+	//A cell at position p is free for a producer once its sequence is p, and ready for a consumer once it's p + 1 (_Lag).
+	//Counts how many cells from the index on are in that state, up to _Count, and claims them. Returns 0 when full or empty.
+	functional_unsigned_size_t Claim(_Inout_ volatile functional_uint64_t& _Index, _In_ functional_uint64_t _Lag, _In_ functional_unsigned_size_t _Count,
+		_Out_ functional_uint64_t& _Position) {
+		functional_uint64_t position = Q_atomic_load_relaxed(&_Index);
+		for (;;) {
+			const long long difference = static_cast<long long>(Q_atomic_load(&this->_m_lpCells[position & this->_m_iMask].m_iSequence) - (position + _Lag));
+			if (difference < 0) return 0;
+			if (difference > 0) {
+				//Somebody else claimed it, catch up.
+				position = Q_atomic_load_relaxed(&_Index);
+				continue;
+			}
+
+			functional_unsigned_size_t count = 1;
+			while (count < _Count && count <= this->_m_iMask && Q_atomic_load(&this->_m_lpCells[(position + count) & this->_m_iMask].m_iSequence) == position + count + _Lag) ++count;
+			if (Q_atomic_compare_exchange(&_Index, position, position + count)) {
+				_Position = position;
+				return count;
+			}
+		}
+	}
+
+	CCell* _m_lpCells;
+	functional_uint64_t _m_iMask;
+	Q_bool _m_bOwnsStorage;
+	char _m_acPadding0[FUNCTIONAL_CACHE_LINE_SIZE];
+	volatile functional_uint64_t _m_iEnqueue;
+	char _m_acPadding1[FUNCTIONAL_CACHE_LINE_SIZE];
+	volatile functional_uint64_t _m_iDequeue;
+	char _m_acPadding2[FUNCTIONAL_CACHE_LINE_SIZE];
+};
+
+//Holds _First and _Second, storing _First as an empty base when it has no state, so a pair with a stateless deleter is just the pointer.
+template<class _First, class _Second, bool = __is_empty(_First) && !__is_final(_First)> struct CCompressedPair : private _First {
+	CCompressedPair(_In_ const _First& _FirstValue, _In_ const _Second& _SecondValue) : _First(_FirstValue), _m_Second(_SecondValue) {}
+
+	_First& first() {
+		return *this;
+	}
+
+	const _First& first() const {
+		return *this;
+	}
+
+	_Second& second() {
+		return this->_m_Second;
+	}
+
+	const _Second& second() const {
+		return this->_m_Second;
+	}
+private:
+	_Second _m_Second;
+};
+
+template<class _First, class _Second> struct CCompressedPair<_First, _Second, false> {
+	CCompressedPair(_In_ const _First& _FirstValue, _In_ const _Second& _SecondValue) : _m_First(_FirstValue), _m_Second(_SecondValue) {}
+
+	_First& first() {
+		return this->_m_First;
+	}
+
+	const _First& first() const {
+		return this->_m_First;
+	}
+
+	_Second& second() {
+		return this->_m_Second;
+	}
+
+	const _Second& second() const {
+		return this->_m_Second;
+	}
+private:
+	_First _m_First;
+	_Second _m_Second;
+};
+
+//Header in front of arrays made by make_unique<_Ty[]>: the element count, padded so the elements stay aligned.
+template<class _Ty> struct CArrayHeader {
+	static constexpr functional_unsigned_size_t m_iSize = alignof(_Ty) > sizeof(functional_unsigned_size_t) ? alignof(_Ty) : sizeof(functional_unsigned_size_t);
+
+	static functional_unsigned_size_t& Count(_In_ _Ty* _Array) {
+		return *reinterpret_cast<functional_unsigned_size_t*>(reinterpret_cast<unsigned char*>(_Array) - m_iSize);
+	}
+};
+
+//Default deleter of CUniquePointer: Q_delete for objects...
+template<class _Ty> struct CDefaultDelete {
+	CDefaultDelete() {}
+
+	//Lets CUniquePointer<CDerived> move into CUniquePointer<CBase>.
+	template<class _Other> CDefaultDelete(_In_ const CDefaultDelete<_Other>&) {}
+
+	void operator()(_In_opt_ _Ty* _Pointer) const {
+		Q_delete(_Pointer);
+	}
+};
+
+//...and destroying every element and freeing the header for arrays from make_unique<_Ty[]>.
+template<class _Ty> struct CDefaultDelete<_Ty[]> {
+	void operator()(_In_opt_ _Ty* _Array) const {
+		if (!_Array) return;
+
+		for (functional_unsigned_size_t idx = CArrayHeader<_Ty>::Count(_Array); idx; idx--) _Array[idx - 1].~_Ty();
+		Q_free(reinterpret_cast<unsigned char*>(_Array) - CArrayHeader<_Ty>::m_iSize);
+	}
+};
+
+//Runs the destructor and leaves the memory alone, for objects placed in a CArena or a pool that is reclaimed as a whole.
+template<class _Ty> struct CDestructOnly {
+	void operator()(_In_opt_ _Ty* _Pointer) const {
+		if (_Pointer) _Pointer->~_Ty();
+	}
+};
+
+//Sole owner of an object, movable but not copyable. _Deleter decides how the object goes away (see CDefaultDelete, CDestructOnly);
+//stateless deleters take no space.
+template<class _Ty, class _Deleter = CDefaultDelete<_Ty>> struct CUniquePointer {
+	explicit CUniquePointer(_In_opt_ _Ty* _Pointer = Q_nullptr, _In_opt_ const _Deleter& _Delete = _Deleter()) : _m_Pair(_Delete, _Pointer) {}
+
+	CUniquePointer(_In_ CUniquePointer&& _Other) : _m_Pair(_Other.get_deleter(), _Other.release()) {}
+
+	template<class _Other, class _OtherDeleter> CUniquePointer(_In_ CUniquePointer<_Other, _OtherDeleter>&& _Pointer) : _m_Pair(_Pointer.get_deleter(), _Pointer.release()) {}
+
+	~CUniquePointer() {
+		this->reset();
+	}
+
+	CUniquePointer& operator=(_In_ CUniquePointer&& _Other) {
+		if (this != &_Other) {
+			this->reset(_Other.release());
+			this->get_deleter() = _Other.get_deleter();
+		}
+
+		return *this;
+	}
+
+	_Ty& operator*() const {
+		Q_ASSERT(this->get());
+		return *this->get();
+	}
+
+	_Ty* operator->() const {
+		Q_ASSERT(this->get());
+		return this->get();
+	}
+
+	_Ty* get() const {
+		return this->_m_Pair.second();
+	}
+
+	_Deleter& get_deleter() {
+		return this->_m_Pair.first();
+	}
+
+	const _Deleter& get_deleter() const {
+		return this->_m_Pair.first();
+	}
+
+	explicit operator bool() const {
+		return this->get() != Q_nullptr;
+	}
+
+	//Gives up ownership without destroying anything.
+	_Ty* release() {
+		_Ty* pointer = this->_m_Pair.second();
+		this->_m_Pair.second() = Q_nullptr;
+
+		return pointer;
+	}
+
+	void reset(_In_opt_ _Ty* _Pointer = Q_nullptr) {
+		_Ty* old = this->_m_Pair.second();
+		this->_m_Pair.second() = _Pointer;
+		if (old) this->get_deleter()(old);
+	}
+
+	void swap(_Inout_ CUniquePointer& _Other) {
+		_Ty* pointer = this->_m_Pair.second();
+		this->_m_Pair.second() = _Other._m_Pair.second();
+		_Other._m_Pair.second() = pointer;
+
+		_Deleter deleter = this->get_deleter();
+		this->get_deleter() = _Other.get_deleter();
+		_Other.get_deleter() = deleter;
+	}
+private:
+	CCompressedPair<_Deleter, _Ty*> _m_Pair;
+
+	CUniquePointer(CUniquePointer const&);
+	CUniquePointer& operator=(CUniquePointer const&);
+
+	void operator==(CUniquePointer const&) const;
+	void operator!=(CUniquePointer const&) const;
+};
+
+//Arrays: operator[] instead of * and ->, released through CDefaultDelete<_Ty[]> unless told otherwise.
+//With the default deleter only make_unique<_Ty[]> can hand one an array, the deleter relies on the count it stores in front of it.
+template<class _Ty, class _Deleter> struct CUniquePointer<_Ty[], _Deleter> {
+	CUniquePointer() : _m_Pair(_Deleter(), Q_nullptr) {}
+
+	template<class _Other = _Deleter, class = enable_if_t<!is_same_v<_Other, CDefaultDelete<_Ty[]>>>>
+	explicit CUniquePointer(_In_opt_ _Ty* _Array, _In_opt_ const _Deleter& _Delete = _Deleter()) : _m_Pair(_Delete, _Array) {}
+
+	CUniquePointer(_In_ CUniquePointer&& _Other) : _m_Pair(_Other.get_deleter(), _Other.release()) {}
+
+	~CUniquePointer() {
+		this->reset();
+	}
+
+	CUniquePointer& operator=(_In_ CUniquePointer&& _Other) {
+		if (this != &_Other) {
+			this->Replace(_Other.release());
+			this->get_deleter() = _Other.get_deleter();
+		}
+
+		return *this;
+	}
+
+	_Ty& operator[](_In_ functional_unsigned_size_t _Index) const {
+		Q_ASSERT(this->get());
+		return this->get()[_Index];
+	}
+
+	_Ty* get() const {
+		return this->_m_Pair.second();
+	}
+
+	_Deleter& get_deleter() {
+		return this->_m_Pair.first();
+	}
+
+	const _Deleter& get_deleter() const {
+		return this->_m_Pair.first();
+	}
+
+	explicit operator bool() const {
+		return this->get() != Q_nullptr;
+	}
+
+	_Ty* release() {
+		_Ty* pointer = this->_m_Pair.second();
+		this->_m_Pair.second() = Q_nullptr;
+
+		return pointer;
+	}
+
+	void reset() {
+		this->Replace(Q_nullptr);
+	}
+
+	template<class _Other = _Deleter, class = enable_if_t<!is_same_v<_Other, CDefaultDelete<_Ty[]>>>> void reset(_In_opt_ _Ty* _Array) {
+		this->Replace(_Array);
+	}
+private:
+	template<class _Array, class> friend CUniquePointer<_Array> make_unique(_In_ functional_unsigned_size_t _Count);
+
+	typedef struct CAdopt {} CAdopt;
+
+	CUniquePointer(CAdopt, _In_ _Ty* _Array) : _m_Pair(_Deleter(), _Array) {}
+
+	void Replace(_In_opt_ _Ty* _Array) {
+		_Ty* old = this->_m_Pair.second();
+		this->_m_Pair.second() = _Array;
+		if (old) this->get_deleter()(old);
+	}
+
+	CCompressedPair<_Deleter, _Ty*> _m_Pair;
+
+	CUniquePointer(CUniquePointer const&);
+	CUniquePointer& operator=(CUniquePointer const&);
+};
+
+template<class _Ty, class... _Ts, class = enable_if_t<!is_array<_Ty>::value>> CUniquePointer<_Ty> make_unique(_In_opt_ _Ts&&... _Args) {
+	return CUniquePointer<_Ty>(Q_new(_Ty)(forward<_Ts>(_Args)...));
+}
+
+//_Count value-initialized elements in one Q_malloc, with the count stored in front of them.
+template<class _Ty, class = enable_if_t<is_array<_Ty>::value>> CUniquePointer<_Ty> make_unique(_In_ functional_unsigned_size_t _Count) {
+	typedef typename remove_extent<_Ty>::type element;
+	auto memory = static_cast<unsigned char*>(Q_malloc(CArrayHeader<element>::m_iSize + sizeof(element) * _Count));
+	Q_ASSERT(memory && "Failed to allocate the array of make_unique");
+
+	auto array = reinterpret_cast<element*>(memory + CArrayHeader<element>::m_iSize);
+	CArrayHeader<element>::Count(array) = _Count;
+	for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) new (INewWrapper(), &array[idx]) element();
+
+	return CUniquePointer<_Ty>(typename CUniquePointer<_Ty>::CAdopt(), array);
+}
+
+//Reference count policies for CSharedPointer/CWeakPointer/CRefCounted. The non-atomic one is for objects that never leave their thread.
+typedef struct CAtomicRefCountPolicy {
+	typedef volatile long type;
+
+	static void Increment(_Inout_ type& _Count) {
+		Q_atomic_fetch_add(&_Count, 1L);
+	}
+
+	//Returns the new count.
+	static long Decrement(_Inout_ type& _Count) {
+		return Q_atomic_fetch_add(&_Count, -1L) - 1;
+	}
+
+	//For CWeakPointer::lock: takes a reference only while the object is still alive.
+	static Q_bool IncrementIfNotZero(_Inout_ type& _Count) {
+		long expected = Q_atomic_load_relaxed(&_Count);
+		while (expected) {
+			if (Q_atomic_compare_exchange(&_Count, expected, expected + 1)) return Q_TRUE;
+		}
+
+		return Q_FALSE;
+	}
+
+	static long Load(_In_ const type& _Count) {
+		return Q_atomic_load(&_Count);
+	}
+} CAtomicRefCountPolicy;
+
+typedef struct CNonAtomicRefCountPolicy {
+	typedef long type;
+
+	static void Increment(_Inout_ type& _Count) {
+		++_Count;
+	}
+
+	static long Decrement(_Inout_ type& _Count) {
+		return --_Count;
+	}
+
+	static Q_bool IncrementIfNotZero(_Inout_ type& _Count) {
+		if (!_Count) return Q_FALSE;
+		++_Count;
+		return Q_TRUE;
+	}
+
+	static long Load(_In_ const type& _Count) {
+		return _Count;
+	}
+} CNonAtomicRefCountPolicy;
+
+//Shared by every CSharedPointer/CWeakPointer of one object. m_iWeak counts weak pointers plus one for all the strong ones together,
+//the block is freed when it drops to zero. make_shared places the object right after the block, in the same Q_malloc.
+template<class _Policy> struct CSharedControlBlock {
+	typename _Policy::type m_iStrong;
+	typename _Policy::type m_iWeak;
+	void(*m_lpDestroy)(_Inout_ CSharedControlBlock* _Block);
+};
+
+template<class _Ty, class _Policy> struct CSharedInplaceBlock : CSharedControlBlock<_Policy> {
+	static void Destroy(_Inout_ CSharedControlBlock<_Policy>* _Block) {
+		static_cast<CSharedInplaceBlock*>(_Block)->Object()->~_Ty();
+	}
+
+	_Ty* Object() {
+		return reinterpret_cast<_Ty*>(this->m_a_cObject);
+	}
+
+	alignas(_Ty) unsigned char m_a_cObject[sizeof(_Ty)];
+};
+
+//For objects that already exist (Q_new'd): the block holds a pointer and Q_delete's it.
+template<class _Ty, class _Policy> struct CSharedPointerBlock : CSharedControlBlock<_Policy> {
+	static void Destroy(_Inout_ CSharedControlBlock<_Policy>* _Block) {
+		Q_delete(static_cast<CSharedPointerBlock*>(_Block)->m_lpObject);
+	}
+
+	_Ty* m_lpObject;
+};
+
+template<class _Ty, class _Policy> struct CWeakPointer;
+
+//Shared ownership: the object dies with its last CSharedPointer, the memory goes with the last CWeakPointer.
+//Pass CNonAtomicRefCountPolicy (or use CLocalSharedPointer) when the pointer never crosses threads.
+template<class _Ty, class _Policy = CAtomicRefCountPolicy> struct CSharedPointer {
+	typedef CSharedControlBlock<_Policy> CControlBlock;
+
+	CSharedPointer() : _m_lpObject(Q_nullptr), _m_lpControl(Q_nullptr) {}
+
+	//Takes ownership of a Q_new'd object. Prefer make_shared, which saves an allocation.
+	explicit CSharedPointer(_In_opt_ _Ty* _Pointer) : _m_lpObject(_Pointer), _m_lpControl(Q_nullptr) {
+		if (!_Pointer) return;
+
+		auto block = static_cast<CSharedPointerBlock<_Ty, _Policy>*>(Q_malloc(sizeof(CSharedPointerBlock<_Ty, _Policy>)));
+		Q_ASSERT(block && "Failed to allocate the control block of a CSharedPointer");
+		block->m_iStrong = 1;
+		block->m_iWeak = 1;
+		block->m_lpDestroy = &CSharedPointerBlock<_Ty, _Policy>::Destroy;
+		block->m_lpObject = _Pointer;
+		this->_m_lpControl = block;
+	}
+
+	CSharedPointer(_In_ const CSharedPointer& _Other) : _m_lpObject(_Other._m_lpObject), _m_lpControl(_Other._m_lpControl) {
+		if (this->_m_lpControl) _Policy::Increment(this->_m_lpControl->m_iStrong);
+	}
+
+	CSharedPointer(_In_ CSharedPointer&& _Other) : _m_lpObject(_Other._m_lpObject), _m_lpControl(_Other._m_lpControl) {
+		_Other._m_lpObject = Q_nullptr;
+		_Other._m_lpControl = Q_nullptr;
+	}
+
+	//Upcasts, CSharedPointer<CBase> base = derived;
+	template<class _Other> CSharedPointer(_In_ const CSharedPointer<_Other, _Policy>& _Pointer) : _m_lpObject(_Pointer._m_lpObject), _m_lpControl(_Pointer._m_lpControl) {
+		if (this->_m_lpControl) _Policy::Increment(this->_m_lpControl->m_iStrong);
+	}
+
+	~CSharedPointer() {
+		this->Release();
+	}
+
+	CSharedPointer& operator=(_In_ const CSharedPointer& _Other) {
+		CSharedPointer copy(_Other);
+		this->swap(copy);
+
+		return *this;
+	}
+
+	CSharedPointer& operator=(_In_ CSharedPointer&& _Other) {
+		CSharedPointer moved(move(_Other));
+		this->swap(moved);
+
+		return *this;
+	}
+
+	_Ty& operator*() const {
+		Q_ASSERT(this->_m_lpObject);
+		return *this->_m_lpObject;
+	}
+
+	_Ty* operator->() const {
+		Q_ASSERT(this->_m_lpObject);
+		return this->_m_lpObject;
+	}
+
+	_Ty* get() const {
+		return this->_m_lpObject;
+	}
+
+	explicit operator bool() const {
+		return this->_m_lpObject != Q_nullptr;
+	}
+
+	long use_count() const {
+		return this->_m_lpControl ? _Policy::Load(this->_m_lpControl->m_iStrong) : 0;
+	}
+
+	void reset() {
+		this->Release();
+		this->_m_lpObject = Q_nullptr;
+		this->_m_lpControl = Q_nullptr;
+	}
+
+	void swap(_Inout_ CSharedPointer& _Other) {
+		_Ty* object = this->_m_lpObject;
+		CControlBlock* control = this->_m_lpControl;
+		this->_m_lpObject = _Other._m_lpObject;
+		this->_m_lpControl = _Other._m_lpControl;
+		_Other._m_lpObject = object;
+		_Other._m_lpControl = control;
+	}
+
+	bool operator==(_In_ const CSharedPointer& _Other) const {
+		return this->_m_lpObject == _Other._m_lpObject;
+	}
+
+	bool operator!=(_In_ const CSharedPointer& _Other) const {
+		return this->_m_lpObject != _Other._m_lpObject;
+	}
+
+	//The one allocation behind make_shared/make_local_shared.
+	template<class... _Ts> static CSharedPointer Create(_In_opt_ _Ts&&... _Args) {
+		typedef CSharedInplaceBlock<_Ty, _Policy> block_type;
+		auto block = static_cast<block_type*>(Q_malloc(sizeof(block_type)));
+		Q_ASSERT(block && "Failed to allocate the object of make_shared");
+		new (INewWrapper(), block->m_a_cObject) _Ty(forward<_Ts>(_Args)...);
+		block->m_iStrong = 1;
+		block->m_iWeak = 1;
+		block->m_lpDestroy = &block_type::Destroy;
+
+		return CSharedPointer(block->Object(), block);
+	}
+private:
+	template<class _Other, class _OtherPolicy> friend struct CSharedPointer;
+	friend struct CWeakPointer<_Ty, _Policy>;
+
+	//Adopts a reference that was already counted.
+	CSharedPointer(_In_ _Ty* _Object, _In_ CControlBlock* _Control) : _m_lpObject(_Object), _m_lpControl(_Control) {}
+
+	void Release() {
+		if (!this->_m_lpControl || _Policy::Decrement(this->_m_lpControl->m_iStrong)) return;
+
+		this->_m_lpControl->m_lpDestroy(this->_m_lpControl);
+		if (!_Policy::Decrement(this->_m_lpControl->m_iWeak)) Q_free(this->_m_lpControl);
+	}
+
+	_Ty* _m_lpObject;
+	CControlBlock* _m_lpControl;
+};
+
+template<class _Ty> using CLocalSharedPointer = CSharedPointer<_Ty, CNonAtomicRefCountPolicy>;
+
+//Observes a CSharedPointer without keeping the object alive. lock() gives a CSharedPointer, empty once the object is gone.
+template<class _Ty, class _Policy = CAtomicRefCountPolicy> struct CWeakPointer {
+	typedef CSharedControlBlock<_Policy> CControlBlock;
+
+	CWeakPointer() : _m_lpObject(Q_nullptr), _m_lpControl(Q_nullptr) {}
+
+	CWeakPointer(_In_ const CSharedPointer<_Ty, _Policy>& _Shared) : _m_lpObject(_Shared._m_lpObject), _m_lpControl(_Shared._m_lpControl) {
+		if (this->_m_lpControl) _Policy::Increment(this->_m_lpControl->m_iWeak);
+	}
+
+	CWeakPointer(_In_ const CWeakPointer& _Other) : _m_lpObject(_Other._m_lpObject), _m_lpControl(_Other._m_lpControl) {
+		if (this->_m_lpControl) _Policy::Increment(this->_m_lpControl->m_iWeak);
+	}
+
+	CWeakPointer(_In_ CWeakPointer&& _Other) : _m_lpObject(_Other._m_lpObject), _m_lpControl(_Other._m_lpControl) {
+		_Other._m_lpObject = Q_nullptr;
+		_Other._m_lpControl = Q_nullptr;
+	}
+
+	~CWeakPointer() {
+		this->Release();
+	}
+
+	CWeakPointer& operator=(_In_ const CWeakPointer& _Other) {
+		CWeakPointer copy(_Other);
+		this->swap(copy);
+
+		return *this;
+	}
+
+	CWeakPointer& operator=(_In_ CWeakPointer&& _Other) {
+		CWeakPointer moved(move(_Other));
+		this->swap(moved);
+
+		return *this;
+	}
+
+	CSharedPointer<_Ty, _Policy> lock() const {
+		if (!this->_m_lpControl || !_Policy::IncrementIfNotZero(this->_m_lpControl->m_iStrong)) return CSharedPointer<_Ty, _Policy>();
+
+		return CSharedPointer<_Ty, _Policy>(this->_m_lpObject, this->_m_lpControl);
+	}
+
+	Q_bool expired() const {
+		return this->use_count() ? Q_FALSE : Q_TRUE;
+	}
+
+	long use_count() const {
+		return this->_m_lpControl ? _Policy::Load(this->_m_lpControl->m_iStrong) : 0;
+	}
+
+	void reset() {
+		this->Release();
+		this->_m_lpObject = Q_nullptr;
+		this->_m_lpControl = Q_nullptr;
+	}
+
+	void swap(_Inout_ CWeakPointer& _Other) {
+		_Ty* object = this->_m_lpObject;
+		CControlBlock* control = this->_m_lpControl;
+		this->_m_lpObject = _Other._m_lpObject;
+		this->_m_lpControl = _Other._m_lpControl;
+		_Other._m_lpObject = object;
+		_Other._m_lpControl = control;
+	}
+private:
+	void Release() {
+		if (this->_m_lpControl && !_Policy::Decrement(this->_m_lpControl->m_iWeak)) Q_free(this->_m_lpControl);
+	}
+
+	_Ty* _m_lpObject;
+	CControlBlock* _m_lpControl;
+};
+
+template<class _Ty, class... _Ts> CSharedPointer<_Ty> make_shared(_In_opt_ _Ts&&... _Args) {
+	return CSharedPointer<_Ty>::Create(forward<_Ts>(_Args)...);
+}
+
+template<class _Ty, class... _Ts> CLocalSharedPointer<_Ty> make_local_shared(_In_opt_ _Ts&&... _Args) {
+	return CLocalSharedPointer<_Ty>::Create(forward<_Ts>(_Args)...);
+}
+
+//Intrusive counting: the count lives in the object, so CIntrusivePointer is a single pointer and needs no control block.
+//struct CTexture : CRefCounted<CTexture> { ... }; CIntrusivePointer<CTexture> texture = make_intrusive<CTexture>();
+//The object must come from Q_new (make_intrusive does that). No weak pointers.
+template<class _Derived, class _Policy = CAtomicRefCountPolicy> struct CRefCounted {
+	CRefCounted() : _m_iReferences(0) {}
+
+	//Copies are new objects with their own count.
+	CRefCounted(_In_ const CRefCounted&) : _m_iReferences(0) {}
+
+	CRefCounted& operator=(_In_ const CRefCounted&) {
+		return *this;
+	}
+
+	void AddReference() const {
+		_Policy::Increment(this->_m_iReferences);
+	}
+
+	void Release() const {
+		if (!_Policy::Decrement(this->_m_iReferences)) Q_delete(static_cast<_Derived*>(const_cast<CRefCounted*>(this)));
+	}
+
+	long use_count() const {
+		return _Policy::Load(this->_m_iReferences);
+	}
+private:
+	mutable typename _Policy::type _m_iReferences;
+};
+
+//Works with anything that has AddReference() and Release(), not just CRefCounted.
+template<class _Ty> struct CIntrusivePointer {
+	CIntrusivePointer(_In_opt_ _Ty* _Pointer = Q_nullptr) : _m_lpObject(_Pointer) {
+		if (_Pointer) _Pointer->AddReference();
+	}
+
+	CIntrusivePointer(_In_ const CIntrusivePointer& _Other) : _m_lpObject(_Other._m_lpObject) {
+		if (this->_m_lpObject) this->_m_lpObject->AddReference();
+	}
+
+	CIntrusivePointer(_In_ CIntrusivePointer&& _Other) : _m_lpObject(_Other._m_lpObject) {
+		_Other._m_lpObject = Q_nullptr;
+	}
+
+	~CIntrusivePointer() {
+		if (this->_m_lpObject) this->_m_lpObject->Release();
+	}
+
+	CIntrusivePointer& operator=(_In_ const CIntrusivePointer& _Other) {
+		CIntrusivePointer copy(_Other);
+		this->swap(copy);
+
+		return *this;
+	}
+
+	CIntrusivePointer& operator=(_In_ CIntrusivePointer&& _Other) {
+		CIntrusivePointer moved(move(_Other));
+		this->swap(moved);
+
+		return *this;
+	}
+
+	_Ty& operator*() const {
+		Q_ASSERT(this->_m_lpObject);
+		return *this->_m_lpObject;
+	}
+
+	_Ty* operator->() const {
+		Q_ASSERT(this->_m_lpObject);
+		return this->_m_lpObject;
+	}
+
+	_Ty* get() const {
+		return this->_m_lpObject;
+	}
+
+	explicit operator bool() const {
+		return this->_m_lpObject != Q_nullptr;
+	}
+
+	void reset() {
+		CIntrusivePointer empty;
+		this->swap(empty);
+	}
+
+	void swap(_Inout_ CIntrusivePointer& _Other) {
+		_Ty* object = this->_m_lpObject;
+		this->_m_lpObject = _Other._m_lpObject;
+		_Other._m_lpObject = object;
+	}
+private:
+	_Ty* _m_lpObject;
+};
+
+template<class _Ty, class... _Ts> CIntrusivePointer<_Ty> make_intrusive(_In_opt_ _Ts&&... _Args) {
+	return CIntrusivePointer<_Ty>(Q_new(_Ty)(forward<_Ts>(_Args)...));
+}
+
+//The CString type is defined after our namespace which is defined a bit later than CParameterPackExpander. (refer to Q_ASSERT)
+template<class _ResultType> _ResultType& CParameterPackExpander::at(_In_ functional_size_t _Where) {
+	Q_ASSERT(_Where < this->m_iArgsSize);
+	_ResultType& _Which = (_ResultType&)(*static_cast<_ResultType*>(this->m_a_lpTotalArgs[_Where]));
+
+	return _Which;
+}
+
+//Hashing & equality policy of CHashMap. Works as-is for integers, enums and pointers; specialize it for your own key types.
+//Every Hash overload of one specialization must give equal values for equal keys (that's what makes heterogeneous lookup work).
+template<class _Ty> struct CHasher {
+	static functional_uint64_t Hash(_In_ const _Ty& _Key) {
+		return Q_hash_integer(static_cast<functional_uint64_t>(_Key));
+	}
+
+	static Q_bool Equals(_In_ const _Ty& _Lhs, _In_ const _Ty& _Rhs) {
+		return _Lhs == _Rhs ? Q_TRUE : Q_FALSE;
+	}
+};
+
+template<class _Ty> struct CHasher<_Ty*> {
+	static functional_uint64_t Hash(_In_opt_ const _Ty* _Key) {
+		return Q_hash_integer(reinterpret_cast<functional_uintptr_t>(_Key));
+	}
+
+	static Q_bool Equals(_In_opt_ const _Ty* _Lhs, _In_opt_ const _Ty* _Rhs) {
+		return _Lhs == _Rhs ? Q_TRUE : Q_FALSE;
+	}
+};
+
+//CString keys may be looked up by plain C strings without constructing a temporary CString.
+template<> struct CHasher<CString> {
+	static functional_uint64_t Hash(_In_ const CString& _Key) {
+		return _Key.hash();
+	}
+
+	static functional_uint64_t Hash(_In_z_ const char* _Key) {
+		return Q_hash_string(_Key);
+	}
+
+	static Q_bool Equals(_In_ const CString& _Lhs, _In_ const CString& _Rhs) {
+		return (_Lhs.length() == _Rhs.length() && Q_memcmp(_Lhs.c_str(), _Rhs.c_str(), _Lhs.length()) == 0) ? Q_TRUE : Q_FALSE;
+	}
+
+	static Q_bool Equals(_In_ const CString& _Lhs, _In_z_ const char* _Rhs) {
+		const functional_unsigned_size_t length = _Lhs.length();
+		return (Q_memcmp(_Lhs.c_str(), _Rhs, length) == 0 && _Rhs[length] == '\0') ? Q_TRUE : Q_FALSE;
+	}
+};
+
+//One probing window of CHashMap control bytes. With FUNCTIONAL_USE_SSE2 a window is 16 bytes compared in one instruction,
+//otherwise 8 bytes packed into an integer and compared with bit tricks. Masks have one bit set per matching slot.
+typedef struct CHashMapGroup {
+	static constexpr signed char m_iEmpty = -128;
+	static constexpr signed char m_iDeleted = -2;
+
+#ifdef FUNCTIONAL_USE_SSE2
+	static constexpr functional_unsigned_size_t m_iWidth = 16;
+	typedef functional_uint32_t m_tMask;
+
+	explicit CHashMapGroup(_In_reads_(m_iWidth) const signed char* _Control) {
+		this->_m_Control = _mm_loadu_si128(reinterpret_cast<const __m128i*>(_Control));
+	}
+
+	m_tMask Match(_In_ signed char _Hash) const {
+		return static_cast<m_tMask>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(_Hash), this->_m_Control)));
+	}
+
+	m_tMask MaskEmpty() const {
+		return static_cast<m_tMask>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(m_iEmpty), this->_m_Control)));
+	}
+
+	//Both special values are below -1, full slots hold 0..127.
+	m_tMask MaskEmptyOrDeleted() const {
+		return static_cast<m_tMask>(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), this->_m_Control)));
+	}
+
+	static functional_unsigned_size_t LowestIndex(_In_ m_tMask _Mask) {
+		return Q_count_trailing_zeros(_Mask);
+	}
+
+	static functional_unsigned_size_t LeadingCount(_In_ m_tMask _Mask) {
+		return _Mask ? Q_count_leading_zeros(_Mask) - (64 - m_iWidth) : m_iWidth;
+	}
+private:
+	__m128i _m_Control;
+#else
+	static constexpr functional_unsigned_size_t m_iWidth = 8;
+	typedef functional_uint64_t m_tMask;
+
+	explicit CHashMapGroup(_In_reads_(m_iWidth) const signed char* _Control) {
+		this->_m_iControl = Q_hash_read64(_Control);
+	}
+
+	//May report a false positive right above a real match, which is fine since keys are compared afterwards anyway.
+	m_tMask Match(_In_ signed char _Hash) const {
+		const functional_uint64_t x = this->_m_iControl ^ (m_iLsbs * static_cast<unsigned char>(_Hash));
+		return (x - m_iLsbs) & ~x & m_iMsbs;
+	}
+
+	//Empty (0x80) is the only value with the top bit set and bit 1 clear.
+	m_tMask MaskEmpty() const {
+		return (this->_m_iControl & ~(this->_m_iControl << 6)) & m_iMsbs;
+	}
+
+	m_tMask MaskEmptyOrDeleted() const {
+		return (this->_m_iControl & ~(this->_m_iControl << 7)) & m_iMsbs;
+	}
+
+	static functional_unsigned_size_t LowestIndex(_In_ m_tMask _Mask) {
+		return Q_count_trailing_zeros(_Mask) >> 3;
+	}
+
+	static functional_unsigned_size_t LeadingCount(_In_ m_tMask _Mask) {
+		return _Mask ? Q_count_leading_zeros(_Mask) >> 3 : m_iWidth;
+	}
+private:
+	static constexpr functional_uint64_t m_iLsbs = 0x0101010101010101ull;
+	static constexpr functional_uint64_t m_iMsbs = 0x8080808080808080ull;
+
+	functional_uint64_t _m_iControl;
+#endif //FUNCTIONAL_USE_SSE2
+public:
+	static functional_unsigned_size_t TrailingCount(_In_ m_tMask _Mask) {
+		return _Mask ? LowestIndex(_Mask) : m_iWidth;
+	}
+} CHashMapGroup;
+
+//Open addressing hash map with SwissTable-style control bytes: one byte per slot holding 7 bits of the hash (or empty/deleted),
+//probed a whole group at a time. Keys and values are stored inline, may be move-only and are never copied by the map itself.
+//Non-copyable
+template<class _Key, class _Value, class _Hasher = CHasher<_Key>, class _Allocator = CDefaultAllocator> struct CHashMap : private _Allocator {
+	struct CSlot {
+		template<class _KeyArg, class... _Args> CSlot(_In_ _KeyArg&& _KeyArgument, _In_opt_ _Args&&... _Arguments) : m_Key(forward<_KeyArg>(_KeyArgument)), m_Value(forward<_Args>(_Arguments)...) {}
+
+		_Key m_Key;
+		_Value m_Value;
+	};
+
+	struct CIterator {
+		CIterator(_In_ const CHashMap* _Map, _In_ functional_unsigned_size_t _Index) : _m_lpMap(_Map), _m_iIndex(_Index) {
+			this->SkipFree();
+		}
+
+		CSlot& operator*() const {
+			return this->_m_lpMap->_m_lpSlots[this->_m_iIndex];
+		}
+
+		CSlot* operator->() const {
+			return &this->_m_lpMap->_m_lpSlots[this->_m_iIndex];
+		}
+
+		CIterator& operator++() {
+			++this->_m_iIndex;
+			this->SkipFree();
+			return *this;
+		}
+
+		bool operator!=(_In_ const CIterator& _Rhs) const {
+			return this->_m_iIndex != _Rhs._m_iIndex;
+		}
+	private:
+		void SkipFree() {
+			while (this->_m_iIndex < this->_m_lpMap->_m_iCapacity && this->_m_lpMap->_m_lpControl[this->_m_iIndex] < 0) ++this->_m_iIndex;
+		}
+
+		const CHashMap* _m_lpMap;
+		functional_unsigned_size_t _m_iIndex;
+	};
+
+	explicit CHashMap(_In_opt_ const _Allocator& _Alloc = _Allocator()) : _Allocator(_Alloc) {
+		this->_m_lpControl = Q_nullptr;
+		this->_m_lpSlots = Q_nullptr;
+		this->_m_iSize = this->_m_iCapacity = this->_m_iGrowthLeft = 0;
+	}
+
+	CHashMap(_In_ CHashMap&& _Other) noexcept : _Allocator(move(static_cast<_Allocator&>(_Other))) {
+		this->_m_lpControl = _Other._m_lpControl;
+		this->_m_lpSlots = _Other._m_lpSlots;
+		this->_m_iSize = _Other._m_iSize;
+		this->_m_iCapacity = _Other._m_iCapacity;
+		this->_m_iGrowthLeft = _Other._m_iGrowthLeft;
+		_Other._m_lpControl = Q_nullptr;
+		_Other._m_lpSlots = Q_nullptr;
+		_Other._m_iSize = _Other._m_iCapacity = _Other._m_iGrowthLeft = 0;
+	}
+
+	CHashMap& operator=(_In_ CHashMap&& _Other) noexcept {
+		if (this != &_Other) {
+			this->Destroy();
+			static_cast<_Allocator&>(*this) = move(static_cast<_Allocator&>(_Other));
+			this->_m_lpControl = _Other._m_lpControl;
+			this->_m_lpSlots = _Other._m_lpSlots;
+			this->_m_iSize = _Other._m_iSize;
+			this->_m_iCapacity = _Other._m_iCapacity;
+			this->_m_iGrowthLeft = _Other._m_iGrowthLeft;
+			_Other._m_lpControl = Q_nullptr;
+			_Other._m_lpSlots = Q_nullptr;
+			_Other._m_iSize = _Other._m_iCapacity = _Other._m_iGrowthLeft = 0;
+		}
+
+		return *this;
+	}
+
+	~CHashMap() {
+		this->Destroy();
+	}
+
+	//Returns a pointer to the value stored under _Key or Q_nullptr. _Lookup may be any type _Hasher can hash and compare with _Key.
+	template<class _Lookup> _Value* find(_In_ const _Lookup& _KeyToFind) const {
+		const functional_size_t index = this->FindIndex(_KeyToFind, _Hasher::Hash(_KeyToFind));
+		return index >= 0 ? &this->_m_lpSlots[index].m_Value : Q_nullptr;
+	}
+
+	template<class _Lookup> Q_bool contains(_In_ const _Lookup& _KeyToFind) const {
+		return this->find(_KeyToFind) ? Q_TRUE : Q_FALSE;
+	}
+
+	//Constructs the value in place only if _Key isn't present yet. Returns the value stored under _Key either way.
+	template<class _KeyArg, class... _Args> _Value* try_emplace(_In_ _KeyArg&& _KeyToInsert, _In_opt_ _Args&&... _Arguments) {
+		const functional_uint64_t hash = _Hasher::Hash(_KeyToInsert);
+		const functional_size_t index = this->FindIndex(_KeyToInsert, hash);
+		if (index >= 0) return &this->_m_lpSlots[index].m_Value;
+
+		return this->InsertNew(hash, forward<_KeyArg>(_KeyToInsert), forward<_Args>(_Arguments)...);
+	}
+
+	template<class _KeyArg, class _ValueArg> _Value* insert_or_assign(_In_ _KeyArg&& _KeyToInsert, _In_ _ValueArg&& _ValueToInsert) {
+		const functional_uint64_t hash = _Hasher::Hash(_KeyToInsert);
+		const functional_size_t index = this->FindIndex(_KeyToInsert, hash);
+		if (index >= 0) {
+			this->_m_lpSlots[index].m_Value = forward<_ValueArg>(_ValueToInsert);
+			return &this->_m_lpSlots[index].m_Value;
+		}
+
+		return this->InsertNew(hash, forward<_KeyArg>(_KeyToInsert), forward<_ValueArg>(_ValueToInsert));
+	}
+
+	template<class _KeyArg> _Value& operator[](_In_ _KeyArg&& _KeyToFind) {
+		return *this->try_emplace(forward<_KeyArg>(_KeyToFind));
+	}
+
+	//Erased slots become empty again unless some probe sequence could have walked past them, so tombstones stay rare.
+	template<class _Lookup> Q_bool erase(_In_ const _Lookup& _KeyToErase) {
+		const functional_size_t index = this->FindIndex(_KeyToErase, _Hasher::Hash(_KeyToErase));
+		if (index < 0) return Q_FALSE;
+
+		this->_m_lpSlots[index].~CSlot();
+		--this->_m_iSize;
+
+		const functional_unsigned_size_t indexBefore = (index - CHashMapGroup::m_iWidth) & (this->_m_iCapacity - 1);
+		const auto emptyAfter = CHashMapGroup(this->_m_lpControl + index).MaskEmpty();
+		const auto emptyBefore = CHashMapGroup(this->_m_lpControl + indexBefore).MaskEmpty();
+		const bool wasNeverFull = emptyBefore && emptyAfter && CHashMapGroup::TrailingCount(emptyAfter) + CHashMapGroup::LeadingCount(emptyBefore) < CHashMapGroup::m_iWidth;
+
+		this->SetControl(index, wasNeverFull ? CHashMapGroup::m_iEmpty : CHashMapGroup::m_iDeleted);
+		if (wasNeverFull) ++this->_m_iGrowthLeft;
+
+		return Q_TRUE;
+	}
+
+	//Makes sure _Count elements fit without rehashing.
+	void reserve(_In_ functional_unsigned_size_t _Count) {
+		if (_Count <= this->_m_iSize + this->_m_iGrowthLeft) return;
+
+		this->Resize(NormalizeCapacity(_Count));
+	}
+
+	void clear() {
+		for (functional_unsigned_size_t idx = 0; idx < this->_m_iCapacity; idx++) {
+			if (this->_m_lpControl[idx] >= 0) this->_m_lpSlots[idx].~CSlot();
+		}
+		if (this->_m_iCapacity) Q_memset(this->_m_lpControl, static_cast<unsigned char>(CHashMapGroup::m_iEmpty), static_cast<unsigned int>(this->_m_iCapacity + CHashMapGroup::m_iWidth));
+		this->_m_iSize = 0;
+		this->_m_iGrowthLeft = CapacityToGrowth(this->_m_iCapacity);
+	}
+
+	functional_unsigned_size_t size() const {
+		return this->_m_iSize;
+	}
+
+	Q_bool empty() const {
+		return this->_m_iSize == 0 ? Q_TRUE : Q_FALSE;
+	}
+
+	functional_unsigned_size_t capacity() const {
+		return this->_m_iCapacity;
+	}
+
+	CIterator begin() const {
+		return CIterator(this, 0);
+	}
+
+	CIterator end() const {
+		return CIterator(this, this->_m_iCapacity);
+	}
+private:
+	CHashMap(CHashMap const&);
+	CHashMap& operator=(CHashMap const&);
+
+	//Max load factor is 7/8.
+	static functional_unsigned_size_t CapacityToGrowth(_In_ functional_unsigned_size_t _Capacity) {
+		return _Capacity - _Capacity / 8;
+	}
+
+	static functional_unsigned_size_t NormalizeCapacity(_In_ functional_unsigned_size_t _Count) {
+		functional_unsigned_size_t capacity = CHashMapGroup::m_iWidth;
+		while (CapacityToGrowth(capacity) < _Count) capacity *= 2;
+		return capacity;
+	}
+
+	//Control bytes come first (with a copy of the first group appended, so a group can be loaded at any index), slots follow.
+	static functional_unsigned_size_t SlotsOffset(_In_ functional_unsigned_size_t _Capacity) {
+		return (_Capacity + CHashMapGroup::m_iWidth + alignof(CSlot) - 1) & ~(alignof(CSlot) - 1);
+	}
+
+	static functional_unsigned_size_t AllocationSize(_In_ functional_unsigned_size_t _Capacity) {
+		return SlotsOffset(_Capacity) + _Capacity * sizeof(CSlot);
+	}
+
+	void SetControl(_In_ functional_unsigned_size_t _Index, _In_ signed char _Control) {
+		this->_m_lpControl[_Index] = _Control;
+		if (_Index < CHashMapGroup::m_iWidth) this->_m_lpControl[this->_m_iCapacity + _Index] = _Control;
+	}
+
+	template<class _Lookup> functional_size_t FindIndex(_In_ const _Lookup& _KeyToFind, _In_ functional_uint64_t _Hash) const {
+		if (!this->_m_iCapacity) return -1;
+
+		const functional_unsigned_size_t mask = this->_m_iCapacity - 1;
+		const signed char h2 = static_cast<signed char>(_Hash & 0x7F);
+		functional_unsigned_size_t offset = static_cast<functional_unsigned_size_t>(_Hash >> 7) & mask, step = 0;
+
+		while (true) {
+			const CHashMapGroup group(this->_m_lpControl + offset);
+			for (auto match = group.Match(h2); match; match &= match - 1) {
+				const functional_unsigned_size_t index = (offset + CHashMapGroup::LowestIndex(match)) & mask;
+				if (_Hasher::Equals(this->_m_lpSlots[index].m_Key, _KeyToFind)) return static_cast<functional_size_t>(index);
+			}
+			if (group.MaskEmpty()) return -1;
+
+			//Triangular steps over whole groups visit every group of a power of two table.
+			step += CHashMapGroup::m_iWidth;
+			offset = (offset + step) & mask;
+		}
+	}
+
+	functional_unsigned_size_t FindInsertIndex(_In_ functional_uint64_t _Hash) const {
+		const functional_unsigned_size_t mask = this->_m_iCapacity - 1;
+		functional_unsigned_size_t offset = static_cast<functional_unsigned_size_t>(_Hash >> 7) & mask, step = 0;
+
+		while (true) {
+			const auto free = CHashMapGroup(this->_m_lpControl + offset).MaskEmptyOrDeleted();
+			if (free) return (offset + CHashMapGroup::LowestIndex(free)) & mask;
+
+			step += CHashMapGroup::m_iWidth;
+			offset = (offset + step) & mask;
+		}
+	}
+
+	template<class... _Args> _Value* InsertNew(_In_ functional_uint64_t _Hash, _In_ _Args&&... _Arguments) {
+		functional_unsigned_size_t index = 0;
+		if (this->_m_iCapacity) index = this->FindInsertIndex(_Hash);
+
+		if (!this->_m_iCapacity || (this->_m_iGrowthLeft == 0 && this->_m_lpControl[index] != CHashMapGroup::m_iDeleted)) {
+			//Mostly tombstones? Rehash in place to drop them instead of growing.
+			if (this->_m_iCapacity && this->_m_iSize < CapacityToGrowth(this->_m_iCapacity) / 2) this->Resize(this->_m_iCapacity);
+			else this->Resize(this->_m_iCapacity ? this->_m_iCapacity * 2 : CHashMapGroup::m_iWidth);
+			index = this->FindInsertIndex(_Hash);
+		}
+
+		if (this->_m_lpControl[index] != CHashMapGroup::m_iDeleted) --this->_m_iGrowthLeft;
+		this->SetControl(index, static_cast<signed char>(_Hash & 0x7F));
+		CSlot* slot = new (INewWrapper(), &this->_m_lpSlots[index]) CSlot(forward<_Args>(_Arguments)...);
+		++this->_m_iSize;
+
+		return &slot->m_Value;
+	}
+
+	void Resize(_In_ functional_unsigned_size_t _Capacity) {
+		signed char* oldControl = this->_m_lpControl;
+		CSlot* oldSlots = this->_m_lpSlots;
+		const functional_unsigned_size_t oldCapacity = this->_m_iCapacity;
+
+		auto memory = static_cast<char*>(this->_Allocator::Allocate(AllocationSize(_Capacity)));
+		Q_ASSERT(memory && "Failed to allocate table at CHashMap::Resize");
+		this->_m_lpControl = reinterpret_cast<signed char*>(memory);
+		this->_m_lpSlots = reinterpret_cast<CSlot*>(memory + SlotsOffset(_Capacity));
+		this->_m_iCapacity = _Capacity;
+		Q_memset(this->_m_lpControl, static_cast<unsigned char>(CHashMapGroup::m_iEmpty), static_cast<unsigned int>(_Capacity + CHashMapGroup::m_iWidth));
+
+		for (functional_unsigned_size_t idx = 0; idx < oldCapacity; idx++) {
+			if (oldControl[idx] < 0) continue;
+
+			CSlot& old = oldSlots[idx];
+			const functional_uint64_t hash = _Hasher::Hash(old.m_Key);
+			const functional_unsigned_size_t index = this->FindInsertIndex(hash);
+			this->SetControl(index, static_cast<signed char>(hash & 0x7F));
+			new (INewWrapper(), &this->_m_lpSlots[index]) CSlot(move(old.m_Key), move(old.m_Value));
+			old.~CSlot();
+		}
+
+		this->_m_iGrowthLeft = CapacityToGrowth(_Capacity) - this->_m_iSize;
+		if (oldControl) this->_Allocator::Free(oldControl, AllocationSize(oldCapacity));
+	}
+
+	void Destroy() {
+		if (!this->_m_lpControl) return;
+
+		for (functional_unsigned_size_t idx = 0; idx < this->_m_iCapacity; idx++) {
+			if (this->_m_lpControl[idx] >= 0) this->_m_lpSlots[idx].~CSlot();
+		}
+		this->_Allocator::Free(this->_m_lpControl, AllocationSize(this->_m_iCapacity));
+		this->_m_lpControl = Q_nullptr;
+		this->_m_lpSlots = Q_nullptr;
+		this->_m_iSize = this->_m_iCapacity = this->_m_iGrowthLeft = 0;
+	}
+
+	signed char* _m_lpControl;
+	CSlot* _m_lpSlots;
+	functional_unsigned_size_t _m_iSize, _m_iCapacity, _m_iGrowthLeft;
+};
+
+//What Q_allocator_replay measured. Time is in CPU cycles (Q_read_cycle_counter) spent inside Q_malloc/Q_free/Q_realloc only.
+typedef struct CAllocatorReplayReport {
+	functional_unsigned_size_t m_iOperations;
+	//Calls that returned Q_nullptr although the trace says they succeeded.
+	functional_unsigned_size_t m_iFailed;
+	//Frees of blocks allocated before the trace started &c.
+	functional_unsigned_size_t m_iSkipped;
+	functional_uint64_t m_iCycles;
+	//Peak of the bytes the trace asked for and hadn't freed yet.
+	functional_unsigned_size_t m_iPeakLiveBytes;
+	//Only filled with our own CAllocator, FUNCTIONAL_NO_ALLOCATOR backends can't be looked into.
+	Q_bool m_bHasStatistics;
+	CAllocatorStatistics m_Final;
+	double m_flWorstFragmentation;
+
+	double CyclesPerOperation() const {
+		return this->m_iOperations ? static_cast<double>(this->m_iCycles) / static_cast<double>(this->m_iOperations) : 0.0;
 	}
+} CAllocatorReplayReport;
+
+#ifndef FUNCTIONAL_ALLOCATOR_REPLAY_SAMPLE
+#define FUNCTIONAL_ALLOCATOR_REPLAY_SAMPLE 4096
+#endif //FUNCTIONAL_ALLOCATOR_REPLAY_SAMPLE
+
+//Feeds recorded calls back through whatever backend this build uses, so traces from production can A/B allocator policies.
+//Fragmentation is sampled every FUNCTIONAL_ALLOCATOR_REPLAY_SAMPLE calls (outside the timed part). Blocks still live at the end are freed.
+//The bookkeeping map allocates too, but outside the timed calls.
+void Q_allocator_replay(_In_reads_(_Count) const CAllocationRecord* _Records, _In_ functional_unsigned_size_t _Count, _Out_ CAllocatorReplayReport& _Report) {
+	struct CBlock {
+		void* m_lpPointer;
+		functional_unsigned_size_t m_iSize;
+	};
 
-	template<class... _Ts> _Success_(return >= 0) functional_size_t Q_sprintf(_Always_(_Post_z_) _Out_ char* const _Buffer,
-		_Printf_format_string_ _In_z_ const char* const _Format, _In_opt_ _Ts... _Args) {
-		Q_SLOWASSERT(_Buffer && "Q_sprintf: Where do you want me to store the output string?");
-		Q_SLOWASSERT(_Format && "Q_sprintf: What should I print into your buffer?");
-		if constexpr (sizeof...(_Args) > 0) {
-			CParameterPackExpander* expander = Q_new(CParameterPackExpander)();
-			Q_pp_start(expander, _Args);
+	Q_memset(&_Report, 0, sizeof(_Report));
+	CHashMap<functional_uint64_t, CBlock> live;
+	functional_unsigned_size_t liveBytes = 0;
+#ifdef FUNCTIONAL_ALLOCATOR_TRACE
+	const Q_bool suspended = gs_AllocationTrace.m_bSuspended;
+	gs_AllocationTrace.m_bSuspended = Q_TRUE;
+#endif //FUNCTIONAL_ALLOCATOR_TRACE
+
+	auto sample = [&_Report]() {
+		_Report.m_bHasStatistics = Q_allocator_statistics(_Report.m_Final);
+		const double fragmentation = _Report.m_Final.Fragmentation();
+		if (fragmentation > _Report.m_flWorstFragmentation) _Report.m_flWorstFragmentation = fragmentation;
+	};
 
-			auto p = const_cast<char*>(&_Format[0]);
-			int fmtCnt = 0;
-			for (; p[0] != '\0'; ++p) {
-				if (p[0] == '%') fmtCnt++;
+	for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) {
+		const CAllocationRecord& record = _Records[idx];
+		CBlock* old = record.m_iOldPointer ? live.find(record.m_iOldPointer) : Q_nullptr;
+		functional_uint64_t start = 0;
+
+		switch (record.m_Op) {
+		case Q_ALLOCATION_MALLOC: {
+			if (!record.m_iPointer) {
+				_Report.m_iSkipped++;
+				continue;
+			}
+			start = Q_read_cycle_counter();
+			void* block = Q_malloc(record.m_iSize);
+			_Report.m_iCycles += Q_read_cycle_counter() - start;
+			if (!block) {
+				_Report.m_iFailed++;
+				break;
 			}
-			//Handling the case when not all arguments are present, i.e there are too much format specifiers but not enough args to format the string
-			if (fmtCnt > sizeof...(_Args)) {
-				Q_strcpy(_Buffer, "Q_sprintf: Not all arguments are present.\n");
-				Q_pp_end(expander);
-				return sizeof("Q_sprintf: Not all arguments are present.\n") - 1;
+			live.insert_or_assign(record.m_iPointer, CBlock{ block, record.m_iSize });
+			liveBytes += record.m_iSize;
+		}
+				break;
+		case Q_ALLOCATION_FREE: {
+			CBlock* block = live.find(record.m_iPointer);
+			if (!block) {
+				_Report.m_iSkipped++;
+				continue;
 			}
-
-			p = const_cast<char*>(&_Format[0]);
-
-			int writtenChars = 0;
-
-			const auto buffer = static_cast<char*>(Q_malloc(2048));
-			for (; p[0] != '\0'; ++p, ++writtenChars) {
-				if (p[0] == '%') {
-					p++;
-					switch (p[0]) {
-					case '.': {
-						++p;
-						functional_size_t count = 0;
-						if (p[0] == '*') {
-							count = expander->at<functional_size_t>(expander->m_iCurrentArg);
-							++expander->m_iCurrentArg;
-							++p;
-						}
-						char* countBuffer = reinterpret_cast<char*>(Q_malloc(3));
-						Q_memset(countBuffer, 0, 3);
-						if (!count) {
-							for (functional_size_t idx = 0; p[0] != 'f' && idx < 3; ++p, idx++) {
-								countBuffer[idx] = p[0];
-							}
-							countBuffer[2] = '\0';
-							count = Q_atoi(countBuffer);
-							Q_free(countBuffer);
-						}
-						const auto it = expander->at<float>(expander->m_iCurrentArg);
-						const char* converted = Q_ftoa(it, count);
-						if (it < 1.f) Q_strcat(buffer, "0");
-						Q_strcat(buffer, converted);
-						if (it < 1.f) writtenChars++;
-						writtenChars += Q_strlen(converted);
-						++expander->m_iCurrentArg;
-						++p;
-					}
-							break;
-					case 'o': {
-						const auto it = Q_integer_to_octal(expander->at<functional_size_t>(expander->m_iCurrentArg));
-						const char* converted = Q_itoa(it);
-						Q_strcat(buffer, converted);
-						writtenChars += Q_strlen(converted);
-						++expander->m_iCurrentArg;
-						++p;
-					}
-							break;
-					case 'u':
-					case 'i':
-					case 'd': {
-						const auto it = expander->at<functional_size_t>(expander->m_iCurrentArg);
-						const char* converted = Q_itoa(it);
-						Q_strcat(buffer, converted);
-						writtenChars += Q_strlen(converted);
-						++expander->m_iCurrentArg;
-						++p;
-					}
-							break;
-					case 'f': {
-						const auto it = expander->at<float>(expander->m_iCurrentArg);
-						const char* converted = Q_ftoa(it, 6);
-						if (it < 1.f) Q_strcat(buffer, "0");
-						Q_strcat(buffer, converted);
-						if (it < 1.f) writtenChars++;
-						writtenChars += Q_strlen(converted);
-						++expander->m_iCurrentArg;
-						++p;
-					}
-							break;
-					case 'c': {
-						buffer[writtenChars] = expander->at<char>(expander->m_iCurrentArg);
-						++writtenChars;
-						++expander->m_iCurrentArg;
-						++p;
-					}
-							break;
-					case 'x': {
-						if (const auto num = expander->at<functional_uintptr_t>(expander->m_iCurrentArg)) {
-							const char* str = Q_itohexa(num);
-							writtenChars += Q_strlen(str);
-							Q_strcat(buffer, str);
-						} else {
-							writtenChars += sizeof("0x0") - 1;
-							Q_strcat(buffer, "0x0");
-						}
-						++expander->m_iCurrentArg;
-						++p;
-					}
-							break;
-					case 'X': {
-						if (const auto num = expander->at<functional_uintptr_t>(expander->m_iCurrentArg)) {
-							const char* str = Q_itohexa_upper(num);
-							writtenChars += Q_strlen(str);
-							Q_strcat(buffer, str);
-						} else {
-							writtenChars += sizeof("0x0") - 1;
-							Q_strcat(buffer, "0x0");
-						}
-						++expander->m_iCurrentArg;
-						++p;
-					}
-							break;
-					case 's': {
-						const auto str = expander->at<const char*>(expander->m_iCurrentArg);
-						writtenChars += Q_strlen(str);
-						Q_strcat(buffer, str);
-						++expander->m_iCurrentArg;
-						++p;
-					}
-							break;
-					case 'p': {
-						if (const auto addr = reinterpret_cast<functional_uintptr_t>(expander->at<void*>(expander->m_iCurrentArg))) {
-							const char* str = Q_itohexa(addr);
-							writtenChars += Q_strlen(str);
-							Q_strcat(buffer, str);
-						}
-						else {
-							writtenChars += sizeof("(null)") - 1;
-							Q_strcat(buffer, "(null)");
-						}
-						++expander->m_iCurrentArg;
-						++p;
-					}
-							break;
-					default: {
-						buffer[writtenChars] = p[0];
-						++writtenChars;
-						++p;
-					}
-						   break;
-					}
-				}
-				buffer[writtenChars] = p[0];
+			start = Q_read_cycle_counter();
+			Q_free(block->m_lpPointer);
+			_Report.m_iCycles += Q_read_cycle_counter() - start;
+			liveBytes -= block->m_iSize;
+			live.erase(record.m_iPointer);
+		}
+				break;
+		case Q_ALLOCATION_REALLOC: {
+			start = Q_read_cycle_counter();
+			void* block = Q_realloc(old ? old->m_lpPointer : Q_nullptr, record.m_iSize);
+			_Report.m_iCycles += Q_read_cycle_counter() - start;
+			//A zero sized realloc is a free.
+			if (!block && record.m_iSize) {
+				_Report.m_iFailed++;
+				break;
+			}
+			if (old) {
+				liveBytes -= old->m_iSize;
+				live.erase(record.m_iOldPointer);
 			}
+			if (block) {
+				live.insert_or_assign(record.m_iPointer, CBlock{ block, record.m_iSize });
+				liveBytes += record.m_iSize;
+			}
+		}
+				break;
+		default:
+			_Report.m_iSkipped++;
+			continue;
+		}
 
-			buffer[writtenChars + 1] = '\0';
+		_Report.m_iOperations++;
+		if (liveBytes > _Report.m_iPeakLiveBytes) _Report.m_iPeakLiveBytes = liveBytes;
+		if (!(_Report.m_iOperations % FUNCTIONAL_ALLOCATOR_REPLAY_SAMPLE)) sample();
+	}
+	sample();
 
-			Q_memcpy(_Buffer, buffer, Q_strlen(buffer) + 1);
-			Q_pp_end(expander);
-			Q_free(buffer);
+	for (auto& slot : live) Q_free(slot.m_Value.m_lpPointer);
+#ifdef FUNCTIONAL_ALLOCATOR_TRACE
+	gs_AllocationTrace.m_bSuspended = suspended;
+#endif //FUNCTIONAL_ALLOCATOR_TRACE
+}
 
-			return writtenChars;
-	} else {
-			if (_Format) {
-				const auto toWrite = Q_strlen(_Format);
-				_Buffer[toWrite + 1] = '\0';
-				Q_memcpy(_Buffer, _Format, toWrite);
-				return toWrite;
-			}
+//Whether an object may be moved to another address with a plain memcpy (and the old copy forgotten without running its destructor).
+//CVector grows such types with Q_realloc instead of move + destroy loops. Specialize it for your own types where it holds.
+template<class _Ty> struct is_trivially_relocatable : integral_constant<bool, __is_trivially_copyable(_Ty)> {};
+template<> struct is_trivially_relocatable<CString> : true_type {};
+template<class _Ty, class _Deleter> struct is_trivially_relocatable<CUniquePointer<_Ty, _Deleter>> : integral_constant<bool, __is_trivially_copyable(_Deleter)> {};
+template<class _Ty, class _Policy> struct is_trivially_relocatable<CSharedPointer<_Ty, _Policy>> : true_type {};
+template<class _Ty, class _Policy> struct is_trivially_relocatable<CWeakPointer<_Ty, _Policy>> : true_type {};
+template<class _Ty> struct is_trivially_relocatable<CIntrusivePointer<_Ty>> : true_type {};
+
+template<class _Ty> inline constexpr bool is_trivially_relocatable_v = is_trivially_relocatable<_Ty>::value;
+
+template<class _Ty, functional_unsigned_size_t _Capacity> struct CVectorInlineStorage {
+	_Ty* Data() const {
+		return reinterpret_cast<_Ty*>(const_cast<unsigned char*>(this->_m_acBuffer));
+	}
+private:
+	alignas(_Ty) unsigned char _m_acBuffer[_Capacity * sizeof(_Ty)];
+};
+
+template<class _Ty> struct CVectorInlineStorage<_Ty, 0> {
+	_Ty* Data() const {
+		return Q_nullptr;
+	}
+};
+
+//Contiguous dynamic array with geometric growth. With _InlineCapacity > 0 the first elements live inside the object itself (see CSmallVector).
+template<class _Ty, class _Allocator = CDefaultAllocator, functional_unsigned_size_t _InlineCapacity = 0> struct CVector : private _Allocator {
+	explicit CVector(_In_opt_ const _Allocator& _Alloc = _Allocator()) : _Allocator(_Alloc) {
+		this->_m_lpData = this->_m_Inline.Data();
+		this->_m_iSize = 0;
+		this->_m_iCapacity = _InlineCapacity;
+	}
+
+	CVector(_In_ const CVector& _Other) : _Allocator(static_cast<const _Allocator&>(_Other)) {
+		this->_m_lpData = this->_m_Inline.Data();
+		this->_m_iSize = 0;
+		this->_m_iCapacity = _InlineCapacity;
+		this->reserve(_Other._m_iSize);
+		for (functional_unsigned_size_t idx = 0; idx < _Other._m_iSize; idx++) new (INewWrapper(), &this->_m_lpData[idx]) _Ty(_Other._m_lpData[idx]);
+		this->_m_iSize = _Other._m_iSize;
+	}
+
+	CVector(_In_ CVector&& _Other) noexcept : _Allocator(move(static_cast<_Allocator&>(_Other))) {
+		this->_m_lpData = this->_m_Inline.Data();
+		this->_m_iSize = 0;
+		this->_m_iCapacity = _InlineCapacity;
+		this->TakeFrom(_Other);
+	}
+
+	CVector& operator=(_In_ const CVector& _Other) {
+		if (this != &_Other) {
+			CVector copy(_Other);
+			*this = move(copy);
 		}
 
-		return -1;
+		return *this;
 	}
-}
 
-/*CString::CString(_In_z_ char* _Which) {
-	Q_ASSERT(_Which && "Expected a non-null string at CString::CString(char*)");
-	this->_m_iLength = Q_strlen(_Which);
-	this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(this->_m_iLength + 1));
-	Q_strcpy(this->_m_lp_cStorage, _Which);
-	this->_m_lp_cStorage[this->_m_iLength + 1] = '\0';
-}*/
+	CVector& operator=(_In_ CVector&& _Other) noexcept {
+		if (this != &_Other) {
+			this->Destroy();
+			static_cast<_Allocator&>(*this) = move(static_cast<_Allocator&>(_Other));
+			this->TakeFrom(_Other);
+		}
 
-CString::CString(_In_z_ const char* _Which) {
-	Q_ASSERT(_Which && "Expected a non-null string at CString::CString(const char*)");
-	this->_m_iLength = Q_strlen(_Which);
-	this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(this->_m_iLength + 1));
-	Q_strcpy(this->_m_lp_cStorage, _Which);
-	this->_m_lp_cStorage[this->_m_iLength + 1] = '\0';
-}
+		return *this;
+	}
 
-CString::CString(_In_ functional_unsigned_size_t _Length) : _m_iLength(_Length) {
-	Q_ASSERT(_Length > 0 && "Expected positive _Length at CString::CString(functional_unsigned_size_t)");
-	this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(_Length + 1));
-	this->_m_lp_cStorage[_Length + 1] = '\0';
-}
+	~CVector() {
+		this->Destroy();
+	}
 
-CString::~CString() {
-	if (this->_m_lp_cStorage) Q_free(this->_m_lp_cStorage);
-	this->_m_iLength = 0;
-}
+	template<class... _Args> _Ty& emplace_back(_In_opt_ _Args&&... _Arguments) {
+		if (this->_m_iSize == this->_m_iCapacity) {
+			//The arguments may point into our own storage, so build the element before the storage moves.
+			_Ty element(forward<_Args>(_Arguments)...);
+			this->Grow(this->_m_iSize + 1);
+			return *new (INewWrapper(), &this->_m_lpData[this->_m_iSize++]) _Ty(move(element));
+		}
 
-CString& CString::operator=(_In_z_ const char* _String) {
-	Q_ASSERT(_String && "Expected a non-null string.");
-	this->_m_iLength = Q_strlen(_String);
+		return *new (INewWrapper(), &this->_m_lpData[this->_m_iSize++]) _Ty(forward<_Args>(_Arguments)...);
+	}
 
-	if (this->_m_lp_cStorage) {
-		Q_free(this->_m_lp_cStorage);
+	void push_back(_In_ const _Ty& _Element) {
+		this->emplace_back(_Element);
 	}
 
-	this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(this->_m_iLength + 1));
+	void push_back(_In_ _Ty&& _Element) {
+		this->emplace_back(move(_Element));
+	}
 
-	Q_strcpy(this->_m_lp_cStorage, _String);
-	this->_m_lp_cStorage[this->_m_iLength + 1] = '\0';
+	void pop_back() {
+		Q_ASSERT(this->_m_iSize && "CVector::pop_back: the vector is empty");
+		this->_m_lpData[--this->_m_iSize].~_Ty();
+	}
 
-	return *this;
-}
+	//Keeps the order of the remaining elements.
+	void erase(_In_ functional_unsigned_size_t _Index) {
+		Q_ASSERT(_Index < this->_m_iSize && "CVector::erase: index out of range");
+		for (functional_unsigned_size_t idx = _Index; idx + 1 < this->_m_iSize; idx++) this->_m_lpData[idx] = move(this->_m_lpData[idx + 1]);
+		this->pop_back();
+	}
 
-CString& CString::operator=(_In_ char _Character) {
-	this->_m_iLength = 1;
+	//O(1): the last element takes the place of the erased one.
+	void erase_unordered(_In_ functional_unsigned_size_t _Index) {
+		Q_ASSERT(_Index < this->_m_iSize && "CVector::erase_unordered: index out of range");
+		if (_Index + 1 != this->_m_iSize) this->_m_lpData[_Index] = move(this->_m_lpData[this->_m_iSize - 1]);
+		this->pop_back();
+	}
 
-	if (this->_m_lp_cStorage) {
-		Q_free(this->_m_lp_cStorage);
+	void reserve(_In_ functional_unsigned_size_t _Capacity) {
+		if (_Capacity > this->_m_iCapacity) this->Reallocate(_Capacity);
 	}
 
-	this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(2));
+	//New elements are value-initialized.
+	void resize(_In_ functional_unsigned_size_t _Size) {
+		if (_Size > this->_m_iCapacity) this->Grow(_Size);
+		while (this->_m_iSize < _Size) new (INewWrapper(), &this->_m_lpData[this->_m_iSize++]) _Ty();
+		while (this->_m_iSize > _Size) this->_m_lpData[--this->_m_iSize].~_Ty();
+	}
 
-	this->_m_lp_cStorage[0] = _Character;
-	this->_m_lp_cStorage[1] = '\0';
+	void clear() {
+		while (this->_m_iSize) this->_m_lpData[--this->_m_iSize].~_Ty();
+	}
 
-	return *this;
-}
+	_Ty& operator[](_In_ functional_unsigned_size_t _Index) {
+		Q_SLOWASSERT(_Index < this->_m_iSize && "CVector::operator[]: index out of range");
+		return this->_m_lpData[_Index];
+	}
 
-CString& CString::operator+=(_In_z_ const char* _String) {
-	Q_ASSERT(_String && "Expected a non-null string. To add a character into CString, refer to CString#operator+=(char)");
-	this->_m_iLength += Q_strlen(_String);
+	const _Ty& operator[](_In_ functional_unsigned_size_t _Index) const {
+		Q_SLOWASSERT(_Index < this->_m_iSize && "CVector::operator[]: index out of range");
+		return this->_m_lpData[_Index];
+	}
 
-	if (this->_m_lp_cStorage) {
-		Q_realloc(this->_m_lp_cStorage, this->_m_iLength + 1);
+	_Ty& front() {
+		Q_ASSERT(this->_m_iSize && "CVector::front: the vector is empty");
+		return this->_m_lpData[0];
 	}
-	else {
-		this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(this->_m_iLength + 1));
+
+	_Ty& back() {
+		Q_ASSERT(this->_m_iSize && "CVector::back: the vector is empty");
+		return this->_m_lpData[this->_m_iSize - 1];
 	}
 
-	Q_strcat(this->_m_lp_cStorage, _String);
-	this->_m_lp_cStorage[this->_m_iLength + 1] = '\0';
+	_Ty* data() const {
+		return this->_m_lpData;
+	}
 
-	return *this;
-}
+	functional_unsigned_size_t size() const {
+		return this->_m_iSize;
+	}
 
-CString& CString::operator+=(_In_ char _Character) {
-	this->_m_iLength++;
+	functional_unsigned_size_t capacity() const {
+		return this->_m_iCapacity;
+	}
 
-	if (this->_m_lp_cStorage) {
-		Q_realloc(this->_m_lp_cStorage, this->_m_iLength + 1);
+	Q_bool empty() const {
+		return this->_m_iSize == 0 ? Q_TRUE : Q_FALSE;
 	}
-	else {
-		this->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(this->_m_iLength + 1));
+
+	_Ty* begin() const {
+		return this->_m_lpData;
 	}
 
-	this->_m_lp_cStorage[this->_m_iLength - 1] = _Character;
-	this->_m_lp_cStorage[this->_m_iLength] = '\0';
+	_Ty* end() const {
+		return this->_m_lpData + this->_m_iSize;
+	}
+private:
+	Q_bool IsInline() const {
+		return (_InlineCapacity && this->_m_lpData == this->_m_Inline.Data()) ? Q_TRUE : Q_FALSE;
+	}
 
-	return *this;
-}
+	void Grow(_In_ functional_unsigned_size_t _MinCapacity) {
+		functional_unsigned_size_t capacity = this->_m_iCapacity ? this->_m_iCapacity * 2 : (16 / sizeof(_Ty) ? 16 / sizeof(_Ty) : 1);
+		if (capacity < _MinCapacity) capacity = _MinCapacity;
+		this->Reallocate(capacity);
+	}
 
-CString& CString::operator+(_In_z_ const char* _Other) {
-	Q_ASSERT(_Other && "Expected a non-null string. To add a character into CString, refer to CString#operator+(char)");
-	CString* result = Q_new(CString)(this->_m_iLength + Q_strlen(_Other));
+	void Reallocate(_In_ functional_unsigned_size_t _Capacity) {
+		if constexpr (is_trivially_relocatable_v<_Ty>) {
+			//Heap to heap moves of relocatable types are a plain realloc, which often grows the block in place.
+			if (!this->IsInline()) {
+				_Ty* data = static_cast<_Ty*>(this->_Allocator::Reallocate(this->_m_lpData, this->_m_iCapacity * sizeof(_Ty), _Capacity * sizeof(_Ty)));
+				Q_ASSERT(data && "Failed to allocate storage at CVector::Reallocate");
+				this->_m_lpData = data;
+				this->_m_iCapacity = this->UsableCapacity(data, _Capacity);
+				return;
+			}
+		}
 
-	Q_strcat(result->_m_lp_cStorage, this->_m_lp_cStorage);
-	Q_strcat(result->_m_lp_cStorage, _Other);
-	result->_m_lp_cStorage[result->_m_iLength + 1] = '\0';
+		_Ty* data = static_cast<_Ty*>(this->_Allocator::Allocate(_Capacity * sizeof(_Ty)));
+		Q_ASSERT(data && "Failed to allocate storage at CVector::Reallocate");
+		for (functional_unsigned_size_t idx = 0; idx < this->_m_iSize; idx++) {
+			new (INewWrapper(), &data[idx]) _Ty(move(this->_m_lpData[idx]));
+			this->_m_lpData[idx].~_Ty();
+		}
+		if (!this->IsInline() && this->_m_lpData) this->_Allocator::Free(this->_m_lpData, this->_m_iCapacity * sizeof(_Ty));
+		this->_m_lpData = data;
+		this->_m_iCapacity = this->UsableCapacity(data, _Capacity);
+	}
 
-	return *result;
-}
+	//Whole elements that fit in what the allocator really gave us.
+	functional_unsigned_size_t UsableCapacity(_In_ _Ty* _Data, _In_ functional_unsigned_size_t _Capacity) {
+		return Q_allocator_usable_size(static_cast<_Allocator&>(*this), _Data, _Capacity * sizeof(_Ty), 0) / sizeof(_Ty);
+	}
 
-CString& CString::operator+(_In_ char _Character) {
-	CString* result = Q_new(CString)(this->_m_iLength + 1);
+	//Steals _Other's heap block, or moves its elements one by one when they're stored inline.
+	void TakeFrom(_Inout_ CVector& _Other) {
+		if (_Other.IsInline()) {
+			for (functional_unsigned_size_t idx = 0; idx < _Other._m_iSize; idx++) new (INewWrapper(), &this->_m_lpData[idx]) _Ty(move(_Other._m_lpData[idx]));
+			this->_m_iSize = _Other._m_iSize;
+			_Other.clear();
+			return;
+		}
 
-	Q_strcat(result->_m_lp_cStorage, this->_m_lp_cStorage);
-	result->_m_lp_cStorage[this->_m_iLength] = _Character;
-	result->_m_lp_cStorage[result->_m_iLength + 1] = '\0';
+		this->_m_lpData = _Other._m_lpData;
+		this->_m_iSize = _Other._m_iSize;
+		this->_m_iCapacity = _Other._m_iCapacity;
+		_Other._m_lpData = _Other._m_Inline.Data();
+		_Other._m_iSize = 0;
+		_Other._m_iCapacity = _InlineCapacity;
+	}
 
-	return *result;
-}
+	void Destroy() {
+		this->clear();
+		if (!this->IsInline() && this->_m_lpData) this->_Allocator::Free(this->_m_lpData, this->_m_iCapacity * sizeof(_Ty));
+		this->_m_lpData = this->_m_Inline.Data();
+		this->_m_iCapacity = _InlineCapacity;
+	}
 
-template<class... _Ts> _Success_(return != Q_nullptr) CString& CString::Format(_Printf_format_string_ _In_z_ const char* const _Format, _In_opt_ _Ts... _Args) {
-	CString* result = Q_new(CString)();
-	result->_m_lp_cStorage = reinterpret_cast<char*>(Q_malloc(2048));
-	result->_m_iLength = sprintf(result->_m_lp_cStorage, _Format, _Args...) + 1;
-	Q_realloc(result->_m_lp_cStorage, result->_m_iLength);
+	_Ty* _m_lpData;
+	functional_unsigned_size_t _m_iSize, _m_iCapacity;
+	CVectorInlineStorage<_Ty, _InlineCapacity> _m_Inline;
+};
 
-	return *result;
-}
+//CVector whose first _InlineCapacity elements don't touch the heap at all.
+template<class _Ty, functional_unsigned_size_t _InlineCapacity, class _Allocator = CDefaultAllocator> using CSmallVector = CVector<_Ty, _Allocator, _InlineCapacity>;
 
-Q_bool CString::operator==(_In_ CString& _Rhs) {
-	return (Q_strcmp(this->_m_lp_cStorage, _Rhs._m_lp_cStorage) == 0) ? Q_TRUE : Q_FALSE;
-}
+//A string owned by a CStringInterner. Two handles are equal exactly when their pointers are, and the hash is stored next to the characters.
+typedef struct CInternedString {
+	CInternedString() : _m_lpszString(Q_nullptr) {}
 
-Q_bool CString::operator==(_In_ const char* _Rhs) {
-	return (Q_strcmp(this->_m_lp_cStorage, _Rhs) == 0) ? Q_TRUE : Q_FALSE;
-}
+	explicit CInternedString(_In_opt_z_ const char* _Interned) : _m_lpszString(_Interned) {}
 
-Q_bool CString::operator!=(_In_ CString& _Rhs) {
-	return (Q_strcmp(this->_m_lp_cStorage, _Rhs._m_lp_cStorage) != 0) ? Q_TRUE : Q_FALSE;
-}
+	const char* c_str() const {
+		return this->_m_lpszString;
+	}
 
-Q_bool CString::operator!=(_In_ const char* _Rhs) {
-	return (Q_strcmp(this->_m_lp_cStorage, _Rhs) != 0) ? Q_TRUE : Q_FALSE;
-}
+	functional_unsigned_size_t length() const {
+		return this->_m_lpszString ? Header()->m_iLength : 0;
+	}
+
+	functional_uint64_t hash() const {
+		return this->_m_lpszString ? Header()->m_iHash : Q_hash_bytes(Q_nullptr, 0);
+	}
 
+	Q_bool operator==(_In_ const CInternedString& _Rhs) const {
+		return this->_m_lpszString == _Rhs._m_lpszString ? Q_TRUE : Q_FALSE;
+	}
+
+	Q_bool operator!=(_In_ const CInternedString& _Rhs) const {
+		return this->_m_lpszString != _Rhs._m_lpszString ? Q_TRUE : Q_FALSE;
+	}
+
+	//Lives right before the characters of every interned string.
+	struct CHeader {
+		functional_uint64_t m_iHash;
+		functional_unsigned_size_t m_iLength;
+	};
+
+	const CHeader* Header() const {
+		return reinterpret_cast<const CHeader*>(this->_m_lpszString) - 1;
+	}
+private:
+	const char* _m_lpszString;
+} CInternedString;
+
+template<> struct CHasher<CInternedString> {
+	static functional_uint64_t Hash(_In_ const CInternedString& _Key) {
+		return _Key.hash();
+	}
+
+	static Q_bool Equals(_In_ const CInternedString& _Lhs, _In_ const CInternedString& _Rhs) {
+		return _Lhs == _Rhs;
+	}
+};
+
+//Stores every distinct string once, in append-only arena chunks, so interned strings never move or die before the interner.
+//Lookups never lock: the open addressing table is only ever published whole (old tables are retired, not freed, until destruction),
+//and slots are filled once with a release store. Inserting threads serialize on a spin lock.
 //Non-copyable
-template<class _Ty> struct CUniquePointer {
-	explicit CUniquePointer(_In_opt_ _Ty* _Pointer = Q_nullptr) {
-		this->_m_lpStorage = _Pointer;
+typedef struct CStringInterner {
+	CStringInterner(_In_opt_ functional_unsigned_size_t _ExpectedCount = 64) : _m_Arena(FUNCTIONAL_ARENA_CHUNK_SIZE) {
+		functional_unsigned_size_t capacity = 16;
+		while (capacity < _ExpectedCount * 2) capacity *= 2;
+		this->_m_lpTable = CTable::Create(capacity, Q_nullptr);
+		this->_m_iCount = 0;
 	}
 
-	~CUniquePointer() {
-		Q_delete(this->_m_lpStorage);
-		this->_m_lpStorage = Q_nullptr;
+	~CStringInterner() {
+		CTable* table = this->_m_lpTable;
+		while (table) {
+			CTable* retired = table->m_lpRetired;
+			Q_free(table);
+			table = retired;
+		}
 	}
 
-	_Ty& operator*() const {
-		Q_ASSERT(this->_m_lpStorage);
-		return *this->_m_lpStorage;
+	CInternedString Intern(_In_reads_(_Length) const char* _String, _In_ functional_unsigned_size_t _Length) {
+		Q_ASSERT((_String || !_Length) && "Expected a non-null string at CStringInterner::Intern");
+		const functional_uint64_t hash = Q_hash_bytes(_String, _Length);
+
+		if (const char* found = Find(Q_atomic_load(&this->_m_lpTable), _String, _Length, hash)) return CInternedString(found);
+
+		this->_m_Lock.Lock();
+		//Somebody could have inserted it while we were waiting for the lock.
+		CTable* table = this->_m_lpTable;
+		const char* result = Find(table, _String, _Length, hash);
+		if (!result) {
+			if ((this->_m_iCount + 1) * 2 > table->m_iCapacity) {
+				table = this->Grow(table);
+			}
+
+			auto header = static_cast<CInternedString::CHeader*>(this->_m_Arena.Allocate(sizeof(CInternedString::CHeader) + _Length + 1, alignof(CInternedString::CHeader)));
+			Q_ASSERT(header && "Failed to allocate string at CStringInterner::Intern");
+			header->m_iHash = hash;
+			header->m_iLength = _Length;
+			char* characters = reinterpret_cast<char*>(header + 1);
+			Q_memcpy(characters, _String, static_cast<unsigned int>(_Length));
+			characters[_Length] = '\0';
+
+			Insert(table, characters, hash);
+			++this->_m_iCount;
+			result = characters;
+		}
+		this->_m_Lock.Unlock();
+
+		return CInternedString(result);
 	}
 
-	_Ty* operator->() const {
-		Q_ASSERT(this->_m_lpStorage);
-		return this->_m_lpStorage;
+	CInternedString Intern(_In_z_ const char* _String) {
+		Q_ASSERT(_String && "Expected a non-null string at CStringInterner::Intern");
+		return this->Intern(_String, Q_strlen(_String));
 	}
 
-	_Ty* get() const {
-		return this->_m_lpStorage;
+	CInternedString Intern(_In_ const CString& _String) {
+		return this->Intern(_String.c_str(), _String.length());
 	}
 
-	void reset() {
-		Q_delete(this->_m_lpStorage);
-		this->_m_lpStorage = Q_nullptr;
+	//Never inserts. Returns an empty handle when the string wasn't interned yet.
+	CInternedString Lookup(_In_reads_(_Length) const char* _String, _In_ functional_unsigned_size_t _Length) const {
+		return CInternedString(Find(Q_atomic_load(&this->_m_lpTable), _String, _Length, Q_hash_bytes(_String, _Length)));
+	}
+
+	CInternedString Lookup(_In_z_ const char* _String) const {
+		return this->Lookup(_String, Q_strlen(_String));
+	}
+
+	functional_unsigned_size_t size() const {
+		return Q_atomic_load_relaxed(&this->_m_iCount);
 	}
 private:
-	_Ty* _m_lpStorage;
+	CStringInterner(CStringInterner const&);
+	CStringInterner& operator=(CStringInterner const&);
 
-	CUniquePointer(CUniquePointer const&);
-	CUniquePointer& operator=(CUniquePointer const&);
+	struct CSlot {
+		functional_uint64_t m_iHash;
+		const char* volatile m_lpszString;
+	};
 
-	void operator==(CUniquePointer const&) const;
-	void operator!=(CUniquePointer const&) const;
-};
+	struct CTable {
+		static CTable* Create(_In_ functional_unsigned_size_t _Capacity, _In_opt_ CTable* _Retired) {
+			auto table = static_cast<CTable*>(Q_malloc(sizeof(CTable) + _Capacity * sizeof(CSlot)));
+			Q_ASSERT(table && "Failed to allocate table at CStringInterner");
+			table->m_iCapacity = _Capacity;
+			table->m_lpRetired = _Retired;
+			Q_memset(table->Slots(), 0, static_cast<unsigned int>(_Capacity * sizeof(CSlot)));
+			return table;
+		}
 
-template<class _Ty, class... _Ts> CUniquePointer<_Ty> make_unique(_In_opt_ _Ts&&... _Args) {
-	return CUniquePointer<_Ty>(Q_new(_Ty)(forward<_Ts>(_Args)...));
-}
+		CSlot* Slots() {
+			return reinterpret_cast<CSlot*>(this + 1);
+		}
 
-//The CString type is defined after our namespace which is defined a bit later than CParameterPackExpander. (refer to Q_ASSERT)
-template<class _ResultType> _ResultType& CParameterPackExpander::at(_In_ functional_size_t _Where) {
-	Q_ASSERT(_Where < this->m_iArgsSize);
-	_ResultType& _Which = (_ResultType&)(*static_cast<_ResultType*>(this->m_a_lpTotalArgs[_Where]));
+		functional_unsigned_size_t m_iCapacity;
+		CTable* m_lpRetired;
+	};
 
-	return _Which;
-}
+	//Linear probing; slots are never removed, so an empty slot ends the search.
+	static const char* Find(_In_ CTable* _Table, _In_reads_(_Length) const char* _String, _In_ functional_unsigned_size_t _Length, _In_ functional_uint64_t _Hash) {
+		const functional_unsigned_size_t mask = _Table->m_iCapacity - 1;
+		CSlot* slots = _Table->Slots();
+
+		for (functional_unsigned_size_t idx = static_cast<functional_unsigned_size_t>(_Hash) & mask;; idx = (idx + 1) & mask) {
+			const char* candidate = Q_atomic_load(&slots[idx].m_lpszString);
+			if (!candidate) return Q_nullptr;
+			if (slots[idx].m_iHash == _Hash && CInternedString(candidate).length() == _Length && Q_memcmp(candidate, _String, _Length) == 0) return candidate;
+		}
+	}
+
+	static void Insert(_In_ CTable* _Table, _In_z_ const char* _Interned, _In_ functional_uint64_t _Hash) {
+		const functional_unsigned_size_t mask = _Table->m_iCapacity - 1;
+		CSlot* slots = _Table->Slots();
+
+		functional_unsigned_size_t idx = static_cast<functional_unsigned_size_t>(_Hash) & mask;
+		while (slots[idx].m_lpszString) idx = (idx + 1) & mask;
+
+		//The hash has to be visible before the pointer that makes the slot live.
+		slots[idx].m_iHash = _Hash;
+		Q_atomic_store(&slots[idx].m_lpszString, _Interned);
+	}
+
+	CTable* Grow(_In_ CTable* _Table) {
+		CTable* table = CTable::Create(_Table->m_iCapacity * 2, _Table);
+		CSlot* slots = _Table->Slots();
+		for (functional_unsigned_size_t idx = 0; idx < _Table->m_iCapacity; idx++) {
+			if (slots[idx].m_lpszString) Insert(table, slots[idx].m_lpszString, slots[idx].m_iHash);
+		}
+		Q_atomic_store(&this->_m_lpTable, table);
+
+		return table;
+	}
+
+	CTable* volatile _m_lpTable;
+	volatile functional_unsigned_size_t _m_iCount;
+	CSpinLock _m_Lock;
+	CArena _m_Arena;
+} CStringInterner;
+
+//Weighted choice of an index in [0, count) in O(1) per draw: Walker's alias method, built with Vose's stable O(n) construction.
+//Every column is one index plus one alias, one 64 bit draw picks the column (upper half of the product) and the side (lower half).
+typedef struct CDiscreteDistribution {
+	CDiscreteDistribution(_In_reads_(_Count) const double* _Weights, _In_ functional_unsigned_size_t _Count) {
+		Q_ASSERT(_Count && _Count <= 0xFFFFFFFF && "CDiscreteDistribution: bad weight count");
+
+		double total = 0.0;
+		for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) {
+			Q_SLOWASSERT(_Weights[idx] >= 0.0 && "CDiscreteDistribution: negative weight");
+			total += _Weights[idx];
+		}
+		Q_ASSERT(total > 0.0 && "CDiscreteDistribution: all weights are zero");
+
+		this->_m_Threshold.resize(_Count);
+		this->_m_Alias.resize(_Count);
+
+		CVector<double> scaled;
+		CVector<functional_uint32_t> small, large;
+		scaled.resize(_Count);
+		small.reserve(_Count);
+		large.reserve(_Count);
+
+		for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) {
+			scaled[idx] = _Weights[idx] * static_cast<double>(_Count) / total;
+			(scaled[idx] < 1.0 ? small : large).push_back(static_cast<functional_uint32_t>(idx));
+		}
+
+		while (!small.empty() && !large.empty()) {
+			const functional_uint32_t less = small.back(), more = large.back();
+			small.pop_back();
+
+			this->SetColumn(less, scaled[less], more);
+			scaled[more] = (scaled[more] + scaled[less]) - 1.0;
+			if (scaled[more] < 1.0) {
+				large.pop_back();
+				small.push_back(more);
+			}
+		}
+
+		//Whatever is left is 1 up to rounding.
+		for (functional_uint32_t idx : large) this->SetColumn(idx, 1.0, idx);
+		for (functional_uint32_t idx : small) this->SetColumn(idx, 1.0, idx);
+	}
+
+	template<class _Engine> functional_unsigned_size_t operator()(_Inout_ _Engine& _Generator) const {
+		functional_uint64_t column = 0;
+		const functional_uint64_t side = Q_mul128(Q_random_bits(_Generator), this->_m_Threshold.size(), column);
+
+		return side < this->_m_Threshold[column] ? static_cast<functional_unsigned_size_t>(column) : this->_m_Alias[column];
+	}
+
+	template<class _Engine> void Fill(_Inout_ _Engine& _Generator, _Out_writes_(_Count) functional_unsigned_size_t* _Output, _In_ functional_unsigned_size_t _Count) const {
+		for (functional_unsigned_size_t idx = 0; idx < _Count; idx++) _Output[idx] = (*this)(_Generator);
+	}
+
+	functional_unsigned_size_t size() const {
+		return this->_m_Threshold.size();
+	}
+private:
+	void SetColumn(_In_ functional_uint32_t _Column, _In_ double _Probability, _In_ functional_uint32_t _Alias) {
+		//Probability 1 can't be expressed as a 64 bit threshold, the alias points back at the column instead.
+		this->_m_Threshold[_Column] = _Probability >= 1.0 ? ~0ull : static_cast<functional_uint64_t>(_Probability * 0x1p64);
+		this->_m_Alias[_Column] = _Probability >= 1.0 ? _Column : _Alias;
+	}
+
+	CVector<functional_uint64_t> _m_Threshold;
+	CVector<functional_uint32_t> _m_Alias;
+} CDiscreteDistribution;
 
 #else //__cplusplus
 #error C++ compiler required to compile functional.hpp.
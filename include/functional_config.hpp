@@ -35,6 +35,30 @@
 //Default: 2 * 1024 * 1024 * 512
 #define FUNCTIONAL_BLOCK_SIZE 4096
 //Default: 4096
+#define FUNCTIONAL_ARENA_CHUNK_SIZE 64 * 1024
+//Default size of a CArena chunk. Bigger requests get a chunk of their own.
+//Default: 64 * 1024
+#define FUNCTIONAL_CONSTEXPR_SEED 0
+//Mixed into Q_CONSTEXPR_SEED(), so RandomNumber/RandomSeed and the constexpr tables change when you change it.
+//Default: 0
+#define FUNCTIONAL_FUNCTION_INLINE_SIZE 32
+//Captures up to this many bytes are stored inside a CFunction, bigger ones are Q_malloc'd.
+//Default: 32
+#define FUNCTIONAL_STRING_BUILDER_CHUNK_SIZE 64 * 1024
+//How many bytes CStringBuilder buffers before handing them to its flush callback (if it has one).
+//Default: 64 * 1024
+#define FUNCTIONAL_WRITER_BUFFER_SIZE 8 * 1024
+//Size of the buffer inside every CWriter (Q_stdout and Q_stderr included). Must be at least FUNCTIONAL_SPRINTF_BUFFER_SIZE.
+//Default: 8 * 1024
+#define FUNCTIONAL_CACHE_LINE_SIZE 64
+//What our concurrent structures pad and align to, so the producer and the consumer side never share a line (128 on Apple silicon).
+//Default: 64
+#define FUNCTIONAL_LOG_RING_SIZE 64 * 1024
+//Default ring size of every CLogger producer, a power of two and at least four records.
+//Default: 64 * 1024
+#define FUNCTIONAL_LOG_RECORD_SIZE 4 * 1024
+//Largest CLogger message before formatting: the format pointer, 24 bytes per argument and the copied strings. Longer strings are cut.
+//Default: 4 * 1024
 
 //#define FUNCTIONAL_NO_ALLOCATOR
 //if FUNCTIONAL_NO_ALLOCATOR is defined, you must introduce your own Q_malloc and Q_free functions using FUNCTIONAL_CUSTOM_MALLOC and FUNCTIONAL_CUSTOM_FREE defines.
@@ -42,6 +66,68 @@
 //#define FUNCTIONAL_CUSTOM_MALLOC malloc
 //#define FUNCTIONAL_CUSTOM_FREE free
 //#define FUNCTIONAL_CUSTOM_REALLOC realloc
+//#define FUNCTIONAL_CUSTOM_MALLOC_USABLE_SIZE malloc_usable_size
+//Optional. Without it Q_malloc_usable_size returns 0 under FUNCTIONAL_NO_ALLOCATOR.
+//#define FUNCTIONAL_CUSTOM_FREE_SIZED free_sized
+//Optional. Q_free_sized goes to FUNCTIONAL_CUSTOM_FREE without it.
+
+//#define FUNCTIONAL_ALLOCATOR_HUGE_PAGES
+//Align the pool to FUNCTIONAL_HUGE_PAGE_SIZE so it can be backed by transparent huge pages (fewer TLB misses over the pool).
+//With FUNCTIONAL_USE_LINUX_SYSCALLS we also madvise(MADV_HUGEPAGE) it before the first touch.
+//Default: undefined
+#define FUNCTIONAL_HUGE_PAGE_SIZE 2 * 1024 * 1024
+//Default: 2 * 1024 * 1024
+#define FUNCTIONAL_PAGE_SIZE 4096
+//Smallest page the OS hands out, Q_allocator_maintain only decommits whole ones (16 * 1024 on Apple silicon).
+//Default: 4096
+
+//#define FUNCTIONAL_ALLOCATOR_DECOMMIT(_Pointer, _Size) my_decommit(_Pointer, _Size)
+//Used by Q_allocator_maintain to give a free tail of the pool back to the page source (MADV_DONTNEED with FUNCTIONAL_USE_LINUX_SYSCALLS).
+//Evaluates to 0 on success. The range is page aligned, it must stay accessible and read as zero afterwards.
+//Default: undefined
+
+//#define FUNCTIONAL_ALLOCATOR_GUARD
+//Hardened CAllocator for debug builds and canary hosts: every header carries a keyed canary that also encodes its state,
+//blocks get a red zone behind them, freed blocks wait in a quarantine ring (poisoned) before they're reused.
+//Catches double frees, frees of foreign pointers, overflows into the red zone or the next header and writes after free.
+//Default: undefined
+#define FUNCTIONAL_ALLOCATOR_REDZONE_SIZE 16
+//Default: 16
+#define FUNCTIONAL_ALLOCATOR_QUARANTINE_SIZE 256
+//How many freed blocks are held back.
+//Default: 256
+//#define FUNCTIONAL_ALLOCATOR_GUARD_FAILED(_Reason, _Pointer) my_report(_Reason, _Pointer)
+//Called on a detected violation, the default stores _Reason as the assertion failure reason and crashes.
+//Default: undefined
+
+//#define FUNCTIONAL_ALLOCATOR_TRACE
+//Record every Q_malloc/Q_free/Q_realloc into a ring buffer that's drained to the callback you pass to Q_allocator_trace.
+//Feed the records to Q_allocator_replay later to benchmark them against another build.
+//Default: undefined
+#define FUNCTIONAL_ALLOCATOR_TRACE_SIZE 4096
+//Records buffered between two drains.
+//Default: 4096
+#define FUNCTIONAL_ALLOCATOR_REPLAY_SAMPLE 4096
+//Q_allocator_replay samples the fragmentation every this many calls.
+//Default: 4096
+
+//#define FUNCTIONAL_ALLOCATOR_RELOCATABLE
+//Link CAllocator's segments by offsets into the pool instead of pointers, so a Q_allocator_snapshot image can be restored
+//wherever the pool ends up in the next process (ASLR). Costs an add per link access.
+//Default: undefined
+
+#define FUNCTIONAL_ALLOCATOR_HEAP_COUNT 1
+//How many CAllocator heaps there are, each with its own FUNCTIONAL_HEAP_SIZE pool and spin lock (e.g one per NUMA node).
+//A thread allocates from FUNCTIONAL_ALLOCATOR_CURRENT_HEAP() (Q_allocator_set_thread_heap by default) and spills to the others when
+//it's full, frees go back to the heap owning the address. With 1 the allocator stays lock-free and single threaded.
+//Default: 1
+//#define FUNCTIONAL_ALLOCATOR_CURRENT_HEAP() my_numa_node()
+//Your own heap selector, reduced modulo FUNCTIONAL_ALLOCATOR_HEAP_COUNT. The default one keeps the heap in a thread_local, which needs
+//the CRT's TLS support; with your own selector that variable and Q_allocator_set_thread_heap aren't compiled.
+//Default: undefined
+//#define FUNCTIONAL_ALLOCATOR_HEAP_BIND(_Heap, _Pointer, _Size) numa_tonode_memory(_Pointer, _Size, _Heap)
+//Called once per heap before its pool is touched, so you can bind it to a node. Without it first touch decides.
+//Default: undefined
 
 //#define FUNCTIONAL_USE_CPP_BOOL
 //Use inbuilt "bool" type instead of our Q_bool.
@@ -55,6 +141,31 @@
 //Don't use anonymous namespace: name it "functional" instead. (To call our functions you must add functional:: before the function name: functional::Q_sprintf)
 //Default: undefined
 
+//#define FUNCTIONAL_USE_SSE2
+//Use SSE2 intrinsics (includes the compiler's <emmintrin.h>, which isn't a CRT header) in our containers. E.g CHashMap probes 16 slots at once instead of 8.
+//Default: undefined
+
+//#define FUNCTIONAL_USE_AVX2
+//Use AVX2 intrinsics (includes the compiler's <immintrin.h>) where we have them, e.g the bulk random fills of CXoshiro256x8. Your compiler must target AVX2 too (-mavx2, /arch:AVX2).
+//Default: undefined
+
+//#define FUNCTIONAL_USE_LINUX_SYSCALLS
+//Let us call into the Linux kernel directly (x86_64 and aarch64): getrandom for Q_random_seed, write for Q_printf, madvise for the heap.
+//Default: undefined
+
+//#define FUNCTIONAL_STANDARD_WRITE(_Descriptor, _Data, _Size) (fwrite(_Data, 1, _Size, _Descriptor == 2 ? stderr : stdout) == _Size)
+//Where Q_stdout/Q_stderr (Q_printf) write to, evaluates to non-zero on success. Takes precedence over FUNCTIONAL_USE_LINUX_SYSCALLS,
+//without either the output is discarded.
+//Default: undefined
+
+//#define FUNCTIONAL_USE_RDRAND
+//Mix the RDRAND instruction into Q_random_seed. Your compiler must target it too (-mrdrnd).
+//Default: undefined
+
+//#define FUNCTIONAL_OS_ENTROPY(_Buffer, _Size) my_getrandom(_Buffer, _Size)
+//Your own entropy source for Q_random_seed. Takes precedence over FUNCTIONAL_USE_LINUX_SYSCALLS.
+//Default: undefined
+
 //#define FUNCTIONAL_USE_FASTEST_STRLEN
 //Use fastest strlen function, compares four bytes with zero instead of per-byte comparison
 //Default: undefined